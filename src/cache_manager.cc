@@ -4,6 +4,7 @@
 #include "indexer.h"
 #include "lsp.h"
 #include "platform.h"
+#include "work_thread.h"
 
 #include <loguru/loguru.hpp>
 
@@ -12,6 +13,90 @@
 
 namespace {
 
+// Maximum number of prefetched caches which are kept in memory waiting for an
+// indexer thread to request them.
+constexpr size_t kMaxPrefetchedCaches = 64;
+// How far ahead of the prefetch threads readahead hints are issued.
+constexpr size_t kReadaheadDistance = 16;
+
+std::string GetCachePath(const std::string& source_file) {
+  assert(!g_config->cacheDirectory.empty());
+  std::string cache_file;
+  size_t len = g_config->projectRoot.size();
+  if (StartsWith(source_file, g_config->projectRoot)) {
+    cache_file = GetCacheProjectDirectory() + '/' +
+                 EscapeFileName(source_file.substr(len));
+  } else {
+    cache_file =
+        '@' + GetCacheProjectDirectory() + '/' + EscapeFileName(source_file);
+  }
+
+  return g_config->cacheDirectory + cache_file;
+}
+
+// Calls |fn| on every path which is stored in the cache of |file|.
+void ForEachCachedPath(IndexFile& file,
+                       const std::function<void(std::string&)>& fn) {
+  fn(file.import_file.path);
+  for (AbsolutePath& dependency : file.dependencies)
+    fn(dependency.path);
+  for (IndexInclude& include : file.includes)
+    fn(include.resolved_path);
+}
+
+// Makes paths inside |root| relative to it.
+void MakeCachedPathsRelative(IndexFile& file, const std::string& root) {
+  ForEachCachedPath(file, [&](std::string& path) {
+    if (StartsWithDirectory(path, root))
+      path = path.substr(root.size());
+  });
+}
+
+// Resolves relative paths against |root|.
+void MakeCachedPathsAbsolute(IndexFile& file, const std::string& root) {
+  ForEachCachedPath(file, [&](std::string& path) {
+    if (!path.empty() && !IsAbsolutePath(path))
+      path = root + path;
+  });
+}
+
+std::string AppendSerializationFormat(const std::string& base) {
+  switch (g_config->cacheFormat) {
+    case SerializeFormat::Json:
+      return base + ".json";
+    case SerializeFormat::MessagePack:
+      return base + ".mpack";
+  }
+  assert(false);
+  return ".json";
+}
+
+// Issues readahead hints for the cache of |path|.
+void HintCache(const std::string& path) {
+  if (path.empty())
+    return;
+  std::string cache_path = GetCachePath(path);
+  HintFileWillBeRead(cache_path);
+  HintFileWillBeRead(AppendSerializationFormat(cache_path));
+}
+
+std::unique_ptr<IndexFile> LoadCacheFromDisk(const std::string& path) {
+  std::string cache_path = GetCachePath(path);
+  optional<std::string> file_content = ReadContent(cache_path);
+  optional<std::string> serialized_indexed_content =
+      ReadContent(AppendSerializationFormat(cache_path));
+  if (!file_content || !serialized_indexed_content)
+    return nullptr;
+
+  std::unique_ptr<IndexFile> file =
+      Deserialize(g_config->cacheFormat, path, *serialized_indexed_content,
+                  *file_content, IndexFile::kMajorVersion);
+  std::string root = GetRelocatableCacheRoot();
+  if (file && !root.empty())
+    MakeCachedPathsAbsolute(*file, root);
+  return file;
+}
+
 // Manages loading caches from file paths for the indexer process.
 struct RealCacheManager : ICacheManager {
   explicit RealCacheManager() {}
@@ -21,8 +106,19 @@ struct RealCacheManager : ICacheManager {
     std::string cache_path = GetCachePath(file.path);
     WriteToFile(cache_path, file.file_contents);
 
+    // |file| is still used after it has been written, so relocated paths are
+    // restored afterwards.
+    std::string root = GetRelocatableCacheRoot();
+    if (!root.empty())
+      MakeCachedPathsRelative(file, root);
     std::string indexed_content = Serialize(g_config->cacheFormat, file);
+    if (!root.empty())
+      MakeCachedPathsAbsolute(file, root);
     WriteToFile(AppendSerializationFormat(cache_path), indexed_content);
+
+    // A cache prefetched before this write would be used as the previous
+    // index of the file. Loads which start from now on read the new cache.
+    CachePrefetcher::instance()->Invalidate(file.path);
   }
 
   optional<std::string> LoadCachedFileContents(
@@ -31,41 +127,11 @@ struct RealCacheManager : ICacheManager {
   }
 
   std::unique_ptr<IndexFile> RawCacheLoad(const std::string& path) override {
-    std::string cache_path = GetCachePath(path);
-    optional<std::string> file_content = ReadContent(cache_path);
-    optional<std::string> serialized_indexed_content =
-        ReadContent(AppendSerializationFormat(cache_path));
-    if (!file_content || !serialized_indexed_content)
-      return nullptr;
-
-    return Deserialize(g_config->cacheFormat, path, *serialized_indexed_content,
-                       *file_content, IndexFile::kMajorVersion);
-  }
-
-  std::string GetCachePath(const std::string& source_file) {
-    assert(!g_config->cacheDirectory.empty());
-    std::string cache_file;
-    size_t len = g_config->projectRoot.size();
-    if (StartsWith(source_file, g_config->projectRoot)) {
-      cache_file = EscapeFileName(g_config->projectRoot) + '/' +
-                   EscapeFileName(source_file.substr(len));
-    } else {
-      cache_file = '@' + EscapeFileName(g_config->projectRoot) + '/' +
-                   EscapeFileName(source_file);
-    }
-
-    return g_config->cacheDirectory + cache_file;
-  }
-
-  std::string AppendSerializationFormat(const std::string& base) {
-    switch (g_config->cacheFormat) {
-      case SerializeFormat::Json:
-        return base + ".json";
-      case SerializeFormat::MessagePack:
-        return base + ".mpack";
-    }
-    assert(false);
-    return ".json";
+    std::unique_ptr<IndexFile> prefetched =
+        CachePrefetcher::instance()->TryTake(path);
+    if (prefetched)
+      return prefetched;
+    return LoadCacheFromDisk(path);
   }
 };
 
@@ -103,6 +169,20 @@ struct FakeCacheManager : ICacheManager {
 
 }  // namespace
 
+std::string GetCacheProjectDirectory() {
+  // Relocatable caches are shared by every checkout of the project, so they
+  // are keyed by name instead of by location.
+  if (!g_config->relocatableCacheKey.empty())
+    return '#' + EscapeFileName(g_config->relocatableCacheKey);
+  return EscapeFileName(g_config->projectRoot);
+}
+
+std::string GetRelocatableCacheRoot() {
+  if (g_config->relocatableCacheKey.empty())
+    return "";
+  return g_config->projectRoot;
+}
+
 // static
 std::shared_ptr<ICacheManager> ICacheManager::Make() {
   return std::make_shared<RealCacheManager>();
@@ -153,3 +233,148 @@ void ICacheManager::IterateLoadedCaches(std::function<void(IndexFile*)> fn) {
     fn(cache.second.get());
   }
 }
+
+// static
+CachePrefetcher* CachePrefetcher::instance() {
+  static CachePrefetcher* instance = new CachePrefetcher();
+  return instance;
+}
+
+void CachePrefetcher::Start(int num_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (num_threads <= 0 || num_threads_ > 0)
+    return;
+  num_threads_ = num_threads;
+  for (int i = 0; i < num_threads; ++i) {
+    WorkThread::StartThread("prefetch" + std::to_string(i),
+                            [this]() { ThreadMain(); });
+  }
+}
+
+void CachePrefetcher::Enqueue(const std::string& path) {
+  std::string hint;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (num_threads_ == 0 || !states_.emplace(path, State::kPending).second)
+      return;
+    pending_.push_back(path);
+    if (pending_.size() <= kReadaheadDistance)
+      hint = path;
+  }
+  cv_.notify_one();
+  HintCache(hint);
+}
+
+std::unique_ptr<IndexFile> CachePrefetcher::TryTake(const std::string& path) {
+  std::unique_ptr<IndexFile> result;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (num_threads_ == 0)
+      return nullptr;
+    ++num_takes_;
+    auto it = states_.find(path);
+    if (it == states_.end())
+      return nullptr;
+    // Erasing the state cancels a pending or in-flight load.
+    if (it->second == State::kReady) {
+      auto ready_it = ready_.find(path);
+      result = std::move(ready_it->second);
+      ready_.erase(ready_it);
+    }
+    states_.erase(it);
+  }
+  // A slot may have been freed up.
+  cv_.notify_all();
+  return result;
+}
+
+void CachePrefetcher::Invalidate(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (num_threads_ == 0)
+      return;
+    // Erasing the state cancels a pending or in-flight load, like in TryTake.
+    // The entry in |ready_order_| is skipped by EvictStaleNoLock.
+    states_.erase(path);
+    ready_.erase(path);
+  }
+  cv_.notify_all();
+}
+
+std::string CachePrefetcher::GetPendingNoLock(size_t index) const {
+  return index < pending_.size() ? pending_[index] : std::string();
+}
+
+void CachePrefetcher::EvictStaleNoLock() {
+  while (!ready_order_.empty()) {
+    const Ready& oldest = ready_order_.front();
+    auto it = ready_.find(oldest.path);
+    // Already taken, or taken and then loaded again.
+    if (it == ready_.end() || it->second.get() != oldest.file) {
+      ready_order_.pop_front();
+      continue;
+    }
+    if (num_takes_ - oldest.num_takes < int64_t(kMaxPrefetchedCaches))
+      return;
+    LOG_S(INFO) << "Dropping unused prefetched cache for " << oldest.path;
+    ready_.erase(it);
+    states_.erase(oldest.path);
+    ready_order_.pop_front();
+  }
+}
+
+void CachePrefetcher::ThreadMain() {
+  while (true) {
+    std::string path;
+    std::string hint;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() {
+        EvictStaleNoLock();
+        return !pending_.empty() && ready_.size() < kMaxPrefetchedCaches;
+      });
+      path = std::move(pending_.front());
+      pending_.pop_front();
+      // The batch of index requests has been prefetched. Caches of later
+      // requests may depend on the same files again, and the set would
+      // otherwise grow for the life of the process.
+      if (pending_.empty())
+        prefetched_dependencies_.clear();
+      // The cache has already been requested by an indexer thread.
+      auto it = states_.find(path);
+      if (it == states_.end() || it->second != State::kPending)
+        continue;
+      it->second = State::kLoading;
+      hint = GetPendingNoLock(kReadaheadDistance - 1);
+    }
+    HintCache(hint);
+
+    std::unique_ptr<IndexFile> cache = LoadCacheFromDisk(path);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = states_.find(path);
+      if (it == states_.end() || it->second != State::kLoading)
+        continue;
+      if (!cache) {
+        states_.erase(it);
+        continue;
+      }
+
+      it->second = State::kReady;
+
+      // Dependencies are validated right after the file itself, so load them
+      // before anything else.
+      for (const AbsolutePath& dependency : cache->dependencies) {
+        if (!prefetched_dependencies_.insert(dependency.path).second ||
+            !states_.emplace(dependency.path, State::kPending).second)
+          continue;
+        pending_.push_front(dependency.path);
+      }
+
+      ready_order_.push_back(Ready{path, cache.get(), num_takes_});
+      ready_[path] = std::move(cache);
+    }
+    cv_.notify_all();
+  }
+}
@@ -2,15 +2,28 @@
 
 #include <optional.h>
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct Config;
 struct IndexFile;
 
+// Name of the directory in |cacheDirectory| which holds the caches of files in
+// the project. Caches of files outside of the project are stored in the same
+// directory prefixed with '@'.
+std::string GetCacheProjectDirectory();
+
+// Returns |projectRoot| if caches are relocatable, or an empty string
+// otherwise. See Config::relocatableCacheKey.
+std::string GetRelocatableCacheRoot();
+
 struct ICacheManager {
   struct FakeCacheEntry {
     std::string path;
@@ -48,3 +61,61 @@ struct ICacheManager {
   virtual std::unique_ptr<IndexFile> RawCacheLoad(const std::string& path) = 0;
   std::unordered_map<std::string, std::unique_ptr<IndexFile>> caches_;
 };
+
+// Reads and deserializes caches on a small pool of I/O threads ahead of the
+// indexer threads which will request them. Indexer threads load caches one at
+// a time while validating timestamps; with prefetching most of those loads
+// find the cache already in memory.
+//
+// Prefetched caches are handed out by RealCacheManager::RawCacheLoad, so every
+// other cache consumer benefits transparently.
+struct CachePrefetcher {
+  static CachePrefetcher* instance();
+
+  // Starts |num_threads| prefetch threads. Does nothing if |num_threads| is not
+  // positive or the threads have already been started.
+  void Start(int num_threads);
+
+  // Queues the caches for |path| to be loaded. Requests are serviced in order,
+  // so this should be called in the same order the caches will be needed.
+  void Enqueue(const std::string& path);
+
+  // Returns the prefetched cache for |path| if it has been loaded. If the load
+  // is still pending it is cancelled, since the caller will read the cache
+  // itself.
+  std::unique_ptr<IndexFile> TryTake(const std::string& path);
+
+  // Drops the prefetched cache for |path| and cancels a pending or in-flight
+  // load, since the cache on disk is being replaced.
+  void Invalidate(const std::string& path);
+
+ private:
+  enum class State { kPending, kLoading, kReady };
+  struct Ready {
+    std::string path;
+    IndexFile* file;
+    // Value of |num_takes_| when the cache was loaded.
+    int64_t num_takes;
+  };
+
+  void ThreadMain();
+  // Returns the file at position |index| of |pending_|, or an empty string if
+  // there is none. Readahead hints for it are issued with HintCache outside of
+  // |mutex_|, since they open the cache files.
+  std::string GetPendingNoLock(size_t index) const;
+  // Drops the oldest loaded caches which have been skipped by many more
+  // recent TryTake calls; they are not going to be requested anymore.
+  void EvictStaleNoLock();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int num_threads_ = 0;
+  int64_t num_takes_ = 0;
+  std::deque<std::string> pending_;
+  std::deque<Ready> ready_order_;
+  std::unordered_map<std::string, State> states_;
+  std::unordered_map<std::string, std::unique_ptr<IndexFile>> ready_;
+  // Dependencies are shared by many files, so only prefetch them once per
+  // batch of requests. Cleared when |pending_| drains.
+  std::unordered_set<std::string> prefetched_dependencies_;
+};
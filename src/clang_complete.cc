@@ -2,7 +2,9 @@
 
 #include "clang_utils.h"
 #include "platform.h"
+#include "preamble_cache.h"
 #include "timer.h"
+#include "utils.h"
 #include "work_thread.h"
 
 #include <loguru.hpp>
@@ -386,6 +388,115 @@ void BuildDetailString(CXCompletionString completion_string,
   }
 }
 
+// Returns the text which is matched against what the user has typed.
+std::string GetTypedText(CXCompletionString completion_string) {
+  int num_chunks = clang_getNumCompletionChunks(completion_string);
+  for (int i = 0; i < num_chunks; ++i) {
+    if (clang_getCompletionChunkKind(completion_string, i) ==
+        CXCompletionChunk_TypedText) {
+      return ToString(clang_getCompletionChunkText(completion_string, i));
+    }
+  }
+  return "";
+}
+
+// Builds the label, detail and insert text of |item| from |result| and
+// appends the results to |out|.
+void BuildCompletionItem(const CXCompletionResult& result,
+                         lsCompletionItem item,
+                         std::vector<lsCompletionItem>* out) {
+  item.label.clear();
+  if (g_config->completion.detailedLabel) {
+    item.detail = ToString(
+        clang_getCompletionParent(result.CompletionString, nullptr));
+
+    auto first_idx = out->size();
+    out->push_back(std::move(item));
+
+    // label/filterText/insertText
+    BuildCompletionItemTexts(*out, result.CompletionString,
+                             g_config->completion.enableSnippets);
+
+    for (auto i = first_idx; i < out->size(); ++i) {
+      if (g_config->completion.enableSnippets &&
+          (*out)[i].insertTextFormat == lsInsertTextFormat::Snippet) {
+        (*out)[i].insertText += "$0";
+      }
+    }
+  } else {
+    bool do_insert = true;
+    int angle_stack = 0;
+    BuildDetailString(result.CompletionString, item.label, item.detail,
+                      item.insertText, do_insert, item.insertTextFormat,
+                      &item.parameters_, g_config->completion.enableSnippets,
+                      angle_stack);
+    assert(angle_stack == 0);
+    if (g_config->completion.enableSnippets &&
+        item.insertTextFormat == lsInsertTextFormat::Snippet) {
+      item.insertText += "$0";
+    }
+    out->push_back(std::move(item));
+  }
+}
+
+// Number of CompletionResults which are kept for completionItem/resolve
+// requests after their items have been resolved.
+constexpr int kMaxResolvableResults = 8;
+
+struct ResolvableResults {
+  std::mutex mutex;
+  LruCache<int, std::shared_ptr<CompletionResults>> results{
+      kMaxResolvableResults};
+};
+
+int NextCompletionResultsId() {
+  static std::atomic<int> next_id(0);
+  return ++next_id;
+}
+
+ResolvableResults* GetResolvableResults() {
+  static ResolvableResults* instance = new ResolvableResults();
+  return instance;
+}
+
+// Returns the existing files next to |path| with the same name and the
+// extension of a source file if |path| is a header, or of a header if |path| is
+// a source file, eg, foo.h for foo.cc.
+std::vector<std::string> GetPairedFiles(const std::string& path) {
+  static const std::vector<std::string> kHeaderExtensions = {".h", ".hh",
+                                                             ".hpp", ".hxx"};
+  static const std::vector<std::string> kSourceExtensions = {
+      ".cc", ".cpp", ".cxx", ".c", ".m", ".mm"};
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+    return {};
+  std::string stem = path.substr(0, dot);
+  std::string extension = path.substr(dot);
+  auto has_extension = [&](const std::vector<std::string>& extensions) {
+    return std::find(extensions.begin(), extensions.end(), extension) !=
+           extensions.end();
+  };
+
+  const std::vector<std::string>* paired_extensions;
+  if (has_extension(kHeaderExtensions))
+    paired_extensions = &kSourceExtensions;
+  else if (has_extension(kSourceExtensions))
+    paired_extensions = &kHeaderExtensions;
+  else
+    return {};
+  std::vector<std::string> ret;
+  for (const std::string& paired_extension : *paired_extensions) {
+    if (FileExists(stem + paired_extension))
+      ret.push_back(stem + paired_extension);
+  }
+  return ret;
+}
+
+// Number of recently edited files which an edited file is recorded as being
+// edited along with, and number of such files kept for each file.
+constexpr size_t kMaxRecentEdits = 4;
+constexpr size_t kMaxCoEditedFiles = 4;
+
 void TryEnsureDocumentParsed(ClangCompleteManager* manager,
                              std::shared_ptr<CompletionSession> session,
                              std::unique_ptr<ClangTranslationUnit>* tu,
@@ -407,13 +518,30 @@ void TryEnsureDocumentParsed(ClangCompleteManager* manager,
       {StripFileType(session->file.filename)});
   std::vector<CXUnsavedFile> unsaved = snapshot.AsUnsavedFiles();
 
+  // Start from the saved preamble of a previous run, if there is one.
+  if (g_config->completion.cachePreambles) {
+    for (const WorkingFiles::Snapshot::File& file : snapshot.files) {
+      if (file.filename != session->file.filename.path)
+        continue;
+      if (optional<std::vector<std::string>> preamble_args =
+              PreambleCache::instance()->Apply(session->file.filename, args,
+                                               ComputePreamble(file.content))) {
+        args = std::move(*preamble_args);
+      }
+      break;
+    }
+  }
+
   LOG_S(INFO) << "Creating completion session with arguments "
               << StringJoin(args, " ");
   *tu = ClangTranslationUnit::Create(index, session->file.filename, args,
                                      unsaved, Flags());
 
-  // Build diagnostics.
-  if (emit_diagnostics && g_config->diagnostics.onParse && *tu) {
+  // Build diagnostics. Files which are only preloaded speculatively are
+  // usually not open, so do not report their diagnostics. This is checked
+  // after parsing since the file may have been viewed in the meantime.
+  if (emit_diagnostics && !session->speculative &&
+      g_config->diagnostics.onParse && *tu) {
     // If we're emitting diagnostics, do an immediate reparse, otherwise we will
     // emit stale/bad diagnostics.
     *tu = ClangTranslationUnit::Reparse(std::move(*tu), unsaved);
@@ -453,192 +581,186 @@ void CompletionPreloadMain(ClangCompleteManager* completion_manager) {
     if (!session)
       continue;
 
-    // Note: we only preload completion. We emit diagnostics for the
-    // completion preload though.
-    CompletionSession::Tu* tu = &session->completion;
-
-    // If we've parsed it more recently than the request time, don't bother
-    // reparsing.
-    if (tu->last_parsed_at && *tu->last_parsed_at > request.request_time) {
-      continue;
+    CompletionSession::Tu* tu = &session->tu;
+    {
+      std::lock_guard<std::mutex> lock(tu->lock);
+      // If we've parsed it more recently than the request time, don't bother
+      // reparsing.
+      if (tu->last_parsed_at && *tu->last_parsed_at > request.request_time)
+        continue;
+      // Another worker is parsing the file; it parses it again once done.
+      if (tu->parsing) {
+        if (!tu->reparse_requested_at ||
+            *tu->reparse_requested_at < request.request_time)
+          tu->reparse_requested_at = request.request_time;
+        continue;
+      }
+      tu->parsing = true;
     }
 
-    std::unique_ptr<ClangTranslationUnit> parsing;
-    TryEnsureDocumentParsed(completion_manager, session, &parsing, &tu->index,
-                            true /*emit_diagnostics*/);
-
-    // Activate new translation unit.
-    std::lock_guard<std::mutex> lock(tu->lock);
-    tu->last_parsed_at = std::chrono::high_resolution_clock::now();
-    tu->tu = std::move(parsing);
+    while (true) {
+      auto started_at = std::chrono::high_resolution_clock::now();
+      std::unique_ptr<ClangTranslationUnit> parsing;
+      TryEnsureDocumentParsed(completion_manager, session, &parsing,
+                              &tu->index, true /*emit_diagnostics*/);
+
+      // Activate new translation unit, unless CompleteAt or the diagnostics
+      // thread built a newer one in the meantime.
+      std::lock_guard<std::mutex> lock(tu->lock);
+      if (!tu->last_parsed_at || *tu->last_parsed_at < started_at) {
+        tu->last_parsed_at = started_at;
+        tu->tu = std::move(parsing);
+        completion_manager->UpdateMemoryUsage(tu);
+      }
+      bool reparse = tu->reparse_requested_at &&
+                     *tu->reparse_requested_at > started_at;
+      tu->reparse_requested_at = nullopt;
+      if (!reparse) {
+        tu->parsing = false;
+        break;
+      }
+    }
   }
 }
 
-void CompletionQueryMain(ClangCompleteManager* completion_manager) {
-  while (true) {
-    // Fetching the completion request blocks until we have a request.
-    std::unique_ptr<ClangCompleteManager::CompletionRequest> request =
-        completion_manager->completion_request_.Dequeue();
-
-    // Drop older requests if we're not buffering.
-    while (g_config->completion.dropOldRequests &&
-           !completion_manager->completion_request_.IsEmpty()) {
-      completion_manager->on_dropped_(request->id);
-      request = completion_manager->completion_request_.Dequeue();
-    }
-
-    std::string path = request->path;
-
-    std::shared_ptr<CompletionSession> session =
-        completion_manager->TryGetSession(path, true /*mark_as_completion*/,
-                                          true /*create_if_needed*/);
-
-    // At this point, we must have a translation unit. Block until we have one.
-    std::lock_guard<std::mutex> lock(session->completion.lock);
-    Timer timer;
-    TryEnsureDocumentParsed(completion_manager, session,
-                            &session->completion.tu, &session->completion.index,
-                            false /*emit_diagnostics*/);
-    timer.ResetAndPrint("[complete] TryEnsureDocumentParsed");
-
-    // It is possible we failed to create the document despite
-    // |TryEnsureDocumentParsed|.
-    if (!session->completion.tu)
-      continue;
-
-    timer.Reset();
-    WorkingFiles::Snapshot snapshot =
-        completion_manager->working_files_->AsSnapshot({StripFileType(path)});
-    std::vector<CXUnsavedFile> unsaved = snapshot.AsUnsavedFiles();
-    timer.ResetAndPrint("[complete] Creating WorkingFile snapshot");
+void CompleteAt(ClangCompleteManager* completion_manager,
+                ClangCompleteManager::CompletionRequest* request) {
+  std::string path = request->path;
+
+  std::shared_ptr<CompletionSession> session =
+      completion_manager->TryGetSession(path, true /*mark_as_completion*/,
+                                        true /*create_if_needed*/);
+
+  // At this point, we must have a translation unit. Block until we have one.
+  std::lock_guard<std::mutex> lock(session->tu.lock);
+  Timer timer;
+  bool was_parsed = !!session->tu.tu;
+  auto started_at = std::chrono::high_resolution_clock::now();
+  TryEnsureDocumentParsed(completion_manager, session, &session->tu.tu,
+                          &session->tu.index, false /*emit_diagnostics*/);
+  timer.ResetAndPrint("[complete] TryEnsureDocumentParsed");
+
+  if (was_parsed != !!session->tu.tu) {
+    session->tu.last_parsed_at = started_at;
+    completion_manager->UpdateMemoryUsage(&session->tu);
+  }
+  // It is possible we failed to create the document despite
+  // |TryEnsureDocumentParsed|.
+  if (!session->tu.tu)
+    return;
 
-    // Language server is 0-based, clang is 1-based.
-    unsigned line = request->position.line + 1;
-    unsigned column = request->position.character + 1;
+  timer.Reset();
+  WorkingFiles::Snapshot snapshot =
+      completion_manager->working_files_->AsSnapshot({StripFileType(path)});
+  std::vector<CXUnsavedFile> unsaved = snapshot.AsUnsavedFiles();
+  timer.ResetAndPrint("[complete] Creating WorkingFile snapshot");
+
+  // Language server is 0-based, clang is 1-based.
+  unsigned line = request->position.line + 1;
+  unsigned column = request->position.character + 1;
+
+  timer.Reset();
+  // TODO: investigate using CXCodeComplete_SkipPreamble. Requires
+  // CINDEX_VERSION_MINOR >= 48.
+  unsigned const kCompleteOptions =
+      CXCodeComplete_IncludeMacros | CXCodeComplete_IncludeBriefComments;
+  CXCodeCompleteResults* cx_results = clang_codeCompleteAt(
+      session->tu.tu->cx_tu, session->file.filename.path.c_str(), line,
+      column, unsaved.data(), (unsigned)unsaved.size(), kCompleteOptions);
+  timer.ResetAndPrint("[complete] clangCodeCompleteAt");
+  if (!cx_results) {
+    request->on_complete(request->id, {}, false /*is_cached_result*/);
+    return;
+  }
 
-    timer.Reset();
-    // TODO: investigate using CXCodeComplete_SkipPreamble. Requires
-    // CINDEX_VERSION_MINOR >= 48.
-    unsigned const kCompleteOptions =
-        CXCodeComplete_IncludeMacros | CXCodeComplete_IncludeBriefComments;
-    CXCodeCompleteResults* cx_results = clang_codeCompleteAt(
-        session->completion.tu->cx_tu, session->file.filename.path.c_str(),
-        line, column, unsaved.data(), (unsigned)unsaved.size(),
-        kCompleteOptions);
-    timer.ResetAndPrint("[complete] clangCodeCompleteAt");
-    if (!cx_results) {
-      request->on_complete(request->id, {}, false /*is_cached_result*/);
+  // Only extract what is needed to filter and sort the results here. Most of
+  // them are filtered out, so the rest is built by ResolveCompletionItems for
+  // the ones which are sent to the client.
+  auto results = std::make_shared<CompletionResults>(cx_results);
+  std::vector<lsCompletionItem> ls_result;
+  ls_result.reserve(cx_results->NumResults);
+
+  timer.Reset();
+  for (unsigned i = 0; i < cx_results->NumResults; ++i) {
+    CXCompletionResult& result = cx_results->Results[i];
+
+    // TODO: Try to figure out how we can hide base method calls without
+    // also hiding method implementation assistance, ie,
+    //
+    //    void Foo::* {
+    //    }
+    //
+
+    if (clang_getCompletionAvailability(result.CompletionString) ==
+        CXAvailability_NotAvailable) {
       continue;
     }
 
-    std::vector<lsCompletionItem> ls_result;
-    // this is a guess but can be larger in case of optional parameters,
-    // as they may be expanded into multiple items
-    ls_result.reserve(cx_results->NumResults);
-
-    timer.Reset();
-    for (unsigned i = 0; i < cx_results->NumResults; ++i) {
-      CXCompletionResult& result = cx_results->Results[i];
-
-      // TODO: Try to figure out how we can hide base method calls without
-      // also hiding method implementation assistance, ie,
-      //
-      //    void Foo::* {
-      //    }
-      //
-
-      if (clang_getCompletionAvailability(result.CompletionString) ==
-          CXAvailability_NotAvailable) {
-        continue;
-      }
-
-      // TODO: fill in more data
-      lsCompletionItem ls_completion_item;
-
-      ls_completion_item.kind = GetCompletionKind(result.CursorKind);
-      ls_completion_item.documentation =
-          ToString(clang_getCompletionBriefComment(result.CompletionString));
-
-      // label/detail/filterText/insertText/priority
-      if (g_config->completion.detailedLabel) {
-        ls_completion_item.detail = ToString(
-            clang_getCompletionParent(result.CompletionString, nullptr));
-
-        auto first_idx = ls_result.size();
-        ls_result.push_back(ls_completion_item);
-
-        // label/filterText/insertText
-        BuildCompletionItemTexts(ls_result, result.CompletionString,
-                                 g_config->completion.enableSnippets);
-
-        for (auto i = first_idx; i < ls_result.size(); ++i) {
-          if (g_config->completion.enableSnippets &&
-              ls_result[i].insertTextFormat == lsInsertTextFormat::Snippet) {
-            ls_result[i].insertText += "$0";
-          }
-
-          ls_result[i].priority_ =
-              GetCompletionPriority(result.CompletionString, result.CursorKind,
-                                    ls_result[i].filterText);
-        }
-      } else {
-        bool do_insert = true;
-        int angle_stack = 0;
-        BuildDetailString(result.CompletionString, ls_completion_item.label,
-                          ls_completion_item.detail,
-                          ls_completion_item.insertText, do_insert,
-                          ls_completion_item.insertTextFormat,
-                          &ls_completion_item.parameters_,
-                          g_config->completion.enableSnippets, angle_stack);
-        assert(angle_stack == 0);
-        if (g_config->completion.enableSnippets &&
-            ls_completion_item.insertTextFormat ==
-                lsInsertTextFormat::Snippet) {
-          ls_completion_item.insertText += "$0";
-        }
-        ls_completion_item.priority_ =
-            GetCompletionPriority(result.CompletionString, result.CursorKind,
-                                  ls_completion_item.label);
-        ls_result.push_back(ls_completion_item);
-      }
-    }
+    lsCompletionItem ls_completion_item;
+    ls_completion_item.kind = GetCompletionKind(result.CursorKind);
+    ls_completion_item.label = GetTypedText(result.CompletionString);
+    ls_completion_item.filterText = ls_completion_item.label;
+    ls_completion_item.priority_ = GetCompletionPriority(
+        result.CompletionString, result.CursorKind, ls_completion_item.label);
+    ls_completion_item.results_ = results;
+    ls_completion_item.result_index_ = i;
+    ls_result.push_back(std::move(ls_completion_item));
+  }
 
-    timer.ResetAndPrint("[complete] Building " +
-                        std::to_string(ls_result.size()) +
-                        " completion results");
+  timer.ResetAndPrint("[complete] Building " +
+                      std::to_string(ls_result.size()) +
+                      " completion results");
 
-    request->on_complete(request->id, ls_result, false /*is_cached_result*/);
+  request->on_complete(request->id, ls_result, false /*is_cached_result*/);
+}
 
-    // Make sure |ls_results| is destroyed before clearing |cx_results|.
-    clang_disposeCodeCompleteResults(cx_results);
+void CompletionQueryMain(ClangCompleteManager* completion_manager) {
+  while (true) {
+    // Blocks until there is a request for a file which is not being completed
+    // by another worker.
+    std::unique_ptr<ClangCompleteManager::CompletionRequest> request =
+        completion_manager->TakeCompletionRequest();
+    CompleteAt(completion_manager, request.get());
+    completion_manager->FinishCompletionRequest(request->path);
   }
 }
 
 void DiagnosticsQueryMain(ClangCompleteManager* completion_manager) {
   while (true) {
-    // Fetching the completion request blocks until we have a request.
-    std::unique_ptr<ClangCompleteManager::DiagnosticRequest> request =
-        completion_manager->diagnostics_request_.Dequeue();
-    if (!request || !g_config->diagnostics.onType)
+    // Blocks until an update is due.
+    std::string path = completion_manager->TakeDiagnosticsRequest();
+    if (!g_config->diagnostics.onType)
       continue;
 
-    std::string path = request->path;
+    // Completion shares the translation unit and is more urgent, so let it go
+    // first.
+    if (completion_manager->HasCompletionRequest(path)) {
+      completion_manager->DiagnosticsUpdate(path, true /*debounce*/);
+      continue;
+    }
 
     std::shared_ptr<CompletionSession> session =
         completion_manager->TryGetSession(path, true /*mark_as_completion*/,
                                           true /*create_if_needed*/);
 
     // At this point, we must have a translation unit. Block until we have one.
-    std::lock_guard<std::mutex> lock(session->diagnostics.lock);
+    std::lock_guard<std::mutex> lock(session->tu.lock);
     Timer timer;
-    TryEnsureDocumentParsed(
-        completion_manager, session, &session->diagnostics.tu,
-        &session->diagnostics.index, false /*emit_diagnostics*/);
+    bool was_parsed = !!session->tu.tu;
+    auto started_at = std::chrono::high_resolution_clock::now();
+    TryEnsureDocumentParsed(completion_manager, session, &session->tu.tu,
+                            &session->tu.index, false /*emit_diagnostics*/);
     timer.ResetAndPrint("[diagnostics] TryEnsureDocumentParsed");
+    if (!was_parsed && session->tu.tu)
+      session->tu.last_parsed_at = started_at;
 
     // It is possible we failed to create the document despite
     // |TryEnsureDocumentParsed|.
-    if (!session->diagnostics.tu)
+    if (!session->tu.tu)
+      continue;
+    // The file was edited while waiting for the translation unit. The newer
+    // update will reparse it.
+    if (completion_manager->HasDiagnosticsRequest(path))
       continue;
 
     timer.Reset();
@@ -651,22 +773,27 @@ void DiagnosticsQueryMain(ClangCompleteManager* completion_manager) {
 
     // Emit diagnostics.
     timer.Reset();
-    session->diagnostics.tu = ClangTranslationUnit::Reparse(
-        std::move(session->diagnostics.tu), unsaved);
+    started_at = std::chrono::high_resolution_clock::now();
+    session->tu.tu =
+        ClangTranslationUnit::Reparse(std::move(session->tu.tu), unsaved);
     timer.ResetAndPrint("[diagnostics] clang_reparseTranslationUnit");
-    if (!session->diagnostics.tu) {
+    session->tu.last_parsed_at = started_at;
+    completion_manager->UpdateMemoryUsage(&session->tu);
+    if (!session->tu.tu) {
       LOG_S(ERROR) << "Reparsing translation unit for diagnostics failed for "
                    << path;
       continue;
     }
+    // libclang cannot cancel a reparse. If the file was edited in the
+    // meantime, the diagnostics are already stale, so drop them.
+    if (completion_manager->HasDiagnosticsRequest(path))
+      continue;
 
-    size_t num_diagnostics =
-        clang_getNumDiagnostics(session->diagnostics.tu->cx_tu);
+    size_t num_diagnostics = clang_getNumDiagnostics(session->tu.tu->cx_tu);
     std::vector<lsDiagnostic> ls_diagnostics;
     ls_diagnostics.reserve(num_diagnostics);
     for (unsigned i = 0; i < num_diagnostics; ++i) {
-      CXDiagnostic cx_diag =
-          clang_getDiagnostic(session->diagnostics.tu->cx_tu, i);
+      CXDiagnostic cx_diag = clang_getDiagnostic(session->tu.tu->cx_tu, i);
       optional<lsDiagnostic> diagnostic =
           BuildAndDisposeDiagnostic(cx_diag, path);
       // Filter messages like "too many errors emitted, stopping now
@@ -681,6 +808,56 @@ void DiagnosticsQueryMain(ClangCompleteManager* completion_manager) {
 
 }  // namespace
 
+CompletionResults::CompletionResults(CXCodeCompleteResults* cx_results)
+    : id(NextCompletionResultsId()), cx_results(cx_results) {}
+
+CompletionResults::~CompletionResults() {
+  clang_disposeCodeCompleteResults(cx_results);
+}
+
+void ResolveCompletionItems(std::vector<lsCompletionItem>* items) {
+  std::vector<lsCompletionItem> resolved;
+  resolved.reserve(items->size());
+  for (lsCompletionItem& item : *items) {
+    if (!item.results_) {
+      resolved.push_back(std::move(item));
+      continue;
+    }
+
+    std::shared_ptr<CompletionResults> results = std::move(item.results_);
+    {
+      ResolvableResults* resolvable = GetResolvableResults();
+      std::lock_guard<std::mutex> lock(resolvable->mutex);
+      if (!resolvable->results.TryGet(results->id, nullptr))
+        resolvable->results.Insert(results->id, results);
+    }
+    unsigned index = item.result_index_;
+    item.data = lsCompletionItemData{results->id, index};
+    BuildCompletionItem(results->cx_results->Results[index], std::move(item),
+                        &resolved);
+  }
+  items->swap(resolved);
+}
+
+void ResolveCompletionItemDocumentation(lsCompletionItem* item) {
+  if (!item->data)
+    return;
+
+  std::shared_ptr<CompletionResults> results;
+  {
+    ResolvableResults* resolvable = GetResolvableResults();
+    std::lock_guard<std::mutex> lock(resolvable->mutex);
+    if (!resolvable->results.TryGet(item->data->resultsId, &results))
+      return;
+  }
+  if (item->data->index >= results->cx_results->NumResults)
+    return;
+  CXCompletionString completion_string =
+      results->cx_results->Results[item->data->index].CompletionString;
+  item->documentation =
+      ToString(clang_getCompletionBriefComment(completion_string));
+}
+
 CompletionSession::Tu::Tu()
     : index(0 /*exclude_declarations_from_pch*/, 0 /*display_diagnostics*/) {}
 
@@ -690,6 +867,10 @@ CompletionSession::CompletionSession(const Project::Entry& file,
 
 CompletionSession::~CompletionSession() {}
 
+size_t CompletionSession::MemoryUsage() const {
+  return tu.memory_usage;
+}
+
 ClangCompleteManager::PreloadRequest::PreloadRequest(const AbsolutePath& path)
     : request_time(std::chrono::high_resolution_clock::now()), path(path) {}
 
@@ -700,10 +881,6 @@ ClangCompleteManager::CompletionRequest::CompletionRequest(
     const OnComplete& on_complete)
     : id(id), path(path), position(position), on_complete(on_complete) {}
 
-ClangCompleteManager::DiagnosticRequest::DiagnosticRequest(
-    const AbsolutePath& path)
-    : path(path) {}
-
 ClangCompleteManager::ClangCompleteManager(Project* project,
                                            WorkingFiles* working_files,
                                            OnDiagnostic on_diagnostic,
@@ -712,11 +889,10 @@ ClangCompleteManager::ClangCompleteManager(Project* project,
       working_files_(working_files),
       on_diagnostic_(on_diagnostic),
       on_dropped_(on_dropped),
-      preloaded_sessions_(kMaxPreloadedSessions),
-      completion_sessions_(kMaxCompletionSessions) {
-  WorkThread::StartThread("comp-query", [&]() { CompletionQueryMain(this); });
-  WorkThread::StartThread("comp-preload",
-                          [&]() { CompletionPreloadMain(this); });
+      preloaded_sessions_(
+          std::max(1, g_config->completion.maxPreloadedSessions)),
+      completion_sessions_(
+          std::max(1, g_config->completion.maxCompletionSessions)) {
   WorkThread::StartThread("diag-query", [&]() { DiagnosticsQueryMain(this); });
 }
 
@@ -726,27 +902,41 @@ void ClangCompleteManager::CodeComplete(
     const lsRequestId& id,
     const lsTextDocumentPositionParams& completion_location,
     const OnComplete& on_complete) {
-  completion_request_.Enqueue(
-      std::make_unique<CompletionRequest>(
-          id, completion_location.textDocument.uri.GetAbsolutePath(),
-          completion_location.position, on_complete),
-      true /*priority*/);
+  std::call_once(completion_workers_started_, [this]() {
+    int num_threads = std::max(1, g_config->completion.threads);
+    for (int i = 0; i < num_threads; ++i) {
+      WorkThread::StartThread("comp-query" + std::to_string(i),
+                              [this]() { CompletionQueryMain(this); });
+    }
+  });
+
+  {
+    std::lock_guard<std::mutex> lock(completion_lock_);
+    completion_requests_.push_back(std::make_unique<CompletionRequest>(
+        id, completion_location.textDocument.uri.GetAbsolutePath(),
+        completion_location.position, on_complete));
+  }
+  completion_cv_.notify_all();
 }
 
-void ClangCompleteManager::DiagnosticsUpdate(const std::string& path) {
-  bool has = false;
-  diagnostics_request_.Iterate(
-      [&](const std::unique_ptr<DiagnosticRequest>& request) {
-        if (request->path == path)
-          has = true;
-      });
-  if (!has) {
-    diagnostics_request_.Enqueue(std::make_unique<DiagnosticRequest>(path),
-                                 true /*priority*/);
+void ClangCompleteManager::DiagnosticsUpdate(const std::string& path,
+                                             bool debounce) {
+  auto due = std::chrono::steady_clock::now();
+  if (debounce)
+    due += std::chrono::milliseconds(g_config->diagnostics.debounceMs);
+  {
+    std::lock_guard<std::mutex> lock(diagnostics_lock_);
+    auto it = diagnostics_requests_.emplace(path, due).first;
+    // An update which is not debounced should not be delayed by earlier edits.
+    if (debounce || due < it->second)
+      it->second = due;
   }
+  diagnostics_cv_.notify_one();
 }
 
-void ClangCompleteManager::NotifyView(const AbsolutePath& filename) {
+void ClangCompleteManager::NotifyView(
+    const AbsolutePath& filename,
+    const std::vector<IndexInclude>& includes) {
   //
   // On view, we reparse only if the file has not been parsed. The existence of
   // a CompletionSession instance implies the file is already parsed or will be
@@ -754,8 +944,10 @@ void ClangCompleteManager::NotifyView(const AbsolutePath& filename) {
   //
 
   // Only reparse the file if we create a new CompletionSession.
-  if (EnsureCompletionOrCreatePreloadSession(filename))
-    preload_requests_.Enqueue(PreloadRequest(filename), true /*priority*/);
+  if (EnsureCompletionOrCreatePreloadSession(filename)) {
+    EnqueuePreload(filename, true /*priority*/);
+    PreloadSpeculatively(filename, includes);
+  }
 }
 
 void ClangCompleteManager::NotifyEdit(const AbsolutePath& filename) {
@@ -765,7 +957,33 @@ void ClangCompleteManager::NotifyEdit(const AbsolutePath& filename) {
   // storage.
   //
 
-  NotifyView(filename);
+  {
+    std::lock_guard<std::mutex> lock(edits_lock_);
+    const std::string& path = filename.path;
+    if (recent_edits_.empty() || recent_edits_.front() != path) {
+      auto add_co_edited = [&](const std::string& file,
+                               const std::string& co_edited) {
+        std::deque<std::string>& files = co_edited_files_[file];
+        files.erase(std::remove(files.begin(), files.end(), co_edited),
+                    files.end());
+        files.push_front(co_edited);
+        if (files.size() > kMaxCoEditedFiles)
+          files.pop_back();
+      };
+      recent_edits_.erase(
+          std::remove(recent_edits_.begin(), recent_edits_.end(), path),
+          recent_edits_.end());
+      for (const std::string& other : recent_edits_) {
+        add_co_edited(path, other);
+        add_co_edited(other, path);
+      }
+      recent_edits_.push_front(path);
+      if (recent_edits_.size() > kMaxRecentEdits)
+        recent_edits_.pop_back();
+    }
+  }
+
+  NotifyView(filename, {});
 }
 
 void ClangCompleteManager::NotifySave(const AbsolutePath& filename) {
@@ -774,7 +992,7 @@ void ClangCompleteManager::NotifySave(const AbsolutePath& filename) {
   //
 
   EnsureCompletionOrCreatePreloadSession(filename);
-  preload_requests_.Enqueue(PreloadRequest(filename), true /*priority*/);
+  EnqueuePreload(filename, true /*priority*/);
 }
 
 void ClangCompleteManager::NotifyClose(const AbsolutePath& filename) {
@@ -804,17 +1022,99 @@ bool ClangCompleteManager::EnsureCompletionOrCreatePreloadSession(
   std::lock_guard<std::mutex> lock(sessions_lock_);
 
   // Check for an existing CompletionSession.
-  if (preloaded_sessions_.Has(filename) || completion_sessions_.Has(filename)) {
-    return false;
+  std::shared_ptr<CompletionSession> session;
+  if (preloaded_sessions_.TryGet(filename, &session)) {
+    // The file is viewed now, so parse it right away if a speculative request
+    // has not done so yet. A speculative parse which is running is not
+    // repeated; it reports diagnostics since the session is no longer
+    // speculative.
+    bool claimed = session->speculative && !session->tu.parsed &&
+                   !session->tu.parsing;
+    session->speculative = false;
+    return claimed;
   }
+  if (completion_sessions_.Has(filename))
+    return false;
 
   // No CompletionSession, create new one.
-  auto session = std::make_shared<CompletionSession>(
+  session = std::make_shared<CompletionSession>(
       project_->FindCompilationEntryForFile(filename), working_files_);
+  ApplySessionLimits();
+  // Make room by dropping a speculatively preloaded session rather than one
+  // for a file which has been viewed.
+  if (int(preloaded_sessions_.Size()) >=
+      std::max(1, g_config->completion.maxPreloadedSessions)) {
+    preloaded_sessions_.TakeCostliest(
+        [](const std::shared_ptr<CompletionSession>& preloaded) {
+          return preloaded->speculative ? 1 : 0;
+        },
+        nullptr);
+  }
   preloaded_sessions_.Insert(session->file.filename, session);
   return true;
 }
 
+void ClangCompleteManager::PreloadSpeculatively(
+    const AbsolutePath& filename,
+    const std::vector<IndexInclude>& includes) {
+  int max_files = g_config->completion.speculativePreloads;
+  if (max_files <= 0)
+    return;
+
+  std::vector<std::string> files = GetPairedFiles(filename.path);
+  {
+    std::lock_guard<std::mutex> lock(edits_lock_);
+    auto it = co_edited_files_.find(filename.path);
+    if (it != co_edited_files_.end())
+      files.insert(files.end(), it->second.begin(), it->second.end());
+  }
+  // System and third party headers are rarely opened.
+  for (const IndexInclude& include : includes) {
+    if (!g_config->projectRoot.empty() &&
+        StartsWithDirectory(include.resolved_path, g_config->projectRoot))
+      files.push_back(include.resolved_path);
+  }
+
+  int num_files = 0;
+  for (const std::string& file : files) {
+    if (num_files >= max_files)
+      break;
+    AbsolutePath path(file, false /*validate*/);
+    {
+      std::lock_guard<std::mutex> lock(sessions_lock_);
+      if (preloaded_sessions_.Has(path) || completion_sessions_.Has(path))
+        continue;
+      // Only use spare room, so that no other session is dropped.
+      int budget_mb = g_config->completion.sessionMemoryBudgetMb;
+      if (int(preloaded_sessions_.Size()) >=
+              std::max(1, g_config->completion.maxPreloadedSessions) ||
+          (budget_mb > 0 &&
+           SessionMemoryUsage() >= size_t(budget_mb) << 20)) {
+        return;
+      }
+      auto session = std::make_shared<CompletionSession>(
+          project_->FindCompilationEntryForFile(path), working_files_);
+      session->speculative = true;
+      preloaded_sessions_.Insert(session->file.filename, session);
+    }
+    LOG_S(INFO) << "Speculatively preloading " << path << " for " << filename;
+    EnqueuePreload(path, false /*priority*/);
+    num_files++;
+  }
+}
+
+void ClangCompleteManager::EnqueuePreload(const AbsolutePath& path,
+                                          bool priority) {
+  std::call_once(preload_workers_started_, [this]() {
+    int num_threads = std::max(1, g_config->completion.preloadThreads);
+    for (int i = 0; i < num_threads; ++i) {
+      WorkThread::StartThread("comp-preload" + std::to_string(i),
+                              [this]() { CompletionPreloadMain(this); });
+    }
+  });
+  preload_requests_.Enqueue(PreloadRequest(path), priority);
+}
+
 std::shared_ptr<CompletionSession> ClangCompleteManager::TryGetSession(
     const std::string& filename,
     bool mark_as_completion,
@@ -828,7 +1128,9 @@ std::shared_ptr<CompletionSession> ClangCompleteManager::TryGetSession(
     // |completion_sessions|.
     if (mark_as_completion) {
       assert(!completion_sessions_.Has(filename));
+      preloaded_session->speculative = false;
       preloaded_sessions_.TryTake(filename, nullptr);
+      ApplySessionLimits();
       completion_sessions_.Insert(filename, preloaded_session);
     }
 
@@ -841,6 +1143,7 @@ std::shared_ptr<CompletionSession> ClangCompleteManager::TryGetSession(
       create_if_needed) {
     completion_session = std::make_shared<CompletionSession>(
         project_->FindCompilationEntryForFile(filename), working_files_);
+    ApplySessionLimits();
     completion_sessions_.Insert(filename, completion_session);
   }
 
@@ -862,3 +1165,162 @@ void ClangCompleteManager::FlushAllSessions() {
   preloaded_sessions_.Clear();
   completion_sessions_.Clear();
 }
+
+bool ClangCompleteManager::IsCompletionReady(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(sessions_lock_);
+  std::shared_ptr<CompletionSession> session;
+  if (!completion_sessions_.TryGet(filename, &session) &&
+      !preloaded_sessions_.TryGet(filename, &session)) {
+    return false;
+  }
+  return session->tu.parsed;
+}
+
+void ClangCompleteManager::UpdateMemoryUsage(CompletionSession::Tu* tu) {
+  tu->memory_usage = tu->tu ? tu->tu->MemoryUsage() : 0;
+  tu->parsed = !!tu->tu;
+
+  std::lock_guard<std::mutex> lock(sessions_lock_);
+  ApplySessionLimits();
+}
+
+void ClangCompleteManager::ApplySessionLimits() {
+  preloaded_sessions_.SetMaxEntries(
+      std::max(1, g_config->completion.maxPreloadedSessions));
+  completion_sessions_.SetMaxEntries(
+      std::max(1, g_config->completion.maxCompletionSessions));
+  if (g_config->completion.sessionMemoryBudgetMb <= 0)
+    return;
+
+  size_t budget = size_t(g_config->completion.sessionMemoryBudgetMb) << 20;
+  size_t usage = SessionMemoryUsage();
+  auto cost = [](const std::shared_ptr<CompletionSession>& session) {
+    return session->MemoryUsage();
+  };
+  auto speculative_cost =
+      [](const std::shared_ptr<CompletionSession>& session) {
+        return session->speculative ? session->MemoryUsage() : 0;
+      };
+  while (usage > budget) {
+    // Preloaded sessions are cheaper to lose as the user has only viewed
+    // those files, so drop them first, starting with the ones which have not
+    // even been viewed.
+    std::shared_ptr<CompletionSession> session;
+    if (!preloaded_sessions_.TakeCostliest(speculative_cost, &session) &&
+        !preloaded_sessions_.TakeCostliest(cost, &session) &&
+        !completion_sessions_.TakeCostliest(cost, &session)) {
+      break;
+    }
+    size_t session_usage = session->MemoryUsage();
+    LOG_S(INFO) << "Dropped code completion session for "
+                << session->file.filename << " using "
+                << (session_usage >> 20) << " MB to stay within budget";
+    usage -= std::min(usage, session_usage);
+  }
+}
+
+size_t ClangCompleteManager::SessionMemoryUsage() {
+  size_t usage = 0;
+  auto add = [&](const std::shared_ptr<CompletionSession>& session) {
+    usage += session->MemoryUsage();
+    return true;
+  };
+  preloaded_sessions_.IterateValues(add);
+  completion_sessions_.IterateValues(add);
+  return usage;
+}
+
+std::unique_ptr<ClangCompleteManager::CompletionRequest>
+ClangCompleteManager::TakeCompletionRequest() {
+  std::vector<lsRequestId> dropped;
+  std::unique_ptr<CompletionRequest> request;
+  {
+    std::unique_lock<std::mutex> lock(completion_lock_);
+    auto it = completion_requests_.end();
+    completion_cv_.wait(lock, [&]() {
+      it = std::find_if(completion_requests_.begin(),
+                        completion_requests_.end(),
+                        [&](const std::unique_ptr<CompletionRequest>& pending) {
+                          return !completing_paths_.count(pending->path);
+                        });
+      return it != completion_requests_.end();
+    });
+    std::string path = (*it)->path;
+
+    // Serve the newest request for |path| and drop the older ones if we're
+    // not buffering.
+    if (g_config->completion.dropOldRequests) {
+      auto newest = it;
+      for (; it != completion_requests_.end(); ++it) {
+        if ((*it)->path == path)
+          newest = it;
+      }
+      request = std::move(*newest);
+      auto end = std::remove_if(
+          completion_requests_.begin(), completion_requests_.end(),
+          [&](const std::unique_ptr<CompletionRequest>& pending) {
+            // |pending| is null for the request we moved out.
+            if (pending && pending->path != path)
+              return false;
+            if (pending)
+              dropped.push_back(pending->id);
+            return true;
+          });
+      completion_requests_.erase(end, completion_requests_.end());
+    } else {
+      request = std::move(*it);
+      completion_requests_.erase(it);
+    }
+    completing_paths_.insert(path);
+  }
+
+  for (const lsRequestId& id : dropped)
+    on_dropped_(id);
+  return request;
+}
+
+void ClangCompleteManager::FinishCompletionRequest(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(completion_lock_);
+    completing_paths_.erase(path);
+  }
+  completion_cv_.notify_all();
+}
+
+bool ClangCompleteManager::HasCompletionRequest(const std::string& path) {
+  std::lock_guard<std::mutex> lock(completion_lock_);
+  if (completing_paths_.count(path))
+    return true;
+  return std::any_of(completion_requests_.begin(), completion_requests_.end(),
+                     [&](const std::unique_ptr<CompletionRequest>& request) {
+                       return request->path == path;
+                     });
+}
+
+std::string ClangCompleteManager::TakeDiagnosticsRequest() {
+  std::unique_lock<std::mutex> lock(diagnostics_lock_);
+  while (true) {
+    if (diagnostics_requests_.empty()) {
+      diagnostics_cv_.wait(lock);
+      continue;
+    }
+    using Request = decltype(diagnostics_requests_)::value_type;
+    auto next = std::min_element(
+        diagnostics_requests_.begin(), diagnostics_requests_.end(),
+        [](const Request& a, const Request& b) { return a.second < b.second; });
+    // Wait for the update to be due, or for a new request which may be due
+    // earlier.
+    if (next->second > std::chrono::steady_clock::now()) {
+      diagnostics_cv_.wait_until(lock, next->second);
+      continue;
+    }
+    std::string path = next->first;
+    diagnostics_requests_.erase(next);
+    return path;
+  }
+}
+
+bool ClangCompleteManager::HasDiagnosticsRequest(const std::string& path) {
+  std::lock_guard<std::mutex> lock(diagnostics_lock_);
+  return diagnostics_requests_.count(path);
+}
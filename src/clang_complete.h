@@ -3,6 +3,7 @@
 #include "atomic_object.h"
 #include "clang_index.h"
 #include "clang_translation_unit.h"
+#include "indexer.h"
 #include "lru_cache.h"
 #include "lsp_completion.h"
 #include "lsp_diagnostic.h"
@@ -12,10 +13,34 @@
 
 #include <clang-c/Index.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Results of a clang_codeCompleteAt call. Completion items refer to them until
+// they are resolved, so that the expensive fields are only built for the items
+// which are sent to the client.
+struct CompletionResults {
+  explicit CompletionResults(CXCodeCompleteResults* cx_results);
+  ~CompletionResults();
+
+  const int id;
+  CXCodeCompleteResults* const cx_results;
+};
+
+// Builds the label, detail and insert text of the |items| which refer to
+// CompletionResults. With completion.detailedLabel, an item expands into one
+// item per combination of optional parameters.
+void ResolveCompletionItems(std::vector<lsCompletionItem>* items);
+// Fills in the documentation of an item built by ResolveCompletionItems, if
+// its results are still around.
+void ResolveCompletionItemDocumentation(lsCompletionItem* item);
 
 struct CompletionSession
     : public std::enable_shared_from_this<CompletionSession> {
@@ -25,22 +50,42 @@ struct CompletionSession
 
     ClangIndex index;
 
-    // When |tu| was last parsed.
+    // When the parse which built |tu| started. Guarded by |lock|.
     optional<std::chrono::time_point<std::chrono::high_resolution_clock>>
         last_parsed_at;
     // Acquired when |tu| is being used.
     std::mutex lock;
     std::unique_ptr<ClangTranslationUnit> tu;
+    // Bytes used by |tu| when it was last parsed.
+    std::atomic<size_t> memory_usage{0};
+    // True if |tu| was set when it was last parsed. Can be read without
+    // holding |lock|.
+    std::atomic<bool> parsed{false};
+    // True while a preload worker is parsing the file without holding |lock|,
+    // so that only one such parse runs at a time. Set and cleared with |lock|
+    // held, but can be read without it.
+    std::atomic<bool> parsing{false};
+    // Time of the newest preload request which came in while |parsing|. The
+    // worker which is parsing parses again for it. Guarded by |lock|.
+    optional<std::chrono::time_point<std::chrono::high_resolution_clock>>
+        reparse_requested_at;
   };
 
   Project::Entry file;
   WorkingFiles* working_files;
+  // True if the session was created by PreloadSpeculatively and the file has
+  // not been viewed since.
+  std::atomic<bool> speculative{false};
 
-  Tu completion;
-  Tu diagnostics;
+  // Used for both completion and diagnostics so that opening a file only
+  // builds one precompiled preamble. |Tu::lock| serializes code completion
+  // and reparsing for diagnostics.
+  Tu tu;
 
   CompletionSession(const Project::Entry& file, WorkingFiles* working_files);
   ~CompletionSession();
+
+  size_t MemoryUsage() const;
 };
 
 struct ClangCompleteManager {
@@ -70,12 +115,6 @@ struct ClangCompleteManager {
     lsPosition position;
     OnComplete on_complete;
   };
-  struct DiagnosticRequest {
-    DiagnosticRequest(const AbsolutePath& path);
-
-    AbsolutePath path;
-  };
-
   ClangCompleteManager(Project* project,
                        WorkingFiles* working_files,
                        OnDiagnostic on_diagnostic,
@@ -87,12 +126,15 @@ struct ClangCompleteManager {
   void CodeComplete(const lsRequestId& request_id,
                     const lsTextDocumentPositionParams& completion_location,
                     const OnComplete& on_complete);
-  // Request a diagnostics update.
-  void DiagnosticsUpdate(const std::string& path);
+  // Request a diagnostics update. If |debounce| is true, the update waits
+  // until |path| has not been edited for diagnostics.debounceMs.
+  void DiagnosticsUpdate(const std::string& path, bool debounce);
 
   // Notify the completion manager that |filename| has been viewed and we
-  // should begin preloading completion data.
-  void NotifyView(const AbsolutePath& filename);
+  // should begin preloading completion data. |includes| are the indexed
+  // includes of |filename|, which may be preloaded as well.
+  void NotifyView(const AbsolutePath& filename,
+                  const std::vector<IndexInclude>& includes);
   // Notify the completion manager that |filename| has been edited.
   void NotifyEdit(const AbsolutePath& filename);
   // Notify the completion manager that |filename| has been saved. This
@@ -103,8 +145,18 @@ struct ClangCompleteManager {
   void NotifyClose(const AbsolutePath& filename);
 
   // Ensures there is a completion or preloaded session. Returns true if a new
-  // session was created.
+  // session was created, or if a speculatively preloaded session which is not
+  // parsed or being parsed yet was claimed, ie, if the file should be parsed
+  // now.
   bool EnsureCompletionOrCreatePreloadSession(const AbsolutePath& filename);
+  // Creates preloaded sessions for files which are likely to be viewed after
+  // |filename|, as long as that does not drop any other session. Those are
+  // its paired files, files edited along with it, and then its |includes|
+  // in the project.
+  void PreloadSpeculatively(const AbsolutePath& filename,
+                            const std::vector<IndexInclude>& includes);
+  // Queues |path| to be parsed by a preload worker.
+  void EnqueuePreload(const AbsolutePath& path, bool priority);
   // Tries to find an edit session for |filename|. This will move the session
   // from view to edit.
   std::shared_ptr<CompletionSession> TryGetSession(const std::string& filename,
@@ -116,9 +168,34 @@ struct ClangCompleteManager {
   // Flushes all saved sessions
   void FlushAllSessions(void);
 
-  // TODO: make these configurable.
-  const int kMaxPreloadedSessions = 10;
-  const int kMaxCompletionSessions = 5;
+  // Returns true if code completion in |filename| does not have to wait for
+  // the file to be parsed first.
+  bool IsCompletionReady(const std::string& filename);
+
+  // Records the memory used by |tu| and whether it is parsed. |tu| must be
+  // locked by the caller. Drops sessions if that puts them over the configured
+  // budget.
+  void UpdateMemoryUsage(CompletionSession::Tu* tu);
+  // Applies the configured session limits. |sessions_lock_| must be held.
+  void ApplySessionLimits();
+  // Returns the bytes used by all sessions. |sessions_lock_| must be held.
+  size_t SessionMemoryUsage();
+
+  // Blocks until there is a completion request for a file which no other
+  // worker is completing, and marks that file as being completed. If
+  // completion.dropOldRequests is set, older requests for the same file are
+  // dropped.
+  std::unique_ptr<CompletionRequest> TakeCompletionRequest();
+  // Marks |path| as no longer being completed.
+  void FinishCompletionRequest(const std::string& path);
+  // Returns true if there is a pending or running completion for |path|.
+  bool HasCompletionRequest(const std::string& path);
+
+  // Blocks until a diagnostics update is due and returns its file.
+  std::string TakeDiagnosticsRequest();
+  // Returns true if there is a pending diagnostics update for |path|, ie,
+  // |path| has changed since the last update was taken.
+  bool HasDiagnosticsRequest(const std::string& path);
 
   // Global state.
   Project* project_;
@@ -139,10 +216,30 @@ struct ClangCompleteManager {
   // Mutex which protects |view_sessions_| and |edit_sessions_|.
   std::mutex sessions_lock_;
 
-  // Request a code completion at the given location.
-  ThreadedQueue<std::unique_ptr<CompletionRequest>> completion_request_;
-  ThreadedQueue<std::unique_ptr<DiagnosticRequest>> diagnostics_request_;
+  // Pending code completion requests, oldest first, and the files which are
+  // being completed by a worker. Requests for different files are served
+  // concurrently by completion.threads workers, which are started on the
+  // first request so the configuration has been received.
+  std::mutex completion_lock_;
+  std::condition_variable completion_cv_;
+  std::deque<std::unique_ptr<CompletionRequest>> completion_requests_;
+  std::unordered_set<std::string> completing_paths_;
+  std::once_flag completion_workers_started_;
+  // Files which need a diagnostics update, and when the update is due. A file
+  // has at most one pending update, and every edit pushes it back, so a burst
+  // of edits results in a single reparse once typing pauses.
+  std::mutex diagnostics_lock_;
+  std::condition_variable diagnostics_cv_;
+  std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+      diagnostics_requests_;
   // Parse requests. The path may already be parsed, in which case it should be
-  // reparsed.
+  // reparsed. Speculative requests are not prioritized. They are served by
+  // completion.preloadThreads workers, started on the first request.
   ThreadedQueue<PreloadRequest> preload_requests_;
+  std::once_flag preload_workers_started_;
+  // Files which were edited most recently, most recent first, and the files
+  // which each file was recently edited along with, most recent first.
+  std::mutex edits_lock_;
+  std::deque<std::string> recent_edits_;
+  std::unordered_map<std::string, std::deque<std::string>> co_edited_files_;
 };
@@ -1,5 +1,6 @@
 #include "indexer.h"
 
+#include "cache_manager.h"
 #include "clang_cursor.h"
 #include "clang_utils.h"
 #include "platform.h"
@@ -734,7 +735,7 @@ void Uniquify(std::vector<IndexId::LexicalRef>& refs) {
 // static
 const int IndexFile::kMajorVersion = 16;
 // static
-const int IndexFile::kMinorVersion = 0;
+const int IndexFile::kMinorVersion = 2;
 
 IndexFile::IndexFile(const AbsolutePath& path)
     : id_cache(path), path(path), file_contents("#error <NONE>") {}
@@ -2272,7 +2273,7 @@ optional<std::vector<std::unique_ptr<IndexFile>>> Parse(
       inc_to_line[inc.resolved_path] = inc.line;
 
   auto result = param.file_consumer->TakeLocalState();
-  auto args_hash = HashArguments(args);
+  auto args_hash = HashArguments(args, GetRelocatableCacheRoot());
   for (std::unique_ptr<IndexFile>& entry : result) {
     entry->import_file = *file;
     entry->args_hash = args_hash;
@@ -2406,39 +2407,3 @@ std::string GetClangVersion() {
   std::string version_string = ToString(clang_getClangVersion());
   return SplitString(version_string, " ")[2];
 }
-
-// |SymbolRef| is serialized this way.
-// |Use| also uses this though it has an extra field |file|,
-// which is not used by Index* so it does not need to be serialized.
-void Reflect(Reader& visitor, Reference& value) {
-  if (visitor.Format() == SerializeFormat::Json) {
-    std::string t = visitor.GetString();
-    char* s = const_cast<char*>(t.c_str());
-    value.range = Range(s);
-    s = strchr(s, '|');
-    value.id.id = RawId(strtol(s + 1, &s, 10));
-    value.kind = static_cast<SymbolKind>(strtol(s + 1, &s, 10));
-    value.role = static_cast<Role>(strtol(s + 1, &s, 10));
-  } else {
-    Reflect(visitor, value.range);
-    Reflect(visitor, value.id);
-    Reflect(visitor, value.kind);
-    Reflect(visitor, value.role);
-  }
-}
-void Reflect(Writer& visitor, Reference& value) {
-  if (visitor.Format() == SerializeFormat::Json) {
-    std::string s = value.range.ToString();
-    // RawId(-1) -> "-1"
-    s += '|' + std::to_string(
-                   static_cast<std::make_signed<RawId>::type>(value.id.id));
-    s += '|' + std::to_string(int(value.kind));
-    s += '|' + std::to_string(int(value.role));
-    Reflect(visitor, s);
-  } else {
-    Reflect(visitor, value.range);
-    Reflect(visitor, value.id);
-    Reflect(visitor, value.kind);
-    Reflect(visitor, value.role);
-  }
-}
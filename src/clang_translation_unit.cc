@@ -154,3 +154,12 @@ ClangTranslationUnit::ClangTranslationUnit(CXTranslationUnit tu) : cx_tu(tu) {}
 ClangTranslationUnit::~ClangTranslationUnit() {
   clang_disposeTranslationUnit(cx_tu);
 }
+
+size_t ClangTranslationUnit::MemoryUsage() const {
+  CXTUResourceUsage usage = clang_getCXTUResourceUsage(cx_tu);
+  size_t ret = 0;
+  for (unsigned i = 0; i < usage.numEntries; i++)
+    ret += usage.entries[i].amount;
+  clang_disposeCXTUResourceUsage(usage);
+  return ret;
+}
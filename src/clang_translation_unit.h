@@ -28,5 +28,9 @@ struct ClangTranslationUnit {
   explicit ClangTranslationUnit(CXTranslationUnit tu);
   ~ClangTranslationUnit();
 
+  // Returns the number of bytes libclang reports as used by this translation
+  // unit, including the preamble.
+  size_t MemoryUsage() const;
+
   CXTranslationUnit cx_tu;
 };
\ No newline at end of file
@@ -1,12 +1,77 @@
 #include "code_complete_cache.h"
 
-void CodeCompleteCache::WithLock(std::function<void()> action) {
+#include "lex_utils.h"
+
+#include <doctest/doctest.h>
+
+CompletionCandidates::CompletionCandidates(std::vector<lsCompletionItem> items)
+    : items(std::move(items)) {
+  keys.reserve(this->items.size());
+  char_sets.reserve(this->items.size());
+  for (lsCompletionItem& item : this->items) {
+    if (!item.filterText)
+      item.filterText = item.label;
+    keys.emplace_back(*item.filterText);
+    char_sets.push_back(CaseFoldingCharSet(*item.filterText));
+  }
+}
+
+CodeCompleteCache::CodeCompleteCache(int max_entries)
+    : entries_(max_entries) {}
+
+bool CodeCompleteCache::TryGet(
+    const Key& key,
+    std::shared_ptr<const CompletionCandidates>* results) {
   std::lock_guard<std::mutex> lock(mutex_);
-  action();
+  return entries_.TryGet(key, results);
 }
 
-bool CodeCompleteCache::IsCacheValid(lsTextDocumentPositionParams position) {
+void CodeCompleteCache::Insert(
+    const Key& key,
+    const std::shared_ptr<const CompletionCandidates>& results) {
   std::lock_guard<std::mutex> lock(mutex_);
-  return cached_path_ == position.textDocument.uri.GetAbsolutePath() &&
-         cached_completion_position_ == position.position;
-}
\ No newline at end of file
+  entries_.TryTake(key, nullptr);
+  entries_.Insert(key, results);
+}
+
+TEST_SUITE("CodeCompleteCache") {
+  TEST_CASE("lru") {
+    CodeCompleteCache cache(2);
+    CodeCompleteCache::Key a, b, c;
+    a.path = AbsolutePath::BuildDoNotUse("a.cc");
+    b.path = AbsolutePath::BuildDoNotUse("b.cc");
+    c.path = a.path;
+    c.edit_generation = 1;
+
+    auto make_candidates = [](size_t n) {
+      return std::make_shared<const CompletionCandidates>(
+          std::vector<lsCompletionItem>(n));
+    };
+    std::shared_ptr<const CompletionCandidates> items = make_candidates(2),
+                                                results;
+    cache.Insert(a, make_candidates(1));
+    cache.Insert(a, items);
+    cache.Insert(b, items);
+    REQUIRE(cache.TryGet(a, &results));
+    REQUIRE(results->items.size() == 2);
+    REQUIRE(!cache.TryGet(c, &results));
+    // |b| is evicted since |a| was used more recently.
+    cache.Insert(c, items);
+    REQUIRE(!cache.TryGet(b, &results));
+    REQUIRE(cache.TryGet(a, &results));
+  }
+
+  TEST_CASE("candidates") {
+    std::vector<lsCompletionItem> items(2);
+    items[0].label = "fooBar";
+    items[1].label = "foo";
+    items[1].filterText = "FooFilter";
+    CompletionCandidates candidates(std::move(items));
+    REQUIRE(*candidates.items[0].filterText == "fooBar");
+    REQUIRE(candidates.keys[0].low == "foobar");
+    REQUIRE(candidates.keys[1].low == "foofilter");
+    REQUIRE(candidates.keys[1].text.data() ==
+            candidates.items[1].filterText->data());
+    REQUIRE(candidates.char_sets[1] == CaseFoldingCharSet("foofilter"));
+  }
+}
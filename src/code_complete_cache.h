@@ -1,22 +1,62 @@
 #pragma once
 
+#include "fuzzy_match.h"
+#include "lru_cache.h"
 #include "lsp_completion.h"
 
-#include <optional.h>
-
+#include <memory>
 #include <mutex>
 
+// Completion results with the lowercase form and character roles of their
+// filter texts computed once, so that refiltering them as the user types only
+// has to score them.
+struct CompletionCandidates {
+  explicit CompletionCandidates(std::vector<lsCompletionItem> items);
+  // |keys| point into |items|.
+  CompletionCandidates(const CompletionCandidates&) = delete;
+  CompletionCandidates& operator=(const CompletionCandidates&) = delete;
+
+  // |filterText| is set on every item.
+  std::vector<lsCompletionItem> items;
+  std::vector<FuzzyMatcher::Text> keys;
+  // CaseFoldingCharSet of every key, so that most keys which a pattern does
+  // not match are rejected without scanning them.
+  std::vector<uint64_t> char_sets;
+};
+
 // Cached completion information, so we can give fast completion results when
-// the user erases a character. vscode will resend the completion request if
-// that happens.
+// the user keeps typing or erases a character, or comes back to a position
+// which was completed before. vscode will resend the completion request in
+// those cases.
 struct CodeCompleteCache {
-  // NOTE: Make sure to access these variables under |WithLock|.
-  optional<AbsolutePath> cached_path_;
-  optional<lsPosition> cached_completion_position_;
-  std::vector<lsCompletionItem> cached_results_;
+  struct Key {
+    AbsolutePath path;
+    // The stable completion position, ie, the start of the identifier being
+    // typed.
+    lsPosition position;
+    // WorkingFile::edit_generation of the buffer, so that entries become
+    // stale after any edit but typing the identifier. 0 if edits do not
+    // matter.
+    int64_t edit_generation = 0;
 
-  std::mutex mutex_;
+    bool operator==(const Key& o) const {
+      return path == o.path && position == o.position &&
+             edit_generation == o.edit_generation;
+    }
+  };
+
+  explicit CodeCompleteCache(int max_entries);
 
-  void WithLock(std::function<void()> action);
-  bool IsCacheValid(lsTextDocumentPositionParams position);
+  // Returns false if there are no results for |key|. The results are shared
+  // with the cache, so they are not copied.
+  bool TryGet(const Key& key,
+              std::shared_ptr<const CompletionCandidates>* results);
+  // Replaces the results for |key|, evicting the least recently used entry if
+  // the cache is full.
+  void Insert(const Key& key,
+              const std::shared_ptr<const CompletionCandidates>& results);
+
+ private:
+  std::mutex mutex_;
+  LruCache<Key, std::shared_ptr<const CompletionCandidates>> entries_;
 };
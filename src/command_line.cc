@@ -228,9 +228,12 @@ void RunQueryDbThread(const std::string& bin_name) {
       });
 
   IncludeComplete include_complete(&project);
-  auto global_code_complete_cache = std::make_unique<CodeCompleteCache>();
-  auto non_global_code_complete_cache = std::make_unique<CodeCompleteCache>();
-  auto signature_cache = std::make_unique<CodeCompleteCache>();
+  // Global completion results are cached per file. Non-global results are
+  // cached per position, and are kept for a few positions so that going back
+  // to one does not need clang.
+  auto global_code_complete_cache = std::make_unique<CodeCompleteCache>(4);
+  auto non_global_code_complete_cache = std::make_unique<CodeCompleteCache>(8);
+  auto signature_cache = std::make_unique<CodeCompleteCache>(1);
   ImportManager import_manager;
   ImportPipelineStatus import_pipeline_status;
   TimestampManager timestamp_manager;
@@ -42,12 +42,21 @@ struct Config {
   // printed with jq.
   //
   // "msgpack" uses a compact binary serialization format (the underlying wire
-  // format is [MessagePack](https://msgpack.org/index.html)) which typically
-  // takes only 60% of the corresponding JSON size, but is difficult to inspect.
-  // msgpack does not store map keys and you need to re-index whenever a struct
-  // member has changed.
+  // format is [MessagePack](https://msgpack.org/index.html)) which is about
+  // half the size of the corresponding JSON, but is difficult to inspect.
+  // Members are written as small integer tags into a table of member names
+  // stored once per file, so caches written by an older cquery can still be
+  // loaded after struct members have changed.
   SerializeFormat cacheFormat = SerializeFormat::Json;
 
+  // If not empty, caches are relocatable: paths inside |projectRoot| are
+  // stored relative to it and the caches are stored under this name instead of
+  // under the project location. Checkouts or git worktrees of the same project
+  // which use the same |cacheDirectory| and |relocatableCacheKey| share their
+  // caches, so a new worktree only reindexes the files whose contents differ
+  // from the ones that were cached.
+  std::string relocatableCacheKey;
+
   // Value to use for clang -resource-dir if not present in
   // compile_commands.json.
   //
@@ -131,6 +140,10 @@ struct Config {
     // completion requests will be serviced.
     bool dropOldRequests = true;
 
+    // Number of threads serving completion requests. Requests in different
+    // files are served concurrently, requests in the same file one at a time.
+    int threads = 2;
+
     // If true, filter and sort completion response. cquery filters and sorts
     // completions to try to be nicer to clients that can't handle big numbers
     // of completion candidates. This behaviour can be disabled by specifying
@@ -156,6 +169,34 @@ struct Config {
     // For example, to hide all files in a /CACHE/ folder, use ".*/CACHE/.*"
     std::vector<std::string> includeBlacklist;
     std::vector<std::string> includeWhitelist;
+
+    // Maximum number of translation units kept for files which have only been
+    // viewed, and for files which code completion has been requested in.
+    int maxPreloadedSessions = 10;
+    int maxCompletionSessions = 5;
+
+    // Number of threads building translation units for viewed files.
+    int preloadThreads = 2;
+    // When a file is viewed, translation units are also built in the
+    // background for up to this many related files: the header or source file
+    // with the same name, and files recently edited along with it. They only
+    // take spare room in |maxPreloadedSessions| and |sessionMemoryBudgetMb|,
+    // and are dropped before any other session. 0 disables this.
+    int speculativePreloads = 2;
+
+    // If positive, translation units for completion and diagnostics are
+    // dropped once together they use more than this many megabytes. Large
+    // sessions which have not been used recently are dropped first, and the
+    // most recently used ones are always kept.
+    int sessionMemoryBudgetMb = 0;
+
+    // If true and |cacheDirectory| is set, the #include block at the top of
+    // open files is precompiled and saved in |cacheDirectory|, so completion
+    // sessions created after a restart do not parse those headers again.
+    bool cachePreambles = true;
+    // Maximum number of preambles kept in |cacheDirectory|. The ones used
+    // least recently are deleted first.
+    int maxCachedPreambles = 20;
   };
   Completion completion;
 
@@ -181,6 +222,11 @@ struct Config {
     bool onParse = true;
     // If true, diagnostics from typing will be reported.
     bool onType = true;
+
+    // Diagnostics from typing are only computed once the file has not been
+    // edited for this many milliseconds, so that a burst of edits results in
+    // a single reparse.
+    int debounceMs = 300;
   };
   Diagnostics diagnostics;
 
@@ -229,12 +275,19 @@ struct Config {
 
     // Number of indexer threads. If 0, 80% of cores are used.
     int threads = 0;
+
+    // Number of threads which read and deserialize cache files ahead of the
+    // indexer threads. Set to 0 to disable cache prefetching.
+    int prefetchThreads = 2;
   };
   Index index;
 
   struct WorkspaceSymbol {
     // Maximum workspace search results.
     int maxNum = 1000;
+    // Number of threads used to scan symbols, which also filter cached code
+    // completion candidates. If 0, one per CPU is used.
+    int threads = 0;
     // If true, workspace search results will be dynamically rescored/reordered
     // as the search progresses. Some clients do their own ordering and assume
     // that the results stay sorted in the same order as the search progresses.
@@ -257,18 +310,27 @@ MAKE_REFLECT_STRUCT(Config::Completion,
                     enableSnippets,
                     detailedLabel,
                     dropOldRequests,
+                    threads,
                     filterAndSort,
                     includeMaxPathSize,
                     includeSuffixWhitelist,
                     includeBlacklist,
-                    includeWhitelist);
+                    includeWhitelist,
+                    maxPreloadedSessions,
+                    maxCompletionSessions,
+                    preloadThreads,
+                    speculativePreloads,
+                    sessionMemoryBudgetMb,
+                    cachePreambles,
+                    maxCachedPreambles);
 MAKE_REFLECT_STRUCT(Config::Formatting, enabled)
 MAKE_REFLECT_STRUCT(Config::Diagnostics,
                     blacklist,
                     whitelist,
                     frequencyMs,
                     onParse,
-                    onType)
+                    onType,
+                    debounceMs)
 MAKE_REFLECT_STRUCT(Config::Highlight, enabled, blacklist, whitelist)
 MAKE_REFLECT_STRUCT(Config::Index,
                     attributeMakeCallsToCtor,
@@ -277,14 +339,16 @@ MAKE_REFLECT_STRUCT(Config::Index,
                     comments,
                     enabled,
                     logSkippedPaths,
-                    threads);
-MAKE_REFLECT_STRUCT(Config::WorkspaceSymbol, maxNum, sort);
+                    threads,
+                    prefetchThreads);
+MAKE_REFLECT_STRUCT(Config::WorkspaceSymbol, maxNum, threads, sort);
 MAKE_REFLECT_STRUCT(Config::Xref, maxNum);
 MAKE_REFLECT_STRUCT(Config,
                     compilationDatabaseCommand,
                     compilationDatabaseDirectory,
                     cacheDirectory,
                     cacheFormat,
+                    relocatableCacheKey,
                     resourceDirectory,
 
                     discoverSystemIncludes,
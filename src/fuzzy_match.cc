@@ -84,24 +84,56 @@ FuzzyMatcher::FuzzyMatcher(std::string_view pattern) {
     }
 }
 
+FuzzyMatcher::Text::Text(std::string_view text) : text(text) {
+  if (text.size() > kMaxText)
+    return;
+  low.resize(text.size());
+  for (size_t i = 0; i < text.size(); i++)
+    low[i] = ::tolower(text[i]);
+  roles.resize(text.size());
+  int class_set;
+  CalculateRoles(text, roles.data(), &class_set);
+}
+
 int FuzzyMatcher::Match(std::string_view text) {
   int n = int(text.size());
   if (n > kMaxText)
     return kMinScore + 1;
   this->text = text;
   for (int i = 0; i < n; i++)
-    low_text[i] = ::tolower(text[i]);
-  CalculateRoles(text, text_role, &text_set);
+    low_buf[i] = ::tolower(text[i]);
+  CalculateRoles(text, role_buf, &text_set);
+  low_text = low_buf;
+  text_role = role_buf;
+  return Score();
+}
+
+int FuzzyMatcher::Match(const Text& text) {
+  if (text.text.size() > kMaxText)
+    return kMinScore + 1;
+  this->text = text.text;
+  low_text = text.low.data();
+  text_role = text.roles.data();
+  return Score();
+}
+
+int FuzzyMatcher::Score() {
+  int n = int(text.size()), m = int(pat.size());
+  // The pattern cannot be matched.
+  if (m > n)
+    return kMinScore;
   dp[0][0][0] = dp[0][0][1] = 0;
   for (int j = 0; j < n; j++) {
     dp[0][j + 1][0] = dp[0][j][0] + MissScore(j, false);
     dp[0][j + 1][1] = kMinScore * 2;
   }
-  for (int i = 0; i < int(pat.size()); i++) {
+  for (int i = 0; i < m; i++) {
     int(*pre)[2] = dp[i & 1];
     int(*cur)[2] = dp[(i + 1) & 1];
     cur[i][0] = cur[i][1] = kMinScore;
-    for (int j = i; j < n; j++) {
+    // Text after n - m + i cannot be matched by pat[i], since the rest of the
+    // pattern must follow it.
+    for (int j = i; j <= n - m + i; j++) {
       cur[j + 1][0] = std::max(cur[j][0] + MissScore(j, false),
                                cur[j][1] + MissScore(j, true));
       // For the first char of pattern, apply extra restriction to filter bad
@@ -118,8 +150,8 @@ int FuzzyMatcher::Match(std::string_view text) {
   // Enumerate the end position of the match in str. Each removed trailing
   // character has a penulty.
   int ret = kMinScore;
-  for (int j = pat.size(); j <= n; j++)
-    ret = std::max(ret, dp[pat.size() & 1][j][1] - 3 * (n - j));
+  for (int j = m; j <= n; j++)
+    ret = std::max(ret, dp[m & 1][j][1] - 3 * (n - j));
   return ret;
 }
 
@@ -169,4 +201,16 @@ TEST_SUITE("fuzzy_match") {
     // score(PRINT) > kMinScore
     CHECK(Ranks("Int", {"int", "INT", "PRINT"}));
   }
+
+  TEST_CASE("prepared text") {
+    std::vector<const char*> texts = {"printf", "sprintf", "PRINT", "pr", ""};
+    std::vector<FuzzyMatcher::Text> prepared;
+    for (auto text : texts)
+      prepared.emplace_back(text);
+    for (const char* pat : {"", "pr", "Print", "prf"}) {
+      FuzzyMatcher fuzzy(pat);
+      for (size_t i = 0; i < texts.size(); i++)
+        CHECK(fuzzy.Match(prepared[i]) == fuzzy.Match(texts[i]));
+    }
+  }
 }
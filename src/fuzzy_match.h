@@ -4,6 +4,7 @@
 
 #include <limits.h>
 #include <string>
+#include <vector>
 
 class FuzzyMatcher {
  public:
@@ -13,17 +14,35 @@ class FuzzyMatcher {
   // overflow.
   constexpr static int kMinScore = INT_MIN / 4;
 
+  // A candidate with its lowercase form and character roles computed up
+  // front, so that it can be matched against many patterns. |text| must
+  // outlive it.
+  struct Text {
+    explicit Text(std::string_view text);
+
+    std::string_view text;
+    std::string low;
+    std::vector<int> roles;
+  };
+
   FuzzyMatcher(std::string_view pattern);
   int Match(std::string_view text);
+  int Match(const Text& text);
 
  private:
   std::string pat;
   std::string_view text;
+  // Lowercase form and roles of |text|, pointing to either |low_buf| and
+  // |role_buf| or a Text.
+  const char* low_text;
+  const int* text_role;
   int pat_set, text_set;
-  char low_pat[kMaxPat], low_text[kMaxText];
-  int pat_role[kMaxPat], text_role[kMaxText];
+  char low_pat[kMaxPat], low_buf[kMaxText];
+  int pat_role[kMaxPat], role_buf[kMaxText];
   int dp[2][kMaxText + 1][2];
 
+  int Score();
+
   int MatchScore(int i, int j, bool last);
   int MissScore(int j, bool last);
 };
@@ -127,6 +127,17 @@ struct ActiveThread {
   ImportPipelineStatus* status_;
 };
 
+// Returns true if |path| has the same contents as when its cache was written.
+bool CachedContentsMatch(ICacheManager* cache_manager,
+                         const AbsolutePath& path) {
+  optional<std::string> cached_contents =
+      cache_manager->LoadCachedFileContents(path);
+  if (!cached_contents)
+    return false;
+  optional<std::string> contents = ReadContent(path);
+  return contents && *contents == *cached_contents;
+}
+
 // Checks if |path| needs to be reparsed. This will modify cached state
 // such that calling this function twice with the same path may return true
 // the first time but will return false the second.
@@ -160,12 +171,24 @@ ChangeResult ComputeChangeStatus(
   // File has been changed.
   if (!last_cached_modification ||
       modification_timestamp != *last_cached_modification) {
-    LOG_S(INFO) << "Timestamp has changed for " << path << unwrap_opt(from);
-    return ChangeResult::kYes;
+    // A relocatable cache may have been written by another checkout of the
+    // project, where the file has a different timestamp. Only reparse if the
+    // contents are different too.
+    if (last_cached_modification && !GetRelocatableCacheRoot().empty() &&
+        CachedContentsMatch(cache_manager.get(), path)) {
+      LOG_S(INFO) << "Timestamp has changed but contents have not for "
+                  << path << unwrap_opt(from);
+      timestamp_manager->UpdateCachedModificationTime(path,
+                                                      *modification_timestamp);
+    } else {
+      LOG_S(INFO) << "Timestamp has changed for " << path << unwrap_opt(from);
+      return ChangeResult::kYes;
+    }
   }
 
   if (opt_previous_index) {
-    if (HashArguments(args) != opt_previous_index->args_hash) {
+    if (HashArguments(args, GetRelocatableCacheRoot()) !=
+        opt_previous_index->args_hash) {
       LOG_S(INFO) << "Arguments have changed for " << path << unwrap_opt(from);
       return ChangeResult::kYes;
     }
@@ -132,8 +132,56 @@ struct IndexId {
   using LexicalRef = IndexLexicalRef;
 };
 
-void Reflect(Reader& visitor, Reference& value);
-void Reflect(Writer& visitor, Reference& value);
+// |SymbolRef| is serialized this way.
+// |Use| also uses this though it has an extra field |file|,
+// which is not used by Index* so it does not need to be serialized.
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, Reference& value) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    std::string_view s = visitor.GetStringView();
+    value.range = ParseRange(&s);
+    ParseSeparator(&s, '|');
+    value.id.id = RawId(ParseInteger(&s));
+    ParseSeparator(&s, '|');
+    value.kind = static_cast<SymbolKind>(ParseInteger(&s));
+    ParseSeparator(&s, '|');
+    value.role = static_cast<Role>(ParseInteger(&s));
+  } else {
+    // The range is flattened into the array of the reference.
+    visitor.StartArray();
+    Reflect(visitor, value.range.start.line);
+    Reflect(visitor, value.range.start.column);
+    Reflect(visitor, value.range.end.line);
+    Reflect(visitor, value.range.end.column);
+    Reflect(visitor, value.id);
+    Reflect(visitor, value.kind);
+    Reflect(visitor, value.role);
+    visitor.EndArray();
+  }
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, Reference& value) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    std::string s = value.range.ToString();
+    // RawId(-1) -> "-1"
+    s += '|' + std::to_string(
+                   static_cast<std::make_signed<RawId>::type>(value.id.id));
+    s += '|' + std::to_string(int(value.kind));
+    s += '|' + std::to_string(int(value.role));
+    Reflect(visitor, s);
+  } else {
+    // The range is flattened into the array of the reference.
+    visitor.StartArray(7);
+    Reflect(visitor, value.range.start.line);
+    Reflect(visitor, value.range.start.column);
+    Reflect(visitor, value.range.end.line);
+    Reflect(visitor, value.range.end.column);
+    Reflect(visitor, value.id);
+    Reflect(visitor, value.kind);
+    Reflect(visitor, value.role);
+    visitor.EndArray();
+  }
+}
 
 template <typename Id>
 struct TypeDefDefinitionData {
@@ -363,7 +411,9 @@ struct VarDefDefinitionData {
   // (declaration).
   StorageClass storage = StorageClass::Invalid;
 
-  bool is_local() const { return kind == lsSymbolKind::Variable; }
+  // Locals and parameters are spelled in their function. Globals have the
+  // same |kind| as locals.
+  bool is_local() const { return spell && spell->kind == SymbolKind::Func; }
 
   bool operator==(const VarDefDefinitionData& o) const {
     return detailed_name == o.detailed_name && spell == o.spell &&
@@ -455,9 +505,9 @@ struct IndexFile {
   // For both JSON and MessagePack cache files.
   static const int kMajorVersion;
   // For MessagePack cache files.
-  // JSON has good forward compatibility because field addition/deletion do not
-  // harm but currently no efforts have been made to make old MessagePack cache
-  // files accepted by newer cquery.
+  // Both JSON and MessagePack store member names (MessagePack in a table of
+  // tags), so member addition/deletion does not require a version bump. Only
+  // bump this when the MessagePack encoding itself changes.
   static const int kMinorVersion;
 
   AbsolutePath path;
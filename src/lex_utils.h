@@ -4,6 +4,7 @@
 
 #include <string_view.h>
 
+#include <stdint.h>
 #include <string>
 #include <tuple>
 
@@ -32,3 +33,8 @@ std::string_view LexIdentifierAroundPos(lsPosition position,
 
 std::pair<bool, int> CaseFoldingSubsequenceMatch(std::string_view search,
                                                  std::string_view content);
+
+// Returns a bit set of the case-folded characters in |s|. If |search| is a
+// case-folding subsequence of |content| then the set of |search| is a subset
+// of the set of |content|, so most mismatches can be rejected with one AND.
+uint64_t CaseFoldingCharSet(std::string_view s);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <algorithm>
 #include <cassert>
 #include <limits>
@@ -25,6 +26,16 @@ struct LruCache {
   bool TryTake(const TKey& key, TValue* dest);
   // Inserts an entry. Evicts the oldest unused entry if there is no space.
   void Insert(const TKey& key, const TValue& value);
+  // Removes the entry with the highest |cost(value)| multiplied by the number
+  // of accesses since it was last used. The most recently used entry is never
+  // removed. Returns false if no entry has a positive weighted cost.
+  template <typename TCost>
+  bool TakeCostliest(TCost cost, TValue* dest);
+
+  // Changes the maximum number of entries, evicting the oldest unused entries
+  // if there are too many.
+  void SetMaxEntries(int max_entries);
+  size_t Size() const { return entries_.size(); }
 
   // Call |func| on existing entries. If |func| returns false iteration
   // terminates early.
@@ -125,6 +136,37 @@ void LruCache<TKey, TValue>::Insert(const TKey& key, const TValue& value) {
   entries_.push_back(entry);
 }
 
+template <typename TKey, typename TValue>
+template <typename TCost>
+bool LruCache<TKey, TValue>::TakeCostliest(TCost cost, TValue* dest) {
+  auto victim = entries_.end();
+  uint64_t max_weight = 0;
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    // |next_score_| is one past the score of the most recently used entry.
+    uint64_t age = uint32_t(next_score_ - 1 - it->score);
+    uint64_t weight = uint64_t(cost(it->value)) * age;
+    if (weight > max_weight) {
+      max_weight = weight;
+      victim = it;
+    }
+  }
+  if (victim == entries_.end())
+    return false;
+
+  if (dest)
+    *dest = victim->value;
+  entries_.erase(victim);
+  return true;
+}
+
+template <typename TKey, typename TValue>
+void LruCache<TKey, TValue>::SetMaxEntries(int max_entries) {
+  assert(max_entries > 0);
+  max_entries_ = max_entries;
+  while ((int)entries_.size() > max_entries_)
+    entries_.erase(std::min_element(entries_.begin(), entries_.end()));
+}
+
 template <typename TKey, typename TValue>
 template <typename TFunc>
 void LruCache<TKey, TValue>::IterateValues(TFunc func) {
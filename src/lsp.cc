@@ -10,6 +10,7 @@
 #include <loguru.hpp>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <iostream>
 
 namespace {
@@ -345,6 +346,21 @@ void Reflect(Reader& visitor, lsDocumentUri& value) {
   UriCache::instance()->RecordPath(value.GetRawPath());
 }
 
+void Reflect(Writer& visitor, lsProgressToken& value) {
+  if (value.is_string)
+    Reflect(visitor, value.value);
+  else
+    visitor.Int64(atoll(value.value.c_str()));
+}
+
+void Reflect(Reader& visitor, lsProgressToken& value) {
+  value.is_string = visitor.IsString();
+  if (value.is_string)
+    Reflect(visitor, value.value);
+  else
+    value.value = std::to_string(visitor.GetInt64());
+}
+
 lsPosition::lsPosition() {}
 lsPosition::lsPosition(int line, int character)
     : line(line), character(character) {}
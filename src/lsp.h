@@ -119,6 +119,15 @@ MAKE_HASHABLE(lsDocumentUri, t.raw_uri_);
 void Reflect(Writer& visitor, lsDocumentUri& value);
 void Reflect(Reader& visitor, lsDocumentUri& value);
 
+// Identifies a request's stream of $/progress notifications. The client can
+// send it as an int or a string; it is written back in the same format.
+struct lsProgressToken {
+  bool is_string = false;
+  std::string value;
+};
+void Reflect(Writer& visitor, lsProgressToken& value);
+void Reflect(Reader& visitor, lsProgressToken& value);
+
 struct lsPosition {
   lsPosition();
   lsPosition(int line, int character);
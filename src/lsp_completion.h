@@ -1,6 +1,11 @@
 #pragma once
 #include "lsp.h"
 
+#include <memory>
+
+// Defined in clang_complete.h.
+struct CompletionResults;
+
 // The kind of a completion entry.
 enum class lsCompletionItemKind {
   Text = 1,
@@ -50,6 +55,13 @@ enum class lsInsertTextFormat {
 };
 MAKE_REFLECT_TYPE_PROXY(lsInsertTextFormat);
 
+// Identifies a completion item in completionItem/resolve requests.
+struct lsCompletionItemData {
+  int resultsId = 0;
+  unsigned index = 0;
+};
+MAKE_REFLECT_STRUCT(lsCompletionItemData, resultsId, index);
+
 struct lsCompletionItem {
   // A set of function parameters. Used internally for signature help. Not sent
   // to vscode.
@@ -72,12 +84,17 @@ struct lsCompletionItem {
   optional<std::string> documentation;
 
   // Internal information to order candidates.
-  int score_;
   unsigned priority_;
 
   // Use <> or "" by default as include path.
   bool use_angle_brackets_ = false;
 
+  // If set, only |kind|, |filterText| and |priority_| have been filled in and
+  // |label| is the typed text. The rest is built by ResolveCompletionItems
+  // from the result at |result_index_|. Not sent to vscode.
+  std::shared_ptr<CompletionResults> results_;
+  unsigned result_index_ = 0;
+
   // A string that shoud be used when comparing this item
   // with other items. When `falsy` the label is used.
   std::string sortText;
@@ -112,7 +129,7 @@ struct lsCompletionItem {
 
   // An data entry field that is preserved on a completion item between
   // a completion and a completion resolve request.
-  // data ? : any
+  optional<lsCompletionItemData> data;
 
   // Use this helper to figure out what content the completion item will insert
   // into the document, as it could live in either |textEdit|, |insertText|, or
@@ -134,4 +151,5 @@ MAKE_REFLECT_STRUCT(lsCompletionItem,
                     insertText,
                     filterText,
                     insertTextFormat,
-                    textEdit);
+                    textEdit,
+                    data);
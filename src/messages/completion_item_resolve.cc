@@ -0,0 +1,35 @@
+#include "clang_complete.h"
+#include "message_handler.h"
+#include "queue_manager.h"
+
+namespace {
+MethodType kMethodType = "completionItem/resolve";
+
+struct In_CompletionItemResolve : public RequestInMessage {
+  MethodType GetMethodType() const override { return kMethodType; }
+  lsCompletionItem params;
+};
+MAKE_REFLECT_STRUCT(In_CompletionItemResolve, id, params);
+REGISTER_IN_MESSAGE(In_CompletionItemResolve);
+
+struct Out_CompletionItemResolve
+    : public lsOutMessage<Out_CompletionItemResolve> {
+  lsRequestId id;
+  lsCompletionItem result;
+};
+MAKE_REFLECT_STRUCT(Out_CompletionItemResolve, jsonrpc, id, result);
+
+struct Handler_CompletionItemResolve
+    : BaseMessageHandler<In_CompletionItemResolve> {
+  MethodType GetMethodType() const override { return kMethodType; }
+  void Run(In_CompletionItemResolve* request) override {
+    Out_CompletionItemResolve out;
+    out.id = request->id;
+    out.result = std::move(request->params);
+    // Documentation is only looked up for the item the user selects.
+    ResolveCompletionItemDocumentation(&out.result);
+    QueueManager::WriteStdout(kMethodType, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(Handler_CompletionItemResolve);
+}  // namespace
@@ -0,0 +1,74 @@
+#include "clang_complete.h"
+#include "message_handler.h"
+#include "queue_manager.h"
+
+namespace {
+MethodType kMethodType = "$cquery/completionSessions";
+
+struct In_CqueryCompletionSessions : public RequestInMessage {
+  MethodType GetMethodType() const override { return kMethodType; }
+};
+MAKE_REFLECT_STRUCT(In_CqueryCompletionSessions, id);
+REGISTER_IN_MESSAGE(In_CqueryCompletionSessions);
+
+struct Out_CqueryCompletionSessions
+    : public lsOutMessage<Out_CqueryCompletionSessions> {
+  struct Session {
+    std::string path;
+    // Bytes used by the translation units of the session.
+    size_t memoryUsage = 0;
+  };
+  struct Result {
+    std::vector<Session> preloaded;
+    std::vector<Session> completion;
+    int maxPreloadedSessions = 0;
+    int maxCompletionSessions = 0;
+    size_t memoryUsage = 0;
+    size_t memoryBudget = 0;
+  };
+  lsRequestId id;
+  Result result;
+};
+MAKE_REFLECT_STRUCT(Out_CqueryCompletionSessions::Session, path, memoryUsage);
+MAKE_REFLECT_STRUCT(Out_CqueryCompletionSessions::Result,
+                    preloaded,
+                    completion,
+                    maxPreloadedSessions,
+                    maxCompletionSessions,
+                    memoryUsage,
+                    memoryBudget);
+MAKE_REFLECT_STRUCT(Out_CqueryCompletionSessions, jsonrpc, id, result);
+
+struct Handler_CqueryCompletionSessions
+    : BaseMessageHandler<In_CqueryCompletionSessions> {
+  MethodType GetMethodType() const override { return kMethodType; }
+  void Run(In_CqueryCompletionSessions* request) override {
+    Out_CqueryCompletionSessions out;
+    out.id = request->id;
+
+    auto add_to = [](std::vector<Out_CqueryCompletionSessions::Session>* out) {
+      return [out](const std::shared_ptr<CompletionSession>& session) {
+        out->push_back({session->file.filename.path, session->MemoryUsage()});
+        return true;
+      };
+    };
+    {
+      std::lock_guard<std::mutex> lock(clang_complete->sessions_lock_);
+      clang_complete->preloaded_sessions_.IterateValues(
+          add_to(&out.result.preloaded));
+      clang_complete->completion_sessions_.IterateValues(
+          add_to(&out.result.completion));
+      out.result.memoryUsage = clang_complete->SessionMemoryUsage();
+    }
+    out.result.maxPreloadedSessions = g_config->completion.maxPreloadedSessions;
+    out.result.maxCompletionSessions =
+        g_config->completion.maxCompletionSessions;
+    if (g_config->completion.sessionMemoryBudgetMb > 0) {
+      out.result.memoryBudget =
+          size_t(g_config->completion.sessionMemoryBudgetMb) << 20;
+    }
+    QueueManager::WriteStdout(kMethodType, out);
+  }
+};
+REGISTER_MESSAGE_HANDLER(Handler_CqueryCompletionSessions);
+}  // namespace
@@ -29,8 +29,8 @@ struct Handler_CqueryDidView
     if (!FindFileOrFail(db, project, nullopt, path, &file))
       return;
 
-    clang_complete->NotifyView(path);
-    clang_complete->DiagnosticsUpdate(path);
+    clang_complete->NotifyView(path, file->def->includes);
+    clang_complete->DiagnosticsUpdate(path, false /*debounce*/);
 
     if (file->def) {
       EmitInactiveLines(working_file, file->def->inactive_regions);
@@ -6,6 +6,7 @@
 #include "platform.h"
 #include "project.h"
 #include "queue_manager.h"
+#include "scan_pool.h"
 #include "semantic_highlight_symbol_cache.h"
 #include "serializers/json.h"
 #include "timer.h"
@@ -36,7 +37,7 @@ MAKE_REFLECT_STRUCT(lsCodeLensOptions, resolveProvider);
 struct lsCompletionOptions {
   // The server provides support to resolve additional
   // information for a completion item.
-  bool resolveProvider = false;
+  bool resolveProvider = true;
 
   // The characters that trigger completion automatically.
   // vscode doesn't support trigger character sequences, so we use ':'
@@ -606,9 +607,9 @@ struct Handler_Initialize : BaseMessageHandler<In_InitializeRequest> {
       // Create two cache directories for files inside and outside of the
       // project.
       MakeDirectoryRecursive(g_config->cacheDirectory +
-                             EscapeFileName(g_config->projectRoot));
+                             GetCacheProjectDirectory());
       MakeDirectoryRecursive(g_config->cacheDirectory + '@' +
-                             EscapeFileName(g_config->projectRoot));
+                             GetCacheProjectDirectory());
 
       Timer time;
       diag_engine->Init();
@@ -640,6 +641,13 @@ struct Handler_Initialize : BaseMessageHandler<In_InitializeRequest> {
         });
       }
 
+      // Prefetch threads must be running before project files are dispatched
+      // so the initial index requests are prefetched.
+      CachePrefetcher::instance()->Start(g_config->index.prefetchThreads);
+
+      // Used by workspace/symbol and to filter code completion results.
+      ScanPool::instance()->Start(g_config->workspaceSymbol.threads);
+
       // Start scanning include directories before dispatching project
       // files, because that takes a long time.
       include_complete->Rescan();
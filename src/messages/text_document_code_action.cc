@@ -109,17 +109,18 @@ optional<QueryId::File> GetImplementationFile(QueryDatabase* db,
 
   LOG_S(INFO) << "!! Looking for impl file that starts with " << target_path;
 
-  for (auto& entry : db->usr_to_file) {
-    const AbsolutePath& path = entry.first;
+  for (auto it = db->sorted_files.lower_bound(target_path);
+       it != db->sorted_files.end() && StartsWith(it->first, target_path);
+       ++it) {
+    const std::string& path = it->first;
 
     // Do not consider header files for implementation files.
     // TODO: make file extensions configurable.
-    if (EndsWith(path.path, ".h") || EndsWith(path.path, ".hpp"))
+    if (EndsWith(path, ".h") || EndsWith(path, ".hpp"))
       continue;
 
-    if (StartsWith(path.path, target_path) && path != original_path) {
-      return entry.second;
-    }
+    if (path != original_path.path)
+      return it->second;
   }
 
   return nullopt;
@@ -452,13 +453,13 @@ struct Handler_TextDocumentCodeAction
 
         std::unordered_set<std::string> include_absolute_paths;
 
-        // Find include candidate strings.
-        for (size_t i = 0; i < db->symbols.size(); ++i) {
+        // Find include candidate strings from the symbols named
+        // |include_query|.
+        std::vector<uint32_t> symbols;
+        db->symbol_scopes.FindByName(include_query, &symbols);
+        for (uint32_t i : symbols) {
           if (include_absolute_paths.size() > kMaxResults)
             break;
-          if (db->GetSymbolDetailedName(i).find(include_query) ==
-              std::string::npos)
-            continue;
 
           optional<QueryId::File> decl_file_id =
               GetDeclarationFileForSymbol(db, db->symbols[i]);
@@ -92,7 +92,7 @@ struct Handler_TextDocumentCodeLens
     lsDocumentUri file_as_uri = request->params.textDocument.uri;
     AbsolutePath path = file_as_uri.GetAbsolutePath();
 
-    clang_complete->NotifyView(path);
+    clang_complete->NotifyView(path, {});
 
     QueryFile* file;
     if (!FindFileOrFail(db, project, request->id,
@@ -3,7 +3,9 @@
 #include "fuzzy_match.h"
 #include "include_complete.h"
 #include "message_handler.h"
+#include "query_utils.h"
 #include "queue_manager.h"
+#include "scan_pool.h"
 #include "timer.h"
 #include "working_files.h"
 
@@ -12,7 +14,10 @@
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
+#include <algorithm>
+#include <numeric>
 #include <regex>
+#include <unordered_set>
 
 namespace {
 MethodType kMethodType = "textDocument/completion";
@@ -160,93 +165,130 @@ char* tofixedbase64(T input, char* out) {
   return out;
 }
 
+// Candidates scored by each ScanPool chunk in ScoreCompletionCandidates.
+// Smaller lists are scored on the calling thread.
+constexpr size_t kScoreChunkSize = 4096;
+
+// Returns true if |low_pattern| is a subsequence of |low_text|, both of which
+// are lowercase.
+bool IsLowercaseSubsequence(std::string_view low_pattern,
+                            std::string_view low_text) {
+  size_t j = 0;
+  for (size_t i = 0; i < low_text.size() && j < low_pattern.size(); i++)
+    if (low_text[i] == low_pattern[j])
+      j++;
+  return j == low_pattern.size();
+}
+
+// Returns the fuzzy match score of every candidate for |pattern|, or kMinScore
+// if it does not match.
+std::vector<int> ScoreCompletionCandidates(
+    const CompletionCandidates& candidates,
+    const std::string& pattern) {
+  std::string low_pattern(pattern);
+  for (char& c : low_pattern)
+    c = ::tolower(c);
+  uint64_t char_set = CaseFoldingCharSet(pattern);
+  std::vector<int> scores(candidates.keys.size());
+  size_t num_chunks = (scores.size() + kScoreChunkSize - 1) / kScoreChunkSize;
+  ScanPool::instance()->Run(num_chunks, [&](size_t k) {
+    FuzzyMatcher fuzzy(pattern);
+    size_t end = std::min(scores.size(), (k + 1) * kScoreChunkSize);
+    for (size_t i = k * kScoreChunkSize; i < end; i++) {
+      // A key which lacks a character of the pattern cannot match it.
+      if (char_set & ~candidates.char_sets[i]) {
+        scores[i] = FuzzyMatcher::kMinScore;
+        continue;
+      }
+      const FuzzyMatcher::Text& key = candidates.keys[i];
+      // |low| is empty if the text is too long to be scored.
+      bool matches = key.low.size() == key.text.size()
+                         ? IsLowercaseSubsequence(low_pattern, key.low)
+                         : CaseFoldingSubsequenceMatch(pattern, key.text).first;
+      scores[i] = matches ? fuzzy.Match(key) : FuzzyMatcher::kMinScore;
+    }
+  });
+  return scores;
+}
+
 // Pre-filters completion responses before sending to vscode. This results in a
 // significantly snappier completion experience as vscode is easily overloaded
 // when given 1000+ completion items.
+//
+// Only the best kMaxResultSize candidates are sorted and copied into
+// |complete_response|, so refiltering a large cached list as the user types
+// is mostly spent scoring it.
 void FilterAndSortCompletionResponse(
     Out_TextDocumentComplete* complete_response,
+    const CompletionCandidates& candidates,
     const std::string& complete_text,
     bool has_open_paren,
     bool enable) {
-  if (!enable)
+  auto& items = complete_response->result.items;
+  if (!enable) {
+    items = candidates.items;
+    ResolveCompletionItems(&items);
     return;
+  }
 
   ScopedPerfTimer timer("FilterAndSortCompletionResponse");
+  const size_t kMaxResultSize = 100u;
 
-// Used to inject more completions.
-#if false
-  const size_t kNumIterations = 250;
-  size_t size = complete_response->result.items.size();
-  complete_response->result.items.reserve(size * (kNumIterations + 1));
-  for (size_t iteration = 0; iteration < kNumIterations; ++iteration) {
-    for (size_t i = 0; i < size; ++i) {
-      auto item = complete_response->result.items[i];
-      item.label += "#" + std::to_string(iteration);
-      complete_response->result.items.push_back(item);
+  std::vector<size_t> selected;
+  if (complete_text.empty()) {
+    // No complete text; don't run any filtering logic except to trim the
+    // items.
+    selected.resize(candidates.items.size());
+    std::iota(selected.begin(), selected.end(), size_t(0));
+  } else {
+    // Fuzzy match and remove awful candidates.
+    std::vector<int> scores =
+        ScoreCompletionCandidates(candidates, complete_text);
+    for (size_t i = 0; i < scores.size(); i++) {
+      if (scores[i] > FuzzyMatcher::kMinScore)
+        selected.push_back(i);
     }
+    auto less = [&](size_t lhs, size_t rhs) {
+      if (scores[lhs] != scores[rhs])
+        return scores[lhs] > scores[rhs];
+      const lsCompletionItem& l = candidates.items[lhs];
+      const lsCompletionItem& r = candidates.items[rhs];
+      if (l.priority_ != r.priority_)
+        return l.priority_ < r.priority_;
+      if (l.filterText->size() != r.filterText->size())
+        return l.filterText->size() < r.filterText->size();
+      if (*l.filterText != *r.filterText)
+        return *l.filterText < *r.filterText;
+      return lhs < rhs;
+    };
+    size_t num_sorted = std::min(selected.size(), kMaxResultSize);
+    std::partial_sort(selected.begin(), selected.begin() + num_sorted,
+                      selected.end(), less);
   }
-#endif
-
-  auto& items = complete_response->result.items;
-
-  auto finalize = [&]() {
-    const size_t kMaxResultSize = 100u;
-    if (items.size() > kMaxResultSize) {
-      items.resize(kMaxResultSize);
-      complete_response->result.isIncomplete = true;
-    }
-
-    if (has_open_paren) {
-      for (auto& item : items) {
-        item.insertText = item.label;
-      }
-    }
 
-    // Set sortText. Note that this happens after resizing - we could do it
-    // before, but then we should also sort by priority.
-    char buf[16];
-    for (size_t i = 0; i < items.size(); ++i)
-      items[i].sortText = tofixedbase64(i, buf);
-  };
-
-  // No complete text; don't run any filtering logic except to trim the items.
-  if (complete_text.empty()) {
-    finalize();
-    return;
+  // Trim result.
+  if (selected.size() > kMaxResultSize) {
+    selected.resize(kMaxResultSize);
+    complete_response->result.isIncomplete = true;
   }
+  items.reserve(selected.size());
+  for (size_t i : selected)
+    items.push_back(candidates.items[i]);
 
-  // Make sure all items have |filterText| set, code that follow needs it.
-  for (auto& item : items) {
-    if (!item.filterText)
-      item.filterText = item.label;
-  }
+  // Only the items which are returned need a label, detail and insert text.
+  ResolveCompletionItems(&items);
 
-  // Fuzzy match and remove awful candidates.
-  FuzzyMatcher fuzzy(complete_text);
-  for (auto& item : items) {
-    item.score_ =
-        CaseFoldingSubsequenceMatch(complete_text, *item.filterText).first
-            ? fuzzy.Match(*item.filterText)
-            : FuzzyMatcher::kMinScore;
+  if (has_open_paren) {
+    for (auto& item : items) {
+      item.insertText = item.label;
+    }
   }
-  items.erase(std::remove_if(items.begin(), items.end(),
-                             [](const lsCompletionItem& item) {
-                               return item.score_ <= FuzzyMatcher::kMinScore;
-                             }),
-              items.end());
-  std::sort(items.begin(), items.end(),
-            [](const lsCompletionItem& lhs, const lsCompletionItem& rhs) {
-              if (lhs.score_ != rhs.score_)
-                return lhs.score_ > rhs.score_;
-              if (lhs.priority_ != rhs.priority_)
-                return lhs.priority_ < rhs.priority_;
-              if (lhs.filterText->size() != rhs.filterText->size())
-                return lhs.filterText->size() < rhs.filterText->size();
-              return *lhs.filterText < *rhs.filterText;
-            });
 
-  // Trim result.
-  finalize();
+  // Set sortText. Note that this happens after resizing - we could do it
+  // before, but then we should also sort by priority.
+  char buf[16];
+  for (size_t i = 0; i < items.size(); ++i)
+    items[i].sortText = tofixedbase64(i, buf);
 }
 
 // Returns true if position is an points to a '(' character in |lines|. Skips
@@ -274,6 +316,207 @@ bool IsOpenParenOrBracket(const std::vector<std::string>& lines,
   return false;
 }
 
+// Returns the qualifier which ends right before |character| in |line|, eg,
+// "ns::Foo::" if |line| is "x = ns::Foo::ba" and |character| is at "ba", or an
+// empty string if there is none.
+std::string GetQualifierBefore(std::string_view line, int character) {
+  if (character < 2 || character > int(line.size()) ||
+      line.substr(character - 2, 2) != "::") {
+    return "";
+  }
+  int start = character;
+  while (start > 0 && (isalnum(uint8_t(line[start - 1])) ||
+                       line[start - 1] == '_' || line[start - 1] == ':')) {
+    start--;
+  }
+  return std::string(line.substr(start, character - start));
+}
+
+lsCompletionItemKind GetCompletionKind(lsSymbolKind kind) {
+  switch (kind) {
+    case lsSymbolKind::Namespace:
+      return lsCompletionItemKind::Module;
+    case lsSymbolKind::Class:
+    case lsSymbolKind::TypeAlias:
+      return lsCompletionItemKind::Class;
+    case lsSymbolKind::Struct:
+      return lsCompletionItemKind::Struct;
+    case lsSymbolKind::Enum:
+      return lsCompletionItemKind::Enum;
+    case lsSymbolKind::Interface:
+      return lsCompletionItemKind::Interface;
+    case lsSymbolKind::Method:
+    case lsSymbolKind::StaticMethod:
+      return lsCompletionItemKind::Method;
+    case lsSymbolKind::Constructor:
+      return lsCompletionItemKind::Constructor;
+    case lsSymbolKind::Function:
+      return lsCompletionItemKind::Function;
+    case lsSymbolKind::Field:
+      return lsCompletionItemKind::Field;
+    case lsSymbolKind::Property:
+      return lsCompletionItemKind::Property;
+    case lsSymbolKind::EnumMember:
+      return lsCompletionItemKind::EnumMember;
+    case lsSymbolKind::Constant:
+      return lsCompletionItemKind::Constant;
+    default:
+      return lsCompletionItemKind::Text;
+  }
+}
+
+// Upper bound on the indexed symbols offered by IndexCompletionItems.
+constexpr size_t kMaxIndexCompletionItems = 5000;
+
+// Returns the class whose definition or member function definition contains
+// |position|, if any.
+Maybe<QueryId::Type> GetEnclosingType(QueryDatabase* db,
+                                      WorkingFile* working_file,
+                                      QueryFile* file,
+                                      lsPosition position) {
+  int line = position.line;
+  int column = position.character;
+  if (optional<int> index_line =
+          working_file->GetIndexPosFromBufferPos(line, &column, false))
+    line = *index_line;
+
+  // Extents are nested, so the innermost one starts last.
+  const QueryId::SymbolRef* innermost = nullptr;
+  for (const QueryId::SymbolRef& sym : file->def->outline) {
+    if ((sym.kind == SymbolKind::Func || sym.kind == SymbolKind::Type) &&
+        sym.range.Contains(line, column) &&
+        (!innermost || innermost->range.start < sym.range.start)) {
+      innermost = &sym;
+    }
+  }
+  if (!innermost)
+    return {};
+  if (innermost->kind == SymbolKind::Func) {
+    if (const QueryFunc::Def* def = db->GetFunc(*innermost).AnyDef())
+      return def->declaring_type;
+    return {};
+  }
+  const QueryType::Def* def = db->GetType(*innermost).AnyDef();
+  if (!def || def->kind == lsSymbolKind::Namespace)
+    return {};
+  return QueryId::Type(innermost->id);
+}
+
+// Adds |type| and its bases, transitively, to |types|.
+void AddTypeAndBases(QueryDatabase* db,
+                     QueryId::Type type,
+                     std::unordered_set<QueryId::Type>* types) {
+  if (!types->insert(type).second)
+    return;
+  if (const QueryType::Def* def = db->GetType(type).AnyDef()) {
+    for (QueryId::Type base : def->bases)
+      AddTypeAndBases(db, base, types);
+  }
+}
+
+// Returns completion items for the indexed symbols which |qualifier| followed
+// by |prefix| may name, where |qualifier| is empty or ends with "::". This is
+// only a stand-in until clang has parsed the file. Locals and parameters are
+// left out, and an unqualified |prefix| only names symbols at namespace scope
+// and members of |enclosing_types|.
+std::vector<lsCompletionItem> IndexCompletionItems(
+    QueryDatabase* db,
+    const std::unordered_set<QueryId::Type>& enclosing_types,
+    const std::string& qualifier,
+    const std::string& prefix) {
+  std::vector<uint32_t> symbols;
+  if (!qualifier.empty() || prefix.empty()) {
+    // Every symbol matches an empty unqualified prefix, so only offer the
+    // global scope and the members of the enclosing classes.
+    db->symbol_scopes.Find((qualifier.empty() ? "::" : qualifier) + prefix,
+                           &symbols);
+    if (qualifier.empty()) {
+      for (QueryId::Type type : enclosing_types) {
+        const QueryType::Def* def = db->GetType(type).AnyDef();
+        if (!def)
+          continue;
+        for (QueryId::Type member : def->types)
+          symbols.push_back(uint32_t(db->GetType(member).symbol_idx));
+        for (QueryId::Func member : def->funcs)
+          symbols.push_back(uint32_t(db->GetFunc(member).symbol_idx));
+        for (QueryId::Var member : def->vars)
+          symbols.push_back(uint32_t(db->GetVar(member).symbol_idx));
+      }
+    }
+  } else {
+    uint64_t char_set = CaseFoldingCharSet(prefix);
+    for (size_t i = 0; i < db->symbols.size(); i++) {
+      if (i < db->symbol_char_sets.size() &&
+          (char_set & ~db->symbol_char_sets[i])) {
+        continue;
+      }
+      std::string_view name = db->GetSymbolShortName(i);
+      if (!name.empty() &&
+          tolower(uint8_t(name[0])) == tolower(uint8_t(prefix[0])) &&
+          CaseFoldingSubsequenceMatch(prefix, name).first) {
+        symbols.push_back(uint32_t(i));
+      }
+    }
+  }
+
+  // Returns true if a symbol whose semantic parent is |parent| can be named
+  // here. Locals never can, and members without a qualifier only in the
+  // enclosing classes.
+  auto is_visible_in = [&](SymbolIdx parent) {
+    switch (parent.kind) {
+      case SymbolKind::File:
+        return true;
+      case SymbolKind::Type: {
+        if (!qualifier.empty())
+          return true;
+        const QueryType::Def* def = db->GetType(parent).AnyDef();
+        return (def && def->kind == lsSymbolKind::Namespace) ||
+               enclosing_types.count(QueryId::Type(parent.id));
+      }
+      default:
+        return false;
+    }
+  };
+
+  std::vector<lsCompletionItem> items;
+  std::unordered_set<std::string> labels;
+  for (uint32_t i : symbols) {
+    if (items.size() >= kMaxIndexCompletionItems)
+      break;
+    if (i >= db->symbols.size())
+      continue;
+    WithEntity(db, db->symbols[i], [&](const auto& entity) {
+      const auto* def = entity.AnyDef();
+      if (!def || def->kind == lsSymbolKind::Parameter ||
+          def->kind == lsSymbolKind::TypeParameter) {
+        return;
+      }
+      // Definitions are spelled in their semantic parent, and declarations
+      // of members in their class.
+      if (def->spell) {
+        if (!is_visible_in(*def->spell))
+          return;
+      } else if (!entity.declarations.empty() &&
+                 !is_visible_in(entity.declarations[0])) {
+        return;
+      }
+      lsCompletionItem item;
+      item.label = std::string(def->ShortName());
+      // Overloads and redeclarations complete to the same text.
+      if (item.label.empty() || !labels.insert(item.label).second)
+        return;
+      item.kind = GetCompletionKind(def->kind);
+      item.detail = def->detailed_name;
+      item.filterText = item.label;
+      item.insertText = item.label;
+      item.insertTextFormat = lsInsertTextFormat::PlainText;
+      item.priority_ = 0;
+      items.push_back(std::move(item));
+    });
+  }
+  return items;
+}
+
 struct Handler_TextDocumentCompletion : MessageHandler {
   MethodType GetMethodType() const override { return kMethodType; }
 
@@ -365,20 +608,25 @@ struct Handler_TextDocumentCompletion : MessageHandler {
                          [&result](std::string_view k) {
                            return k == result.keyword;
                          })) {
-          out.result.items = PreprocessorKeywordCompletionItems(result.match);
-          FilterAndSortCompletionResponse(&out, result.keyword, has_open_paren,
+          CompletionCandidates candidates(
+              PreprocessorKeywordCompletionItems(result.match));
+          FilterAndSortCompletionResponse(&out, candidates, result.keyword,
+                                          has_open_paren,
                                           g_config->completion.filterAndSort);
         }
       } else if (result.keyword.compare("include") == 0) {
+        std::vector<lsCompletionItem> items;
         {
           // do include completion
           std::unique_lock<std::mutex> lock(
               include_complete->completion_items_mutex, std::defer_lock);
           if (include_complete->is_scanning)
             lock.lock();
-          out.result.items = include_complete->completion_items;
+          items = include_complete->completion_items;
         }
-        FilterAndSortCompletionResponse(&out, result.pattern, has_open_paren,
+        CompletionCandidates candidates(std::move(items));
+        FilterAndSortCompletionResponse(&out, candidates, result.pattern,
+                                        has_open_paren,
                                         g_config->completion.filterAndSort);
         DecorateIncludePaths(result.match, &out.result.items);
       }
@@ -392,85 +640,112 @@ struct Handler_TextDocumentCompletion : MessageHandler {
 
       QueueManager::WriteStdout(kMethodType, out);
     } else {
+      // Global results only depend on the file. Other results are cached for
+      // the stable completion position, until the buffer is edited anywhere
+      // but in the identifier being typed.
+      std::string qualifier =
+          GetQualifierBefore(buffer_line, request->params.position.character);
+      CodeCompleteCache::Key cache_key;
+      cache_key.path = path;
+      if (!is_global_completion) {
+        cache_key.position = request->params.position;
+        cache_key.edit_generation = file->edit_generation;
+      }
+
+      // |is_incomplete| makes the client ask again as the user types.
+      auto reply = [request, existing_completion, end_pos, has_open_paren](
+                       const CompletionCandidates& candidates,
+                       bool is_incomplete) {
+        Out_TextDocumentComplete out;
+        out.id = request->id;
+
+        // Emit completion results.
+        FilterAndSortCompletionResponse(&out, candidates, existing_completion,
+                                        has_open_paren,
+                                        g_config->completion.filterAndSort);
+        if (is_incomplete)
+          out.result.isIncomplete = true;
+        // Add text edits with the same text, but whose ranges include the
+        // whole token from start to end.
+        for (auto& item : out.result.items) {
+          item.textEdit = lsTextEdit{lsRange(request->params.position, end_pos),
+                                     item.insertText};
+        }
+
+        QueueManager::WriteStdout(kMethodType, out);
+      };
+
+      // Cache completion results.
+      auto cache_results = [this, is_global_completion,
+                            cache_key](std::vector<lsCompletionItem> results) {
+        auto candidates =
+            std::make_shared<const CompletionCandidates>(std::move(results));
+        if (is_global_completion)
+          global_code_complete_cache->Insert(cache_key, candidates);
+        else
+          non_global_code_complete_cache->Insert(cache_key, candidates);
+        return candidates;
+      };
+
       ClangCompleteManager::OnComplete callback =
-          [this, request, existing_completion, end_pos, is_global_completion,
-           has_open_paren](const lsRequestId& id,
-                           std::vector<lsCompletionItem> results,
-                           bool is_cached_result) {
-            Out_TextDocumentComplete out;
-            out.id = request->id;
-            out.result.items = results;
-
-            // Emit completion results.
-            FilterAndSortCompletionResponse(&out, existing_completion,
-                                            has_open_paren,
-                                            g_config->completion.filterAndSort);
-            // Add text edits with the same text, but whose ranges include the
-            // whole token from start to end.
-            for (auto& item : out.result.items) {
-              item.textEdit = lsTextEdit{
-                  lsRange(request->params.position, end_pos), item.insertText};
-            }
-
-            QueueManager::WriteStdout(kMethodType, out);
-
-            // Cache completion results.
-            if (!is_cached_result) {
-              AbsolutePath path =
-                  request->params.textDocument.uri.GetAbsolutePath();
-              if (is_global_completion) {
-                global_code_complete_cache->WithLock([&]() {
-                  global_code_complete_cache->cached_path_ = path;
-                  global_code_complete_cache->cached_results_ = results;
-                });
-              } else {
-                non_global_code_complete_cache->WithLock([&]() {
-                  non_global_code_complete_cache->cached_path_ = path;
-                  non_global_code_complete_cache->cached_completion_position_ =
-                      request->params.position;
-                  non_global_code_complete_cache->cached_results_ = results;
-                });
-              }
-            }
+          [reply, cache_results](const lsRequestId& id,
+                                 std::vector<lsCompletionItem> results,
+                                 bool is_cached_result) {
+            reply(*cache_results(std::move(results)), false /*is_incomplete*/);
           };
 
-      bool is_cache_match = false;
-      global_code_complete_cache->WithLock([&]() {
-        is_cache_match = is_global_completion &&
-                         global_code_complete_cache->cached_path_ == path &&
-                         !global_code_complete_cache->cached_results_.empty();
-      });
-      if (is_cache_match) {
+      std::shared_ptr<const CompletionCandidates> cached_results;
+      if (is_global_completion &&
+          global_code_complete_cache->TryGet(cache_key, &cached_results) &&
+          !cached_results->items.empty()) {
         ClangCompleteManager::OnComplete freshen_global =
-            [this](const lsRequestId& id, std::vector<lsCompletionItem> results,
-                   bool is_cached_result) {
+            [this, cache_key](const lsRequestId& id,
+                              std::vector<lsCompletionItem> results,
+                              bool is_cached_result) {
               assert(!is_cached_result);
-
-              // note: path is updated in the normal completion handler.
-              global_code_complete_cache->WithLock([&]() {
-                global_code_complete_cache->cached_results_ = results;
-              });
+              global_code_complete_cache->Insert(
+                  cache_key, std::make_shared<const CompletionCandidates>(
+                                 std::move(results)));
             };
 
         // Reply immediately with the cache, and then send a new completion
         // request in the background that will be freshen the global index.
-        global_code_complete_cache->WithLock([&]() {
-          callback(request->id, global_code_complete_cache->cached_results_,
-                   true /*is_cached_result*/);
-        });
+        reply(*cached_results, false /*is_incomplete*/);
         // Do not pass the request id, since we've already sent a response for
         // the id.
         clang_complete->CodeComplete(lsRequestId(), request->params,
                                      freshen_global);
-      } else if (non_global_code_complete_cache->IsCacheValid(
-                     request->params)) {
-        // Don't bother updating a non-global completion request, since cache
-        // hits are much less likely and the cache is much more likely to be up
-        // to date.
-        non_global_code_complete_cache->WithLock([&]() {
-          callback(request->id, non_global_code_complete_cache->cached_results_,
-                   true /*is_cached_result*/);
-        });
+      } else if (!is_global_completion &&
+                 non_global_code_complete_cache->TryGet(cache_key,
+                                                        &cached_results)) {
+        // Don't bother updating a non-global completion request, since the
+        // cache is invalidated by any edit which could change the results.
+        // The results are refiltered for the text typed since.
+        reply(*cached_results, false /*is_incomplete*/);
+      } else if (!clang_complete->IsCompletionReady(path) &&
+                 (is_global_completion || !qualifier.empty())) {
+        // clang has yet to parse the file, which can take many seconds, so
+        // reply with indexed symbols in the meantime. Once the client asks
+        // again, the clang results are served from the cache. Members cannot
+        // be completed from the index, as the type of the object is unknown.
+        std::unordered_set<QueryId::Type> enclosing_types;
+        QueryFile* query_file = nullptr;
+        if (qualifier.empty() &&
+            FindFileOrFail(db, project, nullopt, path, &query_file)) {
+          if (Maybe<QueryId::Type> type = GetEnclosingType(
+                  db, file, query_file, request->params.position))
+            AddTypeAndBases(db, *type, &enclosing_types);
+        }
+        CompletionCandidates candidates(IndexCompletionItems(
+            db, enclosing_types, qualifier, existing_completion));
+        reply(candidates, true /*is_incomplete*/);
+        clang_complete->CodeComplete(
+            lsRequestId(), request->params,
+            [cache_results](const lsRequestId& id,
+                            std::vector<lsCompletionItem> results,
+                            bool is_cached_result) {
+              cache_results(std::move(results));
+            });
       } else {
         // No cache hit.
         clang_complete->CodeComplete(request->id, request->params, callback);
@@ -480,7 +755,98 @@ struct Handler_TextDocumentCompletion : MessageHandler {
 };
 REGISTER_MESSAGE_HANDLER(Handler_TextDocumentCompletion);
 
+TEST_SUITE("Completion filtering") {
+  TEST_CASE("top results") {
+    std::vector<lsCompletionItem> items(3);
+    items[0].label = "barFoo";
+    items[1].label = "bar";
+    items[2].label = "foo";
+    for (int i = 0; i < 150; i++) {
+      items.emplace_back();
+      items.back().label = "foo" + std::to_string(i);
+    }
+    CompletionCandidates candidates(std::move(items));
+
+    Out_TextDocumentComplete out;
+    FilterAndSortCompletionResponse(&out, candidates, "foo", false, true);
+    REQUIRE(out.result.isIncomplete);
+    REQUIRE(out.result.items.size() == 100);
+    REQUIRE(out.result.items[0].label == "foo");
+    REQUIRE(out.result.items[1].label == "foo0");
+    for (const lsCompletionItem& item : out.result.items)
+      REQUIRE(item.label != "bar");
+
+    out = Out_TextDocumentComplete();
+    FilterAndSortCompletionResponse(&out, candidates, "bar", false, true);
+    REQUIRE(!out.result.isIncomplete);
+    REQUIRE(out.result.items.size() == 2);
+    REQUIRE(out.result.items[0].label == "bar");
+    REQUIRE(out.result.items[1].label == "barFoo");
+  }
+
+  TEST_CASE("index items") {
+    IndexFile file(AbsolutePath("a.cc"));
+    IndexId::Type ns = file.ToTypeId(HashUsr("ns"));
+    IndexId::Type foo = file.ToTypeId(HashUsr("Foo"));
+    IndexId::Func method = file.ToFuncId(HashUsr("method"));
+    auto set_def = [](auto* def, std::string detailed_name, lsSymbolKind kind,
+                      AnyId parent, SymbolKind parent_kind) {
+      size_t offset = detailed_name.rfind(':') + 1;
+      def->detailed_name = detailed_name;
+      def->short_name_offset = int16_t(offset);
+      def->short_name_size = int16_t(detailed_name.size() - offset);
+      def->kind = kind;
+      def->spell = IndexId::LexicalRef(Range(Position(1, 0)), parent,
+                                       parent_kind, Role::Definition);
+    };
+    set_def(&file.Resolve(ns)->def, "ns", lsSymbolKind::Namespace, AnyId(),
+            SymbolKind::File);
+    set_def(&file.Resolve(foo)->def, "ns::Foo", lsSymbolKind::Class, ns,
+            SymbolKind::Type);
+    set_def(&file.Resolve(method)->def, "ns::Foo::method",
+            lsSymbolKind::Method, foo, SymbolKind::Type);
+    // A global, a field and a local have the same kind or prefix.
+    set_def(&file.Resolve(file.ToVarId(HashUsr("global")))->def,
+            "ns::value_global", lsSymbolKind::Variable, ns, SymbolKind::Type);
+    set_def(&file.Resolve(file.ToVarId(HashUsr("field")))->def,
+            "ns::Foo::value_field", lsSymbolKind::Field, foo, SymbolKind::Type);
+    set_def(&file.Resolve(file.ToVarId(HashUsr("local")))->def,
+            "value_local", lsSymbolKind::Variable, method, SymbolKind::Func);
+
+    QueryDatabase db;
+    IdMap map(&db, file.id_cache);
+    IndexUpdate update =
+        IndexUpdate::CreateDelta(nullptr, &map, nullptr, &file);
+    db.ApplyIndexUpdate(&update);
+
+    auto labels = [&](const std::unordered_set<QueryId::Type>& enclosing_types,
+                      const std::string& qualifier, const std::string& prefix) {
+      std::vector<std::string> ret;
+      for (const lsCompletionItem& item :
+           IndexCompletionItems(&db, enclosing_types, qualifier, prefix))
+        ret.push_back(item.label);
+      std::sort(ret.begin(), ret.end());
+      return ret;
+    };
+    std::unordered_set<QueryId::Type> in_foo;
+    AddTypeAndBases(&db, map.ToQuery(foo), &in_foo);
+    REQUIRE(labels({}, "", "val") == std::vector<std::string>{"value_global"});
+    REQUIRE(labels(in_foo, "", "val") ==
+            (std::vector<std::string>{"value_field", "value_global"}));
+    REQUIRE(labels({}, "ns::Foo::", "") ==
+            (std::vector<std::string>{"method", "value_field"}));
+  }
+}
+
 TEST_SUITE("Completion lexing") {
+  TEST_CASE("GetQualifierBefore") {
+    REQUIRE(GetQualifierBefore("x = ns::Foo::ba", 13) == "ns::Foo::");
+    REQUIRE(GetQualifierBefore("  ::ba", 4) == "::");
+    REQUIRE(GetQualifierBefore("a.ba", 2) == "");
+    REQUIRE(GetQualifierBefore("ba", 0) == "");
+    REQUIRE(GetQualifierBefore("a:", 2) == "");
+  }
+
   TEST_CASE("NextCharIsOpenParen") {
     auto check = [](std::vector<std::string> lines, int line, int character) {
       return IsOpenParenOrBracket(lines, lsPosition(line, character));
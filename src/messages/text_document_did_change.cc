@@ -34,7 +34,7 @@ struct Handler_TextDocumentDidChange
           true /*priority*/);
     }
     clang_complete->NotifyEdit(path);
-    clang_complete->DiagnosticsUpdate(path);
+    clang_complete->DiagnosticsUpdate(path, true /*debounce*/);
   }
 };
 REGISTER_MESSAGE_HANDLER(Handler_TextDocumentDidChange);
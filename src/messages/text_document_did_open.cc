@@ -77,7 +77,9 @@ struct Handler_TextDocumentDidOpen
 
     // Clear any existing completion state and preload completion.
     clang_complete->FlushSession(entry.filename);
-    clang_complete->NotifyView(path);
+    clang_complete->NotifyView(
+        path, file && file->def ? file->def->includes
+                                : std::vector<IndexInclude>());
   }
 };
 REGISTER_MESSAGE_HANDLER(Handler_TextDocumentDidOpen);
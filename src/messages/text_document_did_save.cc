@@ -58,7 +58,7 @@ struct Handler_TextDocumentDidSave
     }
 
     clang_complete->NotifySave(path);
-    clang_complete->DiagnosticsUpdate(path);
+    clang_complete->DiagnosticsUpdate(path, false /*debounce*/);
   }
 };
 REGISTER_MESSAGE_HANDLER(Handler_TextDocumentDidSave);
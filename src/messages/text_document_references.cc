@@ -70,7 +70,11 @@ struct Handler_TextDocumentReferences
       for (const IndexInclude& include : file->def->includes)
         if (include.line == request->params.position.line) {
           // |include| is the line the cursor is on.
-          for (QueryFile& file1 : db->files)
+          auto it = db->includers.find(include.resolved_path);
+          if (it == db->includers.end())
+            break;
+          for (QueryId::File file1_id : it->second) {
+            QueryFile& file1 = db->files[file1_id.id];
             if (file1.def)
               for (const IndexInclude& include1 : file1.def->includes)
                 if (include1.resolved_path == include.resolved_path) {
@@ -82,6 +86,7 @@ struct Handler_TextDocumentReferences
                   out.result.push_back(std::move(result));
                   break;
                 }
+          }
           break;
         }
 
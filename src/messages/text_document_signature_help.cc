@@ -111,10 +111,14 @@ struct Handler_TextDocumentSignatureHelp : MessageHandler {
           Out_TextDocumentSignatureHelp out;
           out.id = id;
 
+          std::vector<lsCompletionItem> matches;
           for (auto& result : results) {
-            if (result.label != search)
-              continue;
+            if (result.label == search)
+              matches.push_back(result);
+          }
+          ResolveCompletionItems(&matches);
 
+          for (auto& result : matches) {
             lsSignatureInformation signature;
             signature.label = result.detail;
             for (auto& parameter : result.parameters_) {
@@ -146,23 +150,22 @@ struct Handler_TextDocumentSignatureHelp : MessageHandler {
           QueueManager::WriteStdout(kMethodType, out);
 
           if (!is_cached_result) {
-            signature_cache->WithLock([&]() {
-              signature_cache->cached_path_ =
-                  msg->params.textDocument.uri.GetAbsolutePath();
-              signature_cache->cached_completion_position_ =
-                  msg->params.position;
-              signature_cache->cached_results_ = results;
-            });
+            CodeCompleteCache::Key key;
+            key.path = msg->params.textDocument.uri.GetAbsolutePath();
+            key.position = msg->params.position;
+            signature_cache->Insert(
+                key, std::make_shared<const CompletionCandidates>(results));
           }
 
           delete msg;
         };
 
-    if (signature_cache->IsCacheValid(params)) {
-      signature_cache->WithLock([&]() {
-        callback(request->id, signature_cache->cached_results_,
-                 true /*is_cached_result*/);
-      });
+    CodeCompleteCache::Key key;
+    key.path = params.textDocument.uri.GetAbsolutePath();
+    key.position = params.position;
+    std::shared_ptr<const CompletionCandidates> cached_results;
+    if (signature_cache->TryGet(key, &cached_results)) {
+      callback(request->id, cached_results->items, true /*is_cached_result*/);
     } else {
       clang_complete->CodeComplete(request->id, params, std::move(callback));
     }
@@ -3,12 +3,15 @@
 #include "message_handler.h"
 #include "query_utils.h"
 #include "queue_manager.h"
+#include "scan_pool.h"
 
 #include <loguru.hpp>
 
 #include <ctype.h>
 #include <limits.h>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <functional>
 
 namespace {
@@ -43,14 +46,69 @@ bool InsertSymbolIntoResult(QueryDatabase* db,
   return true;
 }
 
+// Symbols are scanned in chunks of this size.
+constexpr size_t kScanChunkSize = 16384;
+
+// Finds the items in [0, n) accepted by |matches|, then calls |fn| on them in
+// order until it returns false. Chunks of items are scanned on the ScanPool;
+// chunks are claimed in order and are skipped once |limit| matches have been
+// found. Chunks which were skipped are scanned on this thread if |fn| still
+// wants more items.
+//
+// Returns the number of leading items which were checked, ie, n unless |fn|
+// stopped the scan.
+//
+// The caller's thread blocks until the scan finishes, so |matches| can read
+// the database without locking.
+template <typename Matches, typename Fn>
+size_t ParallelScan(size_t n, size_t limit, Matches matches, Fn fn) {
+  struct Chunk {
+    bool scanned = false;
+    std::vector<size_t> matches;
+  };
+  std::vector<Chunk> chunks((n + kScanChunkSize - 1) / kScanChunkSize);
+
+  if (ScanPool::instance()->num_threads() > 1) {
+    std::atomic<size_t> num_matches{0};
+    ScanPool::instance()->Run(chunks.size(), [&](size_t k) {
+      if (num_matches >= limit)
+        return;
+      Chunk& chunk = chunks[k];
+      size_t end = std::min(n, (k + 1) * kScanChunkSize);
+      for (size_t i = k * kScanChunkSize; i < end; i++)
+        if (matches(i))
+          chunk.matches.push_back(i);
+      chunk.scanned = true;
+      num_matches += chunk.matches.size();
+    });
+  }
+
+  for (size_t k = 0; k < chunks.size(); k++) {
+    Chunk& chunk = chunks[k];
+    if (!chunk.scanned) {
+      size_t end = std::min(n, (k + 1) * kScanChunkSize);
+      for (size_t i = k * kScanChunkSize; i < end; i++)
+        if (matches(i) && !fn(i))
+          return i + 1;
+      continue;
+    }
+    for (size_t i : chunk.matches)
+      if (!fn(i))
+        return i + 1;
+  }
+  return n;
+}
+
 struct In_WorkspaceSymbol : public RequestInMessage {
   MethodType GetMethodType() const override { return kMethodType; }
   struct Params {
     std::string query;
+    // If set, results may be sent in batches as $/progress notifications.
+    optional<lsProgressToken> partialResultToken;
   };
   Params params;
 };
-MAKE_REFLECT_STRUCT(In_WorkspaceSymbol::Params, query);
+MAKE_REFLECT_STRUCT(In_WorkspaceSymbol::Params, query, partialResultToken);
 MAKE_REFLECT_STRUCT(In_WorkspaceSymbol, id, params);
 REGISTER_IN_MESSAGE(In_WorkspaceSymbol);
 
@@ -60,99 +118,257 @@ struct Out_WorkspaceSymbol : public lsOutMessage<Out_WorkspaceSymbol> {
 };
 MAKE_REFLECT_STRUCT(Out_WorkspaceSymbol, jsonrpc, id, result);
 
+struct Out_WorkspaceSymbolPartialResult
+    : public lsOutMessage<Out_WorkspaceSymbolPartialResult> {
+  struct Params {
+    lsProgressToken token;
+    std::vector<lsSymbolInformation> value;
+  };
+  std::string method = "$/progress";
+  Params params;
+};
+MAKE_REFLECT_STRUCT(Out_WorkspaceSymbolPartialResult::Params, token, value);
+MAKE_REFLECT_STRUCT(Out_WorkspaceSymbolPartialResult, jsonrpc, method, params);
+
 ///// Fuzzy matching
 
 struct Handler_WorkspaceSymbol : BaseMessageHandler<In_WorkspaceSymbol> {
+  // Clients send a request for every character typed, so remember which
+  // symbols may match the previous query. If the next query extends it, only
+  // those symbols and the ones which were not scanned need to be looked at.
+  struct Refinement {
+    uint64_t symbols_version = 0;
+    // The previous query without whitespace.
+    std::string query;
+    // Sorted symbols below |scanned| which may match |query|.
+    std::vector<uint32_t> candidates;
+    size_t scanned = 0;
+  };
+  Refinement last_;
+
   MethodType GetMethodType() const override { return kMethodType; }
   void Run(In_WorkspaceSymbol* request) override {
     Out_WorkspaceSymbol out;
     out.id = request->id;
 
-    LOG_S(INFO) << "[querydb] Considering " << db->symbols.size()
-                << " candidates for query " << request->params.query;
-
     std::string query = request->params.query;
+    std::string query_without_space;
+    query_without_space.reserve(query.size());
+    for (char c : query)
+      if (!isspace(c))
+        query_without_space += c;
+
+    // Symbols matching |query| are a subset of the symbols matching any query
+    // it extends, so start from the previous candidates when possible.
+    Refinement refinement;
+    if (last_.symbols_version == db->symbols_version &&
+        query_without_space.compare(0, last_.query.size(), last_.query) == 0)
+      refinement = std::move(last_);
+    refinement.symbols_version = db->symbols_version;
+    refinement.query = query_without_space;
+    // Symbols to look at are |refinement.candidates| followed by the unscanned
+    // symbols.
+    size_t num_candidates = refinement.candidates.size();
+    size_t num_source =
+        num_candidates + (db->symbols.size() - refinement.scanned);
+    auto source_at = [&](size_t j) {
+      return j < num_candidates
+                 ? int(refinement.candidates[j])
+                 : int(refinement.scanned + j - num_candidates);
+    };
+
+    LOG_S(INFO) << "[querydb] Considering " << num_source
+                << " candidates for query " << query;
 
     std::unordered_set<std::string> inserted_results;
-    // db->detailed_names indices of each lsSymbolInformation in out.result
-    std::vector<int> result_indices;
     std::vector<lsSymbolInformation> unsorted_results;
+    // Fuzzy score of each entry of |unsorted_results|.
+    std::vector<int> scores;
     inserted_results.reserve(g_config->workspaceSymbol.maxNum);
-    result_indices.reserve(g_config->workspaceSymbol.maxNum);
+    unsorted_results.reserve(g_config->workspaceSymbol.maxNum);
+    scores.reserve(g_config->workspaceSymbol.maxNum);
+
+    // Results are ranked with a fuzzy matching algorithm. Awful candidates are
+    // discarded as they are found, so they do not count towards |max_num|.
+    optional<FuzzyMatcher> fuzzy;
+    if (g_config->workspaceSymbol.sort &&
+        query.size() <= FuzzyMatcher::kMaxPat)
+      fuzzy.emplace(query);
 
     // We use detailed_names without parameters for matching.
 
-    // Find exact substring matches.
-    for (int i = 0; i < db->symbols.size(); ++i) {
+    // Adds symbol |i| with fuzzy score |score| to the results. Returns false
+    // once there are enough.
+    size_t max_num = g_config->workspaceSymbol.maxNum;
+    auto add_result = [&](int i, int score) {
+      if (InsertSymbolIntoResult(db, working_files, db->symbols[i],
+                                 &unsorted_results)) {
+        scores.push_back(score);
+        if (unsorted_results.size() >= max_num)
+          return false;
+      }
+      return true;
+    };
+    // Adds symbol |i| to the results unless it is a duplicate or an awful
+    // match. Returns false once there are enough.
+    auto insert_result = [&](int i) {
       std::string_view detailed_name = db->GetSymbolDetailedName(i);
-      if (detailed_name.find(query) != std::string::npos) {
-        // Do not show the same entry twice.
-        if (!inserted_results.insert(std::string(detailed_name)).second)
-          continue;
-
-        if (InsertSymbolIntoResult(db, working_files, db->symbols[i],
-                                   &unsorted_results)) {
-          result_indices.push_back(i);
-          if (unsorted_results.size() >= g_config->workspaceSymbol.maxNum)
-            break;
-        }
+      // Do not show the same entry twice.
+      if (!inserted_results.insert(std::string(detailed_name)).second)
+        return true;
+
+      int score = 0;
+      if (fuzzy) {
+        score = fuzzy->Match(detailed_name);
+        if (score <= FuzzyMatcher::kMinScore)
+          return true;
       }
+      return add_result(i, score);
+    };
+
+    // The first |num_scoped| results are scope matches, which are already
+    // ordered best first.
+    size_t num_scoped = 0;
+
+    // Moves the results from |begin| on to |result|, best first. Scope matches
+    // go ahead of the others regardless of their fuzzy score.
+    auto take_results = [&](size_t begin,
+                            std::vector<lsSymbolInformation>* result) {
+      std::vector<size_t> order;
+      for (size_t i = begin; i < unsorted_results.size(); i++)
+        order.push_back(i);
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        bool a_scoped = a < num_scoped, b_scoped = b < num_scoped;
+        if (a_scoped || b_scoped)
+          return a_scoped && !b_scoped;
+        return scores[a] > scores[b];
+      });
+      result->reserve(result->size() + order.size());
+      for (size_t i : order)
+        result->push_back(std::move(unsorted_results[i]));
+    };
+
+    // Scoped queries such as "ns::Foo::ba" or "::Foo" are looked up in the
+    // qualified name index first, best scope matches first.
+    std::vector<uint32_t> scoped;
+    if (db->symbol_scopes.Find(query_without_space, &scoped)) {
+      for (uint32_t i : scoped)
+        if (!insert_result(int(i)))
+          break;
     }
+    num_scoped = unsorted_results.size();
 
-    // Find subsequence matches.
-    if (unsorted_results.size() < g_config->workspaceSymbol.maxNum) {
-      std::string query_without_space;
-      query_without_space.reserve(query.size());
-      for (char c : query)
-        if (!isspace(c))
-          query_without_space += c;
-
-      for (int i = 0; i < (int)db->symbols.size(); ++i) {
-        std::string_view detailed_name = db->GetSymbolDetailedName(i);
-        if (CaseFoldingSubsequenceMatch(query_without_space, detailed_name)
-                .first) {
-          // Do not show the same entry twice.
-          if (!inserted_results.insert(std::string(detailed_name)).second)
-            continue;
+    // Find exact substring matches. Unless the query is too short, only the
+    // symbols which share all of its trigrams need to be checked.
+    std::vector<uint32_t> candidates;
+    bool use_trigrams = db->symbol_trigrams.Candidates(query, &candidates);
+    auto candidate_at = [&](size_t j) {
+      return use_trigrams ? int(candidates[j]) : source_at(j);
+    };
+    if (unsorted_results.size() < max_num) {
+      ParallelScan(use_trigrams ? candidates.size() : num_source, max_num,
+                   [&](size_t j) {
+                     return db->GetSymbolDetailedName(candidate_at(j))
+                                .find(query) != std::string::npos;
+                   },
+                   [&](size_t j) { return insert_result(candidate_at(j)); });
+    }
+
+    // Scoped and substring matches are the best ones, so if the client accepts
+    // partial results send them before looking for subsequence matches.
+    size_t num_sent = 0;
+    if (request->params.partialResultToken && !unsorted_results.empty() &&
+        unsorted_results.size() < max_num) {
+      Out_WorkspaceSymbolPartialResult partial;
+      partial.params.token = *request->params.partialResultToken;
+      take_results(0, &partial.params.value);
+      num_sent = unsorted_results.size();
+      QueueManager::WriteStdout(kMethodType, partial);
+    }
 
-          if (InsertSymbolIntoResult(db, working_files, db->symbols[i],
-                                     &unsorted_results)) {
-            result_indices.push_back(i);
-            if (unsorted_results.size() >= g_config->workspaceSymbol.maxNum)
-              break;
+    // Find subsequence matches. Substring matches are also subsequence
+    // matches, so these are the candidates for the next query.
+    std::vector<uint32_t> next_candidates;
+    size_t checked = 0;
+    if (unsorted_results.size() < max_num) {
+      // Names lacking any character of the query cannot match.
+      uint64_t query_char_set = CaseFoldingCharSet(query_without_space);
+      auto matches = [&](size_t j) {
+        int i = source_at(j);
+        if (query_char_set & ~db->symbol_char_sets[i])
+          return false;
+        return CaseFoldingSubsequenceMatch(query_without_space,
+                                           db->GetSymbolDetailedName(i))
+            .first;
+      };
+
+      if (!fuzzy) {
+        checked = ParallelScan(num_source, max_num - unsorted_results.size(),
+                               matches, [&](size_t j) {
+                                 next_candidates.push_back(
+                                     uint32_t(source_at(j)));
+                                 return insert_result(source_at(j));
+                               });
+      } else {
+        // Every match is scored and only the best ones are kept, in a heap
+        // whose front is the worst of them. Ties go to the earlier symbol.
+        struct Match {
+          int score;
+          int symbol;
+        };
+        auto better = [](const Match& a, const Match& b) {
+          return a.score != b.score ? a.score > b.score : a.symbol < b.symbol;
+        };
+        std::vector<Match> best;
+        size_t num_best = max_num - unsorted_results.size();
+        best.reserve(num_best + 1);
+        checked = ParallelScan(num_source, SIZE_MAX, matches, [&](size_t j) {
+          int i = source_at(j);
+          next_candidates.push_back(uint32_t(i));
+          std::string_view detailed_name = db->GetSymbolDetailedName(i);
+          int score = fuzzy->Match(detailed_name);
+          if (score <= FuzzyMatcher::kMinScore ||
+              (best.size() == num_best && score <= best.front().score))
+            return true;
+          if (!inserted_results.insert(std::string(detailed_name)).second)
+            return true;
+          best.push_back({score, i});
+          std::push_heap(best.begin(), best.end(), better);
+          if (best.size() > num_best) {
+            std::pop_heap(best.begin(), best.end(), better);
+            best.pop_back();
           }
-        }
+          return true;
+        });
+        std::sort_heap(best.begin(), best.end(), better);
+        for (const Match& match : best)
+          add_result(match.symbol, match.score);
       }
     }
+    // Symbols after the ones which were checked keep their previous state.
+    if (checked < num_candidates) {
+      next_candidates.insert(next_candidates.end(),
+                             refinement.candidates.begin() + checked,
+                             refinement.candidates.end());
+    } else {
+      refinement.scanned += checked - num_candidates;
+    }
+    refinement.candidates = std::move(next_candidates);
+    last_ = std::move(refinement);
 
-    if (g_config->workspaceSymbol.sort &&
-        query.size() <= FuzzyMatcher::kMaxPat) {
-      // Sort results with a fuzzy matching algorithm.
-      int longest = 0;
-      for (int i : result_indices)
-        longest = std::max(longest, int(db->GetSymbolDetailedName(i).size()));
-      FuzzyMatcher fuzzy(query);
-      std::vector<std::pair<int, int>> permutation(result_indices.size());
-      for (int i = 0; i < int(result_indices.size()); i++) {
-        permutation[i] = {
-            fuzzy.Match(db->GetSymbolDetailedName(result_indices[i])), i};
-      }
-      std::sort(permutation.begin(), permutation.end(),
-                std::greater<std::pair<int, int>>());
-      out.result.reserve(result_indices.size());
-      // Discard awful candidates.
-      for (int i = 0; i < int(result_indices.size()) &&
-                      permutation[i].first > FuzzyMatcher::kMinScore;
-           i++)
-        out.result.push_back(
-            std::move(unsorted_results[permutation[i].second]));
+    // Once partial results have been sent, the rest must be sent the same way
+    // and the response carries no results.
+    if (num_sent > 0) {
+      Out_WorkspaceSymbolPartialResult partial;
+      partial.params.token = *request->params.partialResultToken;
+      take_results(num_sent, &partial.params.value);
+      if (!partial.params.value.empty())
+        QueueManager::WriteStdout(kMethodType, partial);
     } else {
-      out.result.reserve(unsorted_results.size());
-      for (const auto& entry : unsorted_results)
-        out.result.push_back(std::move(entry));
+      take_results(0, &out.result);
     }
 
-    LOG_S(INFO) << "[querydb] Found " << out.result.size()
+    LOG_S(INFO) << "[querydb] Found " << unsorted_results.size()
                 << " results for query " << query;
     QueueManager::WriteStdout(kMethodType, out);
   }
@@ -46,6 +46,12 @@ optional<AbsolutePath> TryMakeTempDirectory();
 void SetCurrentThreadName(const std::string& thread_name);
 
 optional<int64_t> GetLastModificationTime(const AbsolutePath& absolute_path);
+// Sets the modification time of |path| to the current time.
+void TouchFile(const AbsolutePath& path);
+
+// Hints to the OS that |path| will be read soon so it can start reading it into
+// the page cache. This is only an optimization and may do nothing.
+void HintFileWillBeRead(const AbsolutePath& path);
 
 void MoveFileTo(const AbsolutePath& destination, const AbsolutePath& source);
 void CopyFileTo(const AbsolutePath& destination, const AbsolutePath& source);
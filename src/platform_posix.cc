@@ -23,6 +23,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include <dirent.h>
 #include <sys/stat.h>
@@ -228,6 +229,20 @@ optional<int64_t> GetLastModificationTime(const AbsolutePath& absolute_path) {
   return buf.st_mtime;
 }
 
+void TouchFile(const AbsolutePath& path) {
+  utime(path.path.c_str(), nullptr);
+}
+
+void HintFileWillBeRead(const AbsolutePath& path) {
+#if defined(POSIX_FADV_WILLNEED)
+  int fd = open(path.path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#endif
+}
+
 void MoveFileTo(const AbsolutePath& dest, const AbsolutePath& source) {
   // TODO/FIXME - do a real move.
   CopyFileTo(dest, source);
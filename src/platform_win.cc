@@ -19,6 +19,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utime.h>
 
 #include <algorithm>
 #include <cassert>
@@ -223,6 +224,12 @@ optional<int64_t> GetLastModificationTime(const AbsolutePath& absolute_path) {
   return buf.st_mtime;
 }
 
+void TouchFile(const AbsolutePath& path) {
+  _utime(path.path.c_str(), nullptr);
+}
+
+void HintFileWillBeRead(const AbsolutePath& path) {}
+
 void MoveFileTo(const AbsolutePath& destination, const AbsolutePath& source) {
   MoveFile(source.path.c_str(), destination.path.c_str());
 }
@@ -1,7 +1,10 @@
 #include "position.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 
+#include <stdexcept>
+
 Position::Position() : line(-1), column(-1) {}
 
 Position::Position(int16_t line, int16_t column) : line(line), column(column) {}
@@ -135,46 +138,39 @@ bool Range::operator<(const Range& that) const {
   return end < that.end;
 }
 
-// Position
-void Reflect(Reader& visitor, Position& value) {
-  if (visitor.Format() == SerializeFormat::Json) {
-    std::string s = visitor.GetString();
-    value = Position(s.c_str());
-  } else {
-    Reflect(visitor, value.line);
-    Reflect(visitor, value.column);
-  }
-}
-void Reflect(Writer& visitor, Position& value) {
-  if (visitor.Format() == SerializeFormat::Json) {
-    std::string output = value.ToString();
-    visitor.String(output.c_str(), output.size());
-  } else {
-    Reflect(visitor, value.line);
-    Reflect(visitor, value.column);
-  }
-}
-
-// Range
-void Reflect(Reader& visitor, Range& value) {
-  if (visitor.Format() == SerializeFormat::Json) {
-    std::string s = visitor.GetString();
-    value = Range(s.c_str());
-  } else {
-    Reflect(visitor, value.start.line);
-    Reflect(visitor, value.start.column);
-    Reflect(visitor, value.end.line);
-    Reflect(visitor, value.end.column);
-  }
-}
-void Reflect(Writer& visitor, Range& value) {
-  if (visitor.Format() == SerializeFormat::Json) {
-    std::string output = value.ToString();
-    visitor.String(output.c_str(), output.size());
-  } else {
-    Reflect(visitor, value.start.line);
-    Reflect(visitor, value.start.column);
-    Reflect(visitor, value.end.line);
-    Reflect(visitor, value.end.column);
-  }
+int64_t ParseInteger(std::string_view* s) {
+  size_t i = 0;
+  bool negative = i < s->size() && (*s)[i] == '-';
+  if (negative)
+    i++;
+  if (i == s->size() || !isdigit((*s)[i]))
+    throw std::invalid_argument("integer");
+  int64_t ret = 0;
+  for (; i < s->size() && isdigit((*s)[i]); i++)
+    ret = ret * 10 + ((*s)[i] - '0');
+  s->remove_prefix(i);
+  return negative ? -ret : ret;
+}
+
+void ParseSeparator(std::string_view* s, char c) {
+  if (s->empty() || (*s)[0] != c)
+    throw std::invalid_argument(std::string("'") + c + "'");
+  s->remove_prefix(1);
+}
+
+Position ParsePosition(std::string_view* s) {
+  Position ret;
+  ret.line = int16_t(ParseInteger(s) - 1);
+  ParseSeparator(s, ':');
+  ret.column = int16_t(ParseInteger(s) - 1);
+  return ret;
+}
+
+Range ParseRange(std::string_view* s) {
+  Range ret;
+  ret.start = ParsePosition(s);
+  ParseSeparator(s, '-');
+  ret.end = ParsePosition(s);
+  return ret;
 }
+
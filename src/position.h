@@ -51,8 +51,68 @@ struct Range {
 };
 MAKE_HASHABLE(Range, t.start, t.end);
 
+// Parse the output of Position::ToString and Range::ToString from the start of
+// |s| and remove the parsed text from |s|. Unlike the constructors taking an
+// encoded string, these do not allocate or require NUL-termination. Throws
+// std::invalid_argument on malformed input.
+Position ParsePosition(std::string_view* s);
+Range ParseRange(std::string_view* s);
+// Parses a (possibly negative) decimal integer from the start of |s|.
+int64_t ParseInteger(std::string_view* s);
+// Removes |c| from the start of |s|, or throws std::invalid_argument.
+void ParseSeparator(std::string_view* s, char c);
+
 // Reflection
-void Reflect(Reader& visitor, Position& value);
-void Reflect(Writer& visitor, Position& value);
-void Reflect(Reader& visitor, Range& value);
-void Reflect(Writer& visitor, Range& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, Position& value) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    std::string_view s = visitor.GetStringView();
+    value = ParsePosition(&s);
+  } else {
+    visitor.StartArray();
+    Reflect(visitor, value.line);
+    Reflect(visitor, value.column);
+    visitor.EndArray();
+  }
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, Position& value) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    std::string output = value.ToString();
+    visitor.String(output.c_str(), output.size());
+  } else {
+    visitor.StartArray(2);
+    Reflect(visitor, value.line);
+    Reflect(visitor, value.column);
+    visitor.EndArray();
+  }
+}
+
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, Range& value) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    std::string_view s = visitor.GetStringView();
+    value = ParseRange(&s);
+  } else {
+    visitor.StartArray();
+    Reflect(visitor, value.start.line);
+    Reflect(visitor, value.start.column);
+    Reflect(visitor, value.end.line);
+    Reflect(visitor, value.end.column);
+    visitor.EndArray();
+  }
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, Range& value) {
+  if (visitor.Format() == SerializeFormat::Json) {
+    std::string output = value.ToString();
+    visitor.String(output.c_str(), output.size());
+  } else {
+    visitor.StartArray(4);
+    Reflect(visitor, value.start.line);
+    Reflect(visitor, value.start.column);
+    Reflect(visitor, value.end.line);
+    Reflect(visitor, value.end.column);
+    visitor.EndArray();
+  }
+}
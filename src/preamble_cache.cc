@@ -0,0 +1,329 @@
+#include "preamble_cache.h"
+
+#include "clang_index.h"
+#include "clang_utils.h"
+#include "config.h"
+#include "platform.h"
+#include "utils.h"
+#include "work_thread.h"
+
+#include <doctest/doctest.h>
+#include <loguru.hpp>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+
+namespace {
+
+std::string GetPreambleDirectory() {
+  return g_config->cacheDirectory + "preambles/";
+}
+
+std::string GetHeaderLanguage(const std::string& path) {
+  if (EndsWith(path, ".c"))
+    return "c-header";
+  if (EndsWith(path, ".m"))
+    return "objective-c-header";
+  if (EndsWith(path, ".mm"))
+    return "objective-c++-header";
+  return "c++-header";
+}
+
+// Arguments to compile the preamble of |file| on its own, as |header|.
+std::vector<std::string> GetHeaderArgs(const AbsolutePath& file,
+                                       const std::vector<std::string>& args,
+                                       const std::string& header) {
+  std::vector<std::string> ret;
+  for (const std::string& arg : args) {
+    if (arg != file.path)
+      ret.push_back(arg);
+  }
+  // The header is not next to |file|, so look up "" includes in the directory
+  // of |file| explicitly.
+  ret.push_back("-iquote");
+  ret.push_back(GetDirName(file.path));
+  ret.push_back("-x");
+  ret.push_back(GetHeaderLanguage(file.path));
+  ret.push_back(header);
+  return ret;
+}
+
+struct Inclusions {
+  CXTranslationUnit tu;
+  // True if the preamble directly includes a file without include guards.
+  bool has_unguarded = false;
+  std::vector<AbsolutePath> files;
+};
+
+void VisitInclusion(CXFile file,
+                    CXSourceLocation* stack,
+                    unsigned stack_len,
+                    CXClientData data) {
+  auto* inclusions = static_cast<Inclusions*>(data);
+  // The preamble itself.
+  if (stack_len == 0)
+    return;
+  if (stack_len == 1 &&
+      !clang_isFileMultipleIncludeGuarded(inclusions->tu, file)) {
+    inclusions->has_unguarded = true;
+  }
+  if (optional<AbsolutePath> path = FileName(file))
+    inclusions->files.push_back(*path);
+}
+
+// Returns true if none of the headers listed in |deps|, one per line after
+// their modification time, has been modified since.
+bool AreDependenciesUnchanged(const std::string& deps) {
+  std::istringstream in(deps);
+  int64_t mtime;
+  std::string path;
+  while (in >> mtime && std::getline(in >> std::ws, path)) {
+    if (GetLastModificationTime(AbsolutePath(path, false /*validate*/)) !=
+        mtime)
+      return false;
+  }
+  return true;
+}
+
+void RemovePreamble(const std::string& base) {
+  // Remove the dependency list first, so that the others are never used.
+  remove((base + ".deps").c_str());
+  remove((base + ".pch").c_str());
+  remove((base + ".h").c_str());
+}
+
+// Removes the preambles in |directory| which were used least recently, so that
+// at most |max_preambles| remain. Apply touches the dependency list of every
+// preamble it uses.
+void EvictPreambles(const std::string& directory, int max_preambles) {
+  std::vector<std::pair<int64_t, std::string>> preambles;
+  for (const std::string& path :
+       GetFilesAndDirectoriesInFolder(directory, false /*recursive*/,
+                                      true /*add_folder_to_path*/)) {
+    if (!EndsWith(path, ".deps"))
+      continue;
+    if (optional<int64_t> mtime =
+            GetLastModificationTime(AbsolutePath(path, false /*validate*/))) {
+      preambles.emplace_back(*mtime,
+                             path.substr(0, path.size() - strlen(".deps")));
+    }
+  }
+  if (int(preambles.size()) <= max_preambles)
+    return;
+  std::sort(preambles.begin(), preambles.end(),
+            std::greater<std::pair<int64_t, std::string>>());
+  for (size_t i = std::max(0, max_preambles); i < preambles.size(); i++)
+    RemovePreamble(preambles[i].second);
+}
+
+}  // namespace
+
+std::string_view ComputePreamble(std::string_view content) {
+  size_t end = 0;
+  bool has_include = false;
+  size_t i = 0;
+  while (i < content.size()) {
+    if (isspace(content[i])) {
+      i++;
+    } else if (content.substr(i, 2) == "//") {
+      i = content.find('\n', i);
+      if (i == std::string_view::npos)
+        break;
+    } else if (content.substr(i, 2) == "/*") {
+      i = content.find("*/", i + 2);
+      if (i == std::string_view::npos)
+        break;
+      i += 2;
+    } else if (content[i] == '#') {
+      size_t j = i + 1;
+      while (j < content.size() && (content[j] == ' ' || content[j] == '\t'))
+        j++;
+      size_t name_start = j;
+      while (j < content.size() && isalpha(content[j]))
+        j++;
+      std::string_view name = content.substr(name_start, j - name_start);
+      bool is_include =
+          name == "include" || name == "import" || name == "include_next";
+      if (!is_include && name != "define" && name != "undef")
+        break;
+      has_include |= is_include;
+
+      // The directive ends at the first newline which is not escaped.
+      while (j < content.size() &&
+             (content[j] != '\n' || content[j - 1] == '\\'))
+        j++;
+      if (j == content.size())
+        break;
+      i = end = j + 1;
+    } else {
+      break;
+    }
+  }
+  return has_include ? content.substr(0, end) : std::string_view();
+}
+
+// static
+PreambleCache* PreambleCache::instance() {
+  static PreambleCache* instance = new PreambleCache();
+  return instance;
+}
+
+optional<std::vector<std::string>> PreambleCache::Apply(
+    const AbsolutePath& file,
+    const std::vector<std::string>& args,
+    std::string_view preamble) {
+  if (g_config->cacheDirectory.empty() || preamble.empty())
+    return nullopt;
+
+  size_t hash = HashArguments(args);
+  hash_combine(hash, GetDirName(file.path), preamble);
+  std::string key = std::to_string(hash);
+  std::string base = GetPreambleDirectory() + key;
+
+  // The dependency list is written last, so the preamble is only used once
+  // it has been completely saved.
+  optional<std::string> deps = ReadContent(base + ".deps");
+  if (deps && AreDependenciesUnchanged(*deps) && FileExists(base + ".pch")) {
+    TouchFile(AbsolutePath(base + ".deps", false /*validate*/));
+    std::vector<std::string> ret = args;
+    ret.push_back("-iquote");
+    ret.push_back(GetDirName(file.path));
+    ret.push_back("-include-pch");
+    ret.push_back(base + ".pch");
+    return ret;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!seen_.insert(key).second)
+      return nullopt;
+    if (!started_) {
+      started_ = true;
+      WorkThread::StartThread("preamble-cache", [this]() { ThreadMain(); });
+    }
+    pending_.push_back(Request{key, file, args, std::string(preamble)});
+  }
+  cv_.notify_one();
+  return nullopt;
+}
+
+void PreambleCache::ThreadMain() {
+  ClangIndex index(0 /*exclude_declarations_from_pch*/,
+                   0 /*display_diagnostics*/);
+  while (true) {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&]() { return !pending_.empty(); });
+      request = std::move(pending_.front());
+      pending_.pop_front();
+    }
+    Save(&index, request);
+  }
+}
+
+void PreambleCache::Save(ClangIndex* index, const Request& request) {
+  std::string base = GetPreambleDirectory() + request.key;
+  MakeDirectoryRecursive(GetPreambleDirectory());
+  remove((base + ".deps").c_str());
+  WriteToFile(base + ".h", request.preamble);
+
+  std::vector<std::string> args =
+      GetHeaderArgs(request.file, request.args, base + ".h");
+  std::vector<const char*> argv;
+  for (const std::string& arg : args)
+    argv.push_back(arg.c_str());
+  CXTranslationUnit tu;
+  CXErrorCode error_code = clang_parseTranslationUnit2FullArgv(
+      index->cx_index, nullptr, argv.data(), (int)argv.size(), nullptr, 0,
+      CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization, &tu);
+  if (error_code != CXError_Success) {
+    LOG_S(WARNING) << "Unable to build preamble of " << request.file;
+    return;
+  }
+
+  bool ok = true;
+  unsigned num_diagnostics = clang_getNumDiagnostics(tu);
+  for (unsigned i = 0; i < num_diagnostics && ok; ++i) {
+    CXDiagnostic diagnostic = clang_getDiagnostic(tu, i);
+    ok = clang_getDiagnosticSeverity(diagnostic) < CXDiagnostic_Error;
+    clang_disposeDiagnostic(diagnostic);
+  }
+  Inclusions inclusions;
+  inclusions.tu = tu;
+  clang_getInclusions(tu, VisitInclusion, &inclusions);
+  ok = ok && !inclusions.has_unguarded &&
+       clang_saveTranslationUnit(tu, (base + ".pch").c_str(),
+                                 clang_defaultSaveOptions(tu)) ==
+           CXSaveError_None;
+  clang_disposeTranslationUnit(tu);
+  if (!ok) {
+    LOG_S(INFO) << "Not caching preamble of " << request.file;
+    RemovePreamble(base);
+    return;
+  }
+
+  std::string deps;
+  for (const AbsolutePath& path : inclusions.files) {
+    optional<int64_t> mtime = GetLastModificationTime(path);
+    if (!mtime) {
+      RemovePreamble(base);
+      return;
+    }
+    deps += std::to_string(*mtime) + " " + path.path + "\n";
+  }
+  WriteToFile(base + ".deps", deps);
+  LOG_S(INFO) << "Cached preamble of " << request.file << " with "
+              << inclusions.files.size() << " headers";
+  EvictPreambles(GetPreambleDirectory(),
+                 g_config->completion.maxCachedPreambles);
+
+  // Allow the preamble to be rebuilt once its headers change.
+  std::lock_guard<std::mutex> lock(mutex_);
+  seen_.erase(request.key);
+}
+
+TEST_SUITE("ComputePreamble") {
+  TEST_CASE("all") {
+    REQUIRE(ComputePreamble("int x;") == "");
+    REQUIRE(ComputePreamble("#define A\nint x;") == "");
+    REQUIRE(ComputePreamble("// c\n#include <a>\n/* c */\n#include \"b\"\n"
+                            "int x;") ==
+            "// c\n#include <a>\n/* c */\n#include \"b\"\n");
+    REQUIRE(ComputePreamble("#include <a>\n#define F(x) \\\n  x\nint x;") ==
+            "#include <a>\n#define F(x) \\\n  x\n");
+    REQUIRE(ComputePreamble("#include <a>\n#ifdef A\n#include <b>\n#endif\n") ==
+            "#include <a>\n");
+    REQUIRE(ComputePreamble("#pragma once\n#include <a>\n") == "");
+    // Unterminated directive.
+    REQUIRE(ComputePreamble("#include <a>\n#include <b>") == "#include <a>\n");
+  }
+}
+
+TEST_SUITE("PreambleCache") {
+  TEST_CASE("dependencies") {
+    optional<AbsolutePath> dir = TryMakeTempDirectory();
+    REQUIRE(dir);
+    std::string header = dir->path + "/a.h";
+    WriteToFile(header, "#pragma once\n");
+    optional<int64_t> mtime =
+        GetLastModificationTime(AbsolutePath(header, false /*validate*/));
+    REQUIRE(mtime);
+
+    REQUIRE(AreDependenciesUnchanged(""));
+    REQUIRE(AreDependenciesUnchanged(std::to_string(*mtime) + " " + header +
+                                     "\n"));
+    // Modified header.
+    REQUIRE(!AreDependenciesUnchanged(std::to_string(*mtime + 1) + " " +
+                                      header + "\n"));
+    // Removed header, after one which is unchanged.
+    REQUIRE(!AreDependenciesUnchanged(std::to_string(*mtime) + " " + header +
+                                      "\n" + std::to_string(*mtime) + " " +
+                                      dir->path + "/b.h\n"));
+    RemoveDirectoryRecursive(*dir);
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "file_types.h"
+
+#include <optional.h>
+#include <string_view.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+class ClangIndex;
+
+// Returns the leading part of |content| which only consists of #include,
+// #import, #define and #undef directives, comments and blank lines, or an
+// empty string if it has no #include or #import.
+std::string_view ComputePreamble(std::string_view content);
+
+// Precompiled headers for the leading #include block of source files, stored
+// in |cacheDirectory| so that completion sessions created after a restart do
+// not have to parse those headers again.
+//
+// libclang cannot save the implicit preamble of a translation unit, so the
+// block is compiled on its own as a header, written with
+// clang_saveTranslationUnit and passed to the file with -include-pch. The
+// headers it includes are then skipped by their include guards, which keeps
+// the implicit preamble built on top of it cheap. Blocks which directly
+// include a header without include guards are not cached.
+//
+// Saved preambles are keyed by the arguments, the directory of the file and
+// the text of the block, and are only used if none of the headers they were
+// built from has been modified since. Only the most recently used
+// |maxCachedPreambles| are kept.
+struct PreambleCache {
+  static PreambleCache* instance();
+
+  // Returns the arguments to parse |file| on top of a saved preamble for
+  // |preamble|, or nullopt if there is none. If there is none, one is built in
+  // the background.
+  optional<std::vector<std::string>> Apply(const AbsolutePath& file,
+                                           const std::vector<std::string>& args,
+                                           std::string_view preamble);
+
+ private:
+  struct Request {
+    std::string key;
+    AbsolutePath file;
+    std::vector<std::string> args;
+    std::string preamble;
+  };
+
+  void ThreadMain();
+  void Save(ClangIndex* index, const Request& request);
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool started_ = false;
+  std::deque<Request> pending_;
+  // Keys which are queued, or which could not be saved and should not be
+  // tried again.
+  std::unordered_set<std::string> seen_;
+};
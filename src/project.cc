@@ -840,6 +840,7 @@ void Project::Index(QueueManager* queue,
   ForAllFilteredFiles([&](int i, const Project::Entry& entry) {
     bool is_interactive =
         working_files->GetFileByFilename(entry.filename) != nullptr;
+    CachePrefetcher::instance()->Enqueue(entry.filename);
     queue->index_request.Enqueue(
         Index_Request(entry.filename, entry.args, is_interactive, nullopt,
                       ICacheManager::Make(), id),
@@ -1,6 +1,7 @@
 #include "query.h"
 
 #include "indexer.h"
+#include "lex_utils.h"
 #include "serializer.h"
 #include "serializers/json.h"
 
@@ -8,7 +9,9 @@
 #include <optional.h>
 #include <loguru.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cstdint>
 #include <functional>
 #include <string>
@@ -321,6 +324,7 @@ Maybe<QueryId::File> GetQueryFileIdFromPath(QueryDatabase* query_db,
 
   RawId idx = query_db->files.size();
   query_db->usr_to_file[path] = QueryId::File(idx);
+  query_db->sorted_files[path.path] = QueryId::File(idx);
   query_db->files.push_back(QueryFile(path));
   return QueryId::File(idx);
 }
@@ -751,10 +755,19 @@ void QueryDatabase::Remove(const std::vector<WithId<QueryId::File, QueryId::Type
     QueryId::Type type_id = entry.value;
 
     QueryType& type = types[type_id.id];
+    size_t num_defs = type.def.size();
     RemoveIf(&type.def,
              [&](const QueryType::Def& def) { return def.file == file_id; });
-    if (type.symbol_idx != size_t(-1) && type.def.empty())
+    if (type.symbol_idx == size_t(-1) || type.def.size() == num_defs)
+      continue;
+    if (type.def.empty()) {
       symbols[type.symbol_idx].kind = SymbolKind::Invalid;
+      symbol_trigrams.Remove(type.symbol_idx);
+      symbol_scopes.Remove(type.symbol_idx);
+    } else {
+      // The name may have come from the removed definition.
+      IndexSymbolName(type.symbol_idx);
+    }
   }
 }
 
@@ -764,10 +777,19 @@ void QueryDatabase::Remove(const std::vector<WithId<QueryId::File, QueryId::Func
     QueryId::Func func_id = entry.value;
 
     QueryFunc& func = funcs[func_id.id];
+    size_t num_defs = func.def.size();
     RemoveIf(&func.def,
              [&](const QueryFunc::Def& def) { return def.file == file_id; });
-    if (func.symbol_idx != size_t(-1) && func.def.empty())
+    if (func.symbol_idx == size_t(-1) || func.def.size() == num_defs)
+      continue;
+    if (func.def.empty()) {
       symbols[func.symbol_idx].kind = SymbolKind::Invalid;
+      symbol_trigrams.Remove(func.symbol_idx);
+      symbol_scopes.Remove(func.symbol_idx);
+    } else {
+      // The name may have come from the removed definition.
+      IndexSymbolName(func.symbol_idx);
+    }
   }
 }
 void QueryDatabase::Remove(const std::vector<WithId<QueryId::File, QueryId::Var>>& to_remove) {
@@ -776,10 +798,19 @@ void QueryDatabase::Remove(const std::vector<WithId<QueryId::File, QueryId::Var>
     QueryId::Var var_id = entry.value;
 
     QueryVar& var = vars[var_id.id];
+    size_t num_defs = var.def.size();
     RemoveIf(&var.def,
              [&](const QueryVar::Def& def) { return def.file == file_id; });
-    if (var.symbol_idx != size_t(-1) && var.def.empty())
+    if (var.symbol_idx == size_t(-1) || var.def.size() == num_defs)
+      continue;
+    if (var.def.empty()) {
       symbols[var.symbol_idx].kind = SymbolKind::Invalid;
+      symbol_trigrams.Remove(var.symbol_idx);
+      symbol_scopes.Remove(var.symbol_idx);
+    } else {
+      // The name may have come from the removed definition.
+      IndexSymbolName(var.symbol_idx);
+    }
   }
 }
 
@@ -799,8 +830,21 @@ void QueryDatabase::ApplyIndexUpdate(IndexUpdate* update) {
     VerifyUnique(def.def_var_name);                                   \
   }
 
-  for (const AbsolutePath& filename : update->files_removed)
-    files[usr_to_file[filename].id].def = nullopt;
+  if (!update->files_removed.empty() || !update->files_def_update.empty() ||
+      !update->types_removed.empty() || !update->types_def_update.empty() ||
+      !update->funcs_removed.empty() || !update->funcs_def_update.empty() ||
+      !update->vars_removed.empty() || !update->vars_def_update.empty())
+    symbols_version++;
+
+  for (const AbsolutePath& filename : update->files_removed) {
+    QueryId::File file_id = usr_to_file[filename];
+    QueryFile& file = files[file_id.id];
+    if (file.def)
+      UpdateIncluders(file_id, &*file.def, nullptr);
+    file.def = nullopt;
+    if (file.symbol_idx != size_t(-1))
+      symbol_trigrams.Remove(file.symbol_idx);
+  }
   ImportOrUpdate(update->files_def_update);
 
   Remove(update->types_removed);
@@ -822,6 +866,9 @@ void QueryDatabase::ApplyIndexUpdate(IndexUpdate* update) {
   HANDLE_MERGEABLE(vars_uses, uses, vars);
 
 #undef HANDLE_MERGEABLE
+
+  if (symbol_trigrams.NeedsRebuild())
+    RebuildSymbolTrigrams();
 }
 
 void QueryDatabase::ImportOrUpdate(
@@ -832,6 +879,8 @@ void QueryDatabase::ImportOrUpdate(
     assert(def.id.id >= 0 && def.id.id < files.size());
     QueryFile& existing = files[def.id.id];
 
+    UpdateIncluders(def.id, existing.def ? &*existing.def : nullptr,
+                    &def.value);
     existing.def = def.value;
     UpdateSymbols(&existing.symbol_idx, SymbolKind::File, def.id);
   }
@@ -848,6 +897,9 @@ void QueryDatabase::ImportOrUpdate(
     if (!TryReplaceDef(existing.def, std::move(def.value))) {
       PushFront(existing.def, std::move(def.value));
       UpdateSymbols(&existing.symbol_idx, SymbolKind::Type, def.id);
+    } else if (existing.symbol_idx != size_t(-1)) {
+      // The detailed name may have changed.
+      IndexSymbolName(existing.symbol_idx);
     }
   }
 }
@@ -863,6 +915,9 @@ void QueryDatabase::ImportOrUpdate(
     if (!TryReplaceDef(existing.def, std::move(def.value))) {
       PushFront(existing.def, std::move(def.value));
       UpdateSymbols(&existing.symbol_idx, SymbolKind::Func, def.id);
+    } else if (existing.symbol_idx != size_t(-1)) {
+      // The detailed name may have changed.
+      IndexSymbolName(existing.symbol_idx);
     }
   }
 }
@@ -878,6 +933,9 @@ void QueryDatabase::ImportOrUpdate(std::vector<QueryVar::DefUpdate>&& updates) {
       PushFront(existing.def, std::move(def.value));
       if (!existing.def.front().is_local())
         UpdateSymbols(&existing.symbol_idx, SymbolKind::Var, def.id);
+    } else if (existing.symbol_idx != size_t(-1)) {
+      // The detailed name may have changed.
+      IndexSymbolName(existing.symbol_idx);
     }
   }
 }
@@ -889,6 +947,69 @@ void QueryDatabase::UpdateSymbols(size_t* symbol_idx,
     *symbol_idx = symbols.size();
     symbols.push_back(SymbolIdx{idx, kind});
   }
+  IndexSymbolName(*symbol_idx);
+}
+
+void QueryDatabase::UpdateIncluders(QueryId::File file,
+                                    const QueryFile::Def* old_def,
+                                    const QueryFile::Def* new_def) {
+  if (old_def) {
+    for (const IndexInclude& include : old_def->includes) {
+      auto it = includers.find(include.resolved_path);
+      if (it == includers.end())
+        continue;
+      std::vector<QueryId::File>& file_ids = it->second;
+      file_ids.erase(std::remove(file_ids.begin(), file_ids.end(), file),
+                     file_ids.end());
+      if (file_ids.empty())
+        includers.erase(it);
+    }
+  }
+  if (new_def) {
+    for (const IndexInclude& include : new_def->includes) {
+      std::vector<QueryId::File>& file_ids = includers[include.resolved_path];
+      auto it = std::lower_bound(file_ids.begin(), file_ids.end(), file);
+      if (it == file_ids.end() || *it != file)
+        file_ids.insert(it, file);
+    }
+  }
+}
+
+void QueryDatabase::IndexSymbolName(size_t symbol_idx) {
+  std::string_view name = GetSymbolDetailedName(symbol_idx);
+  symbol_trigrams.Update(symbol_idx, name);
+  if (symbol_idx >= symbol_char_sets.size())
+    symbol_char_sets.resize(symbols.size());
+  symbol_char_sets[symbol_idx] = CaseFoldingCharSet(name);
+
+  if (symbols[symbol_idx].kind == SymbolKind::File)
+    return;
+  // The qualified name ends with the short name and starts after the return
+  // type or variable type, eg, "ns::Foo::bar" in "void ns::Foo::bar".
+  std::string_view short_name = GetSymbolShortName(symbol_idx);
+  if (name.empty() || short_name.data() < name.data() ||
+      short_name.data() + short_name.size() > name.data() + name.size()) {
+    symbol_scopes.Remove(symbol_idx);
+    return;
+  }
+  size_t end = short_name.data() + short_name.size() - name.data();
+  size_t start = short_name.data() - name.data();
+  for (int depth = 0; start; start--) {
+    char c = name[start - 1];
+    if (c == ')' || c == '>')
+      depth++;
+    else if (c == '(' || c == '<')
+      depth--;
+    else if (!(depth > 0 || isalnum(uint8_t(c)) || c == '_' || c == ':'))
+      break;
+  }
+  symbol_scopes.Update(symbol_idx, name.substr(start, end - start));
+}
+
+void QueryDatabase::RebuildSymbolTrigrams() {
+  symbol_trigrams.Clear();
+  for (size_t i = 0; i < symbols.size(); i++)
+    symbol_trigrams.Update(i, GetSymbolDetailedName(i));
 }
 
 // For Func, the returned name does not include parameters.
@@ -1105,6 +1226,40 @@ TEST_SUITE("query") {
     REQUIRE(db.funcs[0].uses[1].range == Range(Position(5, 0)));
   }
 
+  TEST_CASE("removing a def reindexes the name") {
+    IndexFile a(AbsolutePath("a.h"));
+    IndexFile b(AbsolutePath("b.h"));
+    IndexFile b_empty(AbsolutePath("b.h"));
+    for (IndexFile* file : {&a, &b}) {
+      IndexType* type = file->Resolve(file->ToTypeId(HashUsr("usr")));
+      type->def.detailed_name = file == &a ? "ns::Alpha" : "ns::Beta";
+      type->def.short_name_offset = 4;
+      type->def.short_name_size = int16_t(type->def.detailed_name.size() - 4);
+      type->def.spell = IndexId::LexicalRef(Range(Position(1, 0)), AnyId(0),
+                                            SymbolKind::Type, Role::Definition);
+    }
+
+    QueryDatabase db;
+    IdMap a_map(&db, a.id_cache);
+    IdMap b_map(&db, b.id_cache);
+    IdMap b_empty_map(&db, b_empty.id_cache);
+    IndexUpdate import_a =
+        IndexUpdate::CreateDelta(nullptr, &a_map, nullptr, &a);
+    IndexUpdate import_b =
+        IndexUpdate::CreateDelta(nullptr, &b_map, nullptr, &b);
+    IndexUpdate remove_b =
+        IndexUpdate::CreateDelta(&b_map, &b_empty_map, &b, &b_empty);
+    db.ApplyIndexUpdate(&import_a);
+    db.ApplyIndexUpdate(&import_b);
+    REQUIRE(db.GetSymbolDetailedName(db.types[0].symbol_idx) == "ns::Beta");
+
+    db.ApplyIndexUpdate(&remove_b);
+    REQUIRE(db.types[0].def.size() == 1);
+    size_t symbol_idx = db.types[0].symbol_idx;
+    REQUIRE(db.GetSymbolDetailedName(symbol_idx) == "ns::Alpha");
+    REQUIRE(db.symbol_char_sets[symbol_idx] == CaseFoldingCharSet("ns::Alpha"));
+  }
+
   TEST_CASE("Remove variable with usage") {
     auto load_index_from_json = [](const char* json) {
       return Deserialize(SerializeFormat::Json,
@@ -1,11 +1,14 @@
 #pragma once
 
 #include "indexer.h"
+#include "scope_index.h"
 #include "serializer.h"
+#include "trigram_index.h"
 
 #include <sparsepp/spp.h>
 
 #include <functional>
+#include <map>
 
 struct QueryFile;
 struct QueryType;
@@ -246,6 +249,18 @@ struct IndexUpdate {
 struct QueryDatabase {
   // All File/Func/Type/Var symbols.
   std::vector<SymbolIdx> symbols;
+  // Substring index over GetSymbolDetailedName of |symbols|.
+  TrigramIndex symbol_trigrams;
+  // Qualified names of the Func/Type/Var |symbols|. Also looks symbols up by
+  // their short name.
+  ScopeIndex symbol_scopes;
+  // CaseFoldingCharSet of the detailed name of |symbols|, used to reject
+  // subsequence matches before looking at the name.
+  std::vector<uint64_t> symbol_char_sets;
+  // Incremented by ApplyIndexUpdate whenever symbols may have been added,
+  // removed or renamed, so that query results derived from |symbols| can be
+  // cached.
+  uint64_t symbols_version = 0;
 
   // Raw data storage. Accessible via SymbolIdx instances.
   std::vector<QueryFile> files;
@@ -258,6 +273,11 @@ struct QueryDatabase {
   spp::sparse_hash_map<Usr, QueryId::Type> usr_to_type;
   spp::sparse_hash_map<Usr, QueryId::Func> usr_to_func;
   spp::sparse_hash_map<Usr, QueryId::Var> usr_to_var;
+  // The paths of |usr_to_file| in order, so that files sharing a prefix are
+  // adjacent.
+  std::map<std::string, QueryId::File> sorted_files;
+  // Sorted files which include each resolved include path.
+  spp::sparse_hash_map<std::string, std::vector<QueryId::File>> includers;
 
   // Removes data for the given ids in the given files.
   void Remove(const std::vector<WithId<QueryId::File, QueryId::Type>>& to_remove);
@@ -271,6 +291,11 @@ struct QueryDatabase {
   void ImportOrUpdate(std::vector<QueryFunc::DefUpdate>&& updates);
   void ImportOrUpdate(std::vector<QueryVar::DefUpdate>&& updates);
   void UpdateSymbols(size_t* symbol_idx, SymbolKind kind, AnyId idx);
+  void UpdateIncluders(QueryId::File file,
+                       const QueryFile::Def* old_def,
+                       const QueryFile::Def* new_def);
+  void IndexSymbolName(size_t symbol_idx);
+  void RebuildSymbolTrigrams();
   std::string_view GetSymbolDetailedName(RawId symbol_idx) const;
   std::string_view GetSymbolShortName(RawId symbol_idx) const;
 
@@ -0,0 +1,95 @@
+#include "scan_pool.h"
+
+#include "work_thread.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+// static
+ScanPool* ScanPool::instance() {
+  static ScanPool* instance = new ScanPool();
+  return instance;
+}
+
+void ScanPool::Start(int num_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (num_threads_ > 0)
+    return;
+  if (num_threads <= 0)
+    num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+  num_threads_ = num_threads;
+  for (int i = 1; i < num_threads; ++i) {
+    WorkThread::StartThread("scan" + std::to_string(i),
+                            [this]() { ThreadMain(); });
+  }
+}
+
+int ScanPool::num_threads() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_threads_;
+}
+
+void ScanPool::Run(size_t num_chunks, const std::function<void(size_t)>& fn) {
+  Job job;
+  job.fn = &fn;
+  job.num_chunks = num_chunks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (num_threads_ > 1 && num_chunks > 1)
+      jobs_.push_back(&job);
+  }
+  jobs_cv_.notify_all();
+
+  while (true) {
+    size_t k;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (job.next_chunk == job.num_chunks)
+        break;
+      k = ClaimNoLock(&job);
+    }
+    fn(k);
+    Finish(&job);
+  }
+
+  // Wait for the chunks claimed by pool threads.
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [&job]() { return job.num_running == 0; });
+}
+
+size_t ScanPool::ClaimNoLock(Job* job) {
+  size_t k = job->next_chunk++;
+  job->num_running++;
+  if (job->next_chunk == job->num_chunks) {
+    auto it = std::find(jobs_.begin(), jobs_.end(), job);
+    if (it != jobs_.end())
+      jobs_.erase(it);
+  }
+  return k;
+}
+
+void ScanPool::Finish(Job* job) {
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done = --job->num_running == 0 && job->next_chunk == job->num_chunks;
+  }
+  if (done)
+    done_cv_.notify_all();
+}
+
+void ScanPool::ThreadMain() {
+  while (true) {
+    Job* job;
+    size_t k;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      jobs_cv_.wait(lock, [this]() { return !jobs_.empty(); });
+      job = jobs_.front();
+      k = ClaimNoLock(job);
+    }
+    (*job->fn)(k);
+    Finish(job);
+  }
+}
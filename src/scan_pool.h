@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// A pool of threads which help request handlers scan large in-memory tables,
+// such as the symbols searched by workspace/symbol or the candidates of a
+// cached code completion. The threads are started once and shared by every
+// scan; a scan is split into chunks which the threads claim one at a time.
+struct ScanPool {
+  static ScanPool* instance();
+
+  // Starts the pool. The calling thread of Run also scans, so |num_threads|
+  // - 1 threads are started; if |num_threads| is not positive, one per CPU is
+  // used. Does nothing if the pool has already been started.
+  void Start(int num_threads);
+
+  // Number of threads started by Start.
+  int num_threads();
+
+  // Calls |fn| on every chunk in [0, num_chunks), from the calling thread and
+  // from the pool threads, and returns once all calls have returned. Chunks
+  // are claimed in order. If the pool has not been started every chunk is
+  // scanned on the calling thread.
+  void Run(size_t num_chunks, const std::function<void(size_t)>& fn);
+
+ private:
+  struct Job {
+    const std::function<void(size_t)>* fn;
+    size_t num_chunks;
+    size_t next_chunk = 0;
+    // Number of chunks being scanned.
+    size_t num_running = 0;
+  };
+
+  void ThreadMain();
+  // Claims the next chunk of |job|, which must have one left.
+  size_t ClaimNoLock(Job* job);
+  // Marks a chunk of |job| claimed by ClaimNoLock as done.
+  void Finish(Job* job);
+
+  std::mutex mutex_;
+  // Notified when a job is added.
+  std::condition_variable jobs_cv_;
+  // Notified when the last running chunk of a job is done.
+  std::condition_variable done_cv_;
+  int num_threads_ = 0;
+  // Jobs which have chunks left to be claimed.
+  std::deque<Job*> jobs_;
+};
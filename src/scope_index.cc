@@ -0,0 +1,172 @@
+#include "scope_index.h"
+
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <tuple>
+
+namespace {
+// Splits |s| at every "::" which is not inside template arguments or
+// parentheses, eg, "a<b::c>::d" => "a<b::c>", "d".
+std::vector<std::string_view> SplitSegments(std::string_view s) {
+  std::vector<std::string_view> ret;
+  size_t start = 0;
+  int depth = 0;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '<' || s[i] == '(')
+      depth++;
+    else if ((s[i] == '>' || s[i] == ')') && depth > 0)
+      depth--;
+    else if (!depth && s[i] == ':' && i + 1 < s.size() && s[i + 1] == ':') {
+      ret.push_back(s.substr(start, i - start));
+      start = i + 2;
+      i++;
+    }
+  }
+  ret.push_back(s.substr(start));
+  return ret;
+}
+}  // namespace
+
+ScopeIndex::ScopeIndex() {
+  nodes_.push_back(Node{0, 0, {}});
+}
+
+void ScopeIndex::Update(size_t symbol_idx, std::string_view qualified_name) {
+  if (qualified_name.empty()) {
+    Remove(symbol_idx);
+    return;
+  }
+  uint32_t node = 0;
+  for (std::string_view segment : SplitSegments(qualified_name)) {
+    auto it = children_.emplace(std::make_pair(node, std::string(segment)),
+                                uint32_t(nodes_.size()));
+    if (it.second) {
+      nodes_.push_back(Node{node, nodes_[node].depth + 1, {}});
+      nodes_by_name_[std::string(segment)].push_back(it.first->second);
+    }
+    node = it.first->second;
+  }
+
+  if (symbol_idx >= symbol_nodes_.size())
+    symbol_nodes_.resize(symbol_idx + 1);
+  if (symbol_nodes_[symbol_idx] == node)
+    return;
+  Remove(symbol_idx);
+  symbol_nodes_[symbol_idx] = node;
+  nodes_[node].symbols.push_back(uint32_t(symbol_idx));
+}
+
+void ScopeIndex::Remove(size_t symbol_idx) {
+  if (symbol_idx >= symbol_nodes_.size() || !symbol_nodes_[symbol_idx])
+    return;
+  std::vector<uint32_t>& symbols = nodes_[symbol_nodes_[symbol_idx]].symbols;
+  symbols.erase(std::find(symbols.begin(), symbols.end(), symbol_idx));
+  symbol_nodes_[symbol_idx] = 0;
+}
+
+bool ScopeIndex::Find(std::string_view query,
+                      std::vector<uint32_t>* symbols) const {
+  bool global = query.substr(0, 2) == "::";
+  if (global)
+    query.remove_prefix(2);
+  std::vector<std::string_view> segments = SplitSegments(query);
+  if (!global && segments.size() < 2)
+    return false;
+  symbols->clear();
+
+  // Find the scopes named by all but the last segment.
+  std::vector<uint32_t> scopes;
+  size_t i = 0;
+  if (global) {
+    scopes.push_back(0);
+  } else {
+    auto it = nodes_by_name_.find(std::string(segments[i++]));
+    if (it != nodes_by_name_.end())
+      scopes = it->second;
+  }
+  for (; i + 1 < segments.size() && scopes.size(); i++) {
+    std::vector<uint32_t> next;
+    for (uint32_t scope : scopes) {
+      auto it =
+          children_.find(std::make_pair(scope, std::string(segments[i])));
+      if (it != children_.end())
+        next.push_back(it->second);
+    }
+    scopes.swap(next);
+  }
+
+  // The last segment may be incomplete, so match it as a prefix.
+  std::string last(segments.back());
+  // (inexact, depth, symbol)
+  std::vector<std::tuple<bool, uint32_t, uint32_t>> ranked;
+  for (uint32_t scope : scopes) {
+    for (auto it = children_.lower_bound(std::make_pair(scope, last));
+         it != children_.end() && it->first.first == scope &&
+         it->first.second.compare(0, last.size(), last) == 0;
+         ++it) {
+      const Node& node = nodes_[it->second];
+      bool inexact = it->first.second.size() != last.size();
+      for (uint32_t symbol : node.symbols)
+        ranked.emplace_back(inexact, node.depth, symbol);
+    }
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const std::tuple<bool, uint32_t, uint32_t>& a,
+                      const std::tuple<bool, uint32_t, uint32_t>& b) {
+                     return std::make_pair(std::get<0>(a), std::get<1>(a)) <
+                            std::make_pair(std::get<0>(b), std::get<1>(b));
+                   });
+  for (auto& entry : ranked)
+    symbols->push_back(std::get<2>(entry));
+  return true;
+}
+
+void ScopeIndex::FindByName(std::string_view name,
+                            std::vector<uint32_t>* symbols) const {
+  symbols->clear();
+  auto it = nodes_by_name_.find(std::string(name));
+  if (it == nodes_by_name_.end())
+    return;
+  for (uint32_t node : it->second)
+    symbols->insert(symbols->end(), nodes_[node].symbols.begin(),
+                    nodes_[node].symbols.end());
+}
+
+TEST_SUITE("ScopeIndex") {
+  TEST_CASE("find") {
+    ScopeIndex index;
+    index.Update(0, "ns::Widget");
+    index.Update(1, "ns::Widget::paint");
+    index.Update(2, "ns::Widget::painter");
+    index.Update(3, "Widget::paint");
+    index.Update(4, "ns::vector<a::b>::paint");
+    index.Update(5, "other::ns::Widget::paint");
+
+    std::vector<uint32_t> symbols;
+    REQUIRE(!index.Find("Widget", &symbols));
+    REQUIRE(index.Find("Widget::paint", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({3, 1, 5, 2}));
+    REQUIRE(index.Find("ns::Widget::pai", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({1, 2, 5}));
+    REQUIRE(index.Find("::ns::Widget::paint", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({1, 2}));
+    REQUIRE(index.Find("::Widget", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({}));
+    REQUIRE(index.Find("vector<a::b>::paint", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({4}));
+    REQUIRE(index.Find("ns::", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({0}));
+
+    index.FindByName("paint", &symbols);
+    REQUIRE(symbols == std::vector<uint32_t>({1, 3, 4, 5}));
+    index.FindByName("ns", &symbols);
+    REQUIRE(symbols.empty());
+
+    // Renamed and removed symbols.
+    index.Update(1, "ns::Widget::repaint");
+    index.Remove(2);
+    REQUIRE(index.Find("ns::Widget::", &symbols));
+    REQUIRE(symbols == std::vector<uint32_t>({1, 5}));
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string_view.h>
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A trie over the segments of qualified names, ie, the symbol "ns::Foo::bar"
+// is stored at node "bar" under "Foo" under "ns" under the global scope.
+//
+// Scoped queries such as "Foo::ba" or "::ns::Foo" are answered by walking the
+// trie from every scope named like the first segment of the query, or from the
+// global scope if the query starts with "::", instead of scanning every name.
+class ScopeIndex {
+ public:
+  ScopeIndex();
+
+  // Indexes |symbol_idx| under |qualified_name|, which must not contain
+  // anything but the scopes and the name, ie, no return type or parameters.
+  void Update(size_t symbol_idx, std::string_view qualified_name);
+  void Remove(size_t symbol_idx);
+
+  // Returns false if |query| is not scoped, ie, has no "::". Otherwise, sets
+  // |symbols| to the symbols whose qualified names end with |query|, with the
+  // last segment of |query| matching a prefix of the name. Exact name matches
+  // come first, then matches in fewer enclosing scopes.
+  bool Find(std::string_view query, std::vector<uint32_t>* symbols) const;
+  // Sets |symbols| to the symbols whose unqualified name is |name|.
+  void FindByName(std::string_view name,
+                  std::vector<uint32_t>* symbols) const;
+
+ private:
+  struct Node {
+    uint32_t parent;
+    // Number of enclosing scopes.
+    uint32_t depth;
+    std::vector<uint32_t> symbols;
+  };
+  // nodes_[0] is the global scope.
+  std::vector<Node> nodes_;
+  // (parent, segment) => child. Ordered so that children with a common prefix
+  // are adjacent.
+  std::map<std::pair<uint32_t, std::string>, uint32_t> children_;
+  // Nodes named by each segment.
+  std::unordered_map<std::string, std::vector<uint32_t>> nodes_by_name_;
+  // Node of each symbol, or 0 if it is not indexed.
+  std::vector<uint32_t> symbol_nodes_;
+};
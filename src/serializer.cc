@@ -4,150 +4,27 @@
 #include "serializers/msgpack.h"
 
 #include "indexer.h"
+#include "timer.h"
+#include "utils.h"
 
 #include <doctest/doctest.h>
 #include <loguru.hpp>
 
+#include <cstdlib>
 #include <stdexcept>
 
 bool gTestOutputMode = false;
 
-//// Elementary types
-
-void Reflect(Reader& visitor, uint8_t& value) {
-  if (!visitor.IsInt())
-    throw std::invalid_argument("uint8_t");
-  value = (uint8_t)visitor.GetInt();
-}
-void Reflect(Writer& visitor, uint8_t& value) {
-  visitor.Int(value);
-}
-
-void Reflect(Reader& visitor, short& value) {
-  if (!visitor.IsInt())
-    throw std::invalid_argument("short");
-  value = (short)visitor.GetInt();
-}
-void Reflect(Writer& visitor, short& value) {
-  visitor.Int(value);
-}
-
-void Reflect(Reader& visitor, unsigned short& value) {
-  if (!visitor.IsInt())
-    throw std::invalid_argument("unsigned short");
-  value = (unsigned short)visitor.GetInt();
-}
-void Reflect(Writer& visitor, unsigned short& value) {
-  visitor.Int(value);
-}
-
-void Reflect(Reader& visitor, int& value) {
-  if (!visitor.IsInt())
-    throw std::invalid_argument("int");
-  value = visitor.GetInt();
-}
-void Reflect(Writer& visitor, int& value) {
-  visitor.Int(value);
-}
-
-void Reflect(Reader& visitor, unsigned& value) {
-  if (!visitor.IsUint64())
-    throw std::invalid_argument("unsigned");
-  value = visitor.GetUint32();
-}
-void Reflect(Writer& visitor, unsigned& value) {
-  visitor.Uint32(value);
-}
-
-void Reflect(Reader& visitor, long& value) {
-  if (!visitor.IsInt64())
-    throw std::invalid_argument("long");
-  value = long(visitor.GetInt64());
-}
-void Reflect(Writer& visitor, long& value) {
-  visitor.Int64(value);
-}
-
-void Reflect(Reader& visitor, unsigned long& value) {
-  if (!visitor.IsUint64())
-    throw std::invalid_argument("unsigned long");
-  value = (unsigned long)visitor.GetUint64();
-}
-void Reflect(Writer& visitor, unsigned long& value) {
-  visitor.Uint64(value);
-}
-
-void Reflect(Reader& visitor, long long& value) {
-  if (!visitor.IsInt64())
-    throw std::invalid_argument("long long");
-  value = visitor.GetInt64();
-}
-void Reflect(Writer& visitor, long long& value) {
-  visitor.Int64(value);
-}
-
-void Reflect(Reader& visitor, unsigned long long& value) {
-  if (!visitor.IsUint64())
-    throw std::invalid_argument("unsigned long long");
-  value = visitor.GetUint64();
-}
-void Reflect(Writer& visitor, unsigned long long& value) {
-  visitor.Uint64(value);
-}
-
-void Reflect(Reader& visitor, double& value) {
-  if (!visitor.IsDouble())
-    throw std::invalid_argument("double");
-  value = visitor.GetDouble();
-}
-void Reflect(Writer& visitor, double& value) {
-  visitor.Double(value);
-}
-
-void Reflect(Reader& visitor, bool& value) {
-  if (!visitor.IsBool())
-    throw std::invalid_argument("bool");
-  value = visitor.GetBool();
-}
-void Reflect(Writer& visitor, bool& value) {
-  visitor.Bool(value);
-}
-
-void Reflect(Reader& visitor, std::string& value) {
-  if (!visitor.IsString())
-    throw std::invalid_argument("std::string");
-  value = visitor.GetString();
-}
-void Reflect(Writer& visitor, std::string& value) {
-  visitor.String(value.c_str(), (rapidjson::SizeType)value.size());
-}
-
-void Reflect(Reader&, std::string_view&) {
-  assert(0);
-}
-void Reflect(Writer& visitor, std::string_view& data) {
-  if (data.empty())
-    visitor.String("");
-  else
-    visitor.String(&data[0], (rapidjson::SizeType)data.size());
-}
-
-void Reflect(Reader& visitor, JsonNull& value) {
-  visitor.GetNull();
-}
-
-void Reflect(Writer& visitor, JsonNull& value) {
-  visitor.Null();
-}
-
 // TODO: Move this to indexer.cc
-void Reflect(Reader& visitor, IndexInclude& value) {
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, IndexInclude& value) {
   REFLECT_MEMBER_START();
   REFLECT_MEMBER(line);
   REFLECT_MEMBER(resolved_path);
   REFLECT_MEMBER_END();
 }
-void Reflect(Writer& visitor, IndexInclude& value) {
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, IndexInclude& value) {
   REFLECT_MEMBER_START();
   REFLECT_MEMBER(line);
   if (gTestOutputMode) {
@@ -161,14 +38,14 @@ void Reflect(Writer& visitor, IndexInclude& value) {
   REFLECT_MEMBER_END();
 }
 
-template <typename Def>
-void ReflectHoverAndComments(Reader& visitor, Def& def) {
+template <typename TVisitor, typename Def>
+IfReader<TVisitor> ReflectHoverAndComments(TVisitor& visitor, Def& def) {
   ReflectMember(visitor, "hover", def.hover);
   ReflectMember(visitor, "comments", def.comments);
 }
 
-template <typename Def>
-void ReflectHoverAndComments(Writer& visitor, Def& def) {
+template <typename TVisitor, typename Def>
+IfWriter<TVisitor> ReflectHoverAndComments(TVisitor& visitor, Def& def) {
   // Don't emit empty hover and comments in JSON test mode.
   if (!gTestOutputMode || !def.hover.empty())
     ReflectMember(visitor, "hover", def.hover);
@@ -176,8 +53,8 @@ void ReflectHoverAndComments(Writer& visitor, Def& def) {
     ReflectMember(visitor, "comments", def.comments);
 }
 
-template <typename Def>
-void ReflectShortName(Reader& visitor, Def& def) {
+template <typename TVisitor, typename Def>
+IfReader<TVisitor> ReflectShortName(TVisitor& visitor, Def& def) {
   if (gTestOutputMode) {
     std::string short_name;
     ReflectMember(visitor, "short_name", short_name);
@@ -190,8 +67,8 @@ void ReflectShortName(Reader& visitor, Def& def) {
   }
 }
 
-template <typename Def>
-void ReflectShortName(Writer& visitor, Def& def) {
+template <typename TVisitor, typename Def>
+IfWriter<TVisitor> ReflectShortName(TVisitor& visitor, Def& def) {
   if (gTestOutputMode) {
     std::string short_name(
         def.detailed_name.substr(def.short_name_offset, def.short_name_size));
@@ -266,7 +143,9 @@ void Reflect(TVisitor& visitor, IndexVar& value) {
 }
 
 // IndexFile
-bool ReflectMemberStart(Writer& visitor, IndexFile& value) {
+template <typename TVisitor>
+IfWriter<TVisitor, bool> ReflectMemberStart(TVisitor& visitor,
+                                            IndexFile& value) {
   // FIXME
   auto it = value.id_cache.usr_to_type_id.find(HashUsr(""));
   if (it != value.id_cache.usr_to_type_id.end()) {
@@ -296,22 +175,6 @@ void Reflect(TVisitor& visitor, IndexFile& value) {
   REFLECT_MEMBER_END();
 }
 
-void Reflect(Reader& visitor, SerializeFormat& value) {
-  std::string fmt = visitor.GetString();
-  value = fmt[0] == 'm' ? SerializeFormat::MessagePack : SerializeFormat::Json;
-}
-
-void Reflect(Writer& visitor, SerializeFormat& value) {
-  switch (value) {
-    case SerializeFormat::Json:
-      visitor.String("json");
-      break;
-    case SerializeFormat::MessagePack:
-      visitor.String("msgpack");
-      break;
-  }
-}
-
 std::string Serialize(SerializeFormat format, IndexFile& file) {
   switch (format) {
     case SerializeFormat::Json: {
@@ -332,13 +195,13 @@ std::string Serialize(SerializeFormat format, IndexFile& file) {
     }
     case SerializeFormat::MessagePack: {
       msgpack::sbuffer buf;
-      msgpack::packer<msgpack::sbuffer> pk(&buf);
-      MessagePackWriter msgpack_writer(&pk);
+      MessagePackWriter msgpack_writer(&buf);
       uint64_t magic = IndexFile::kMajorVersion;
       int version = IndexFile::kMinorVersion;
       Reflect(msgpack_writer, magic);
       Reflect(msgpack_writer, version);
       Reflect(msgpack_writer, file);
+      msgpack_writer.Finish();
       return std::string(buf.data(), buf.size());
     }
   }
@@ -357,17 +220,37 @@ std::unique_ptr<IndexFile> Deserialize(
   std::unique_ptr<IndexFile> file;
   switch (format) {
     case SerializeFormat::Json: {
-      rapidjson::Document reader;
-      if (gTestOutputMode || !expected_version) {
-        reader.Parse(serialized_index_content.c_str());
-      } else {
+      size_t offset = 0;
+      if (!gTestOutputMode && expected_version) {
         const char* p = strchr(serialized_index_content.c_str(), '\n');
         if (!p)
           return nullptr;
         if (atoi(serialized_index_content.c_str()) != *expected_version)
           return nullptr;
-        reader.Parse(p + 1);
+        offset = p + 1 - serialized_index_content.c_str();
       }
+
+      // Try the streaming reader first, it is much faster than building a DOM
+      // but cannot read some members which are out of order. Caches written
+      // by a different cquery version may have them.
+      {
+        file = std::make_unique<IndexFile>(path);
+        file->file_contents = file_content;
+        try {
+          JsonStreamReader json_reader(serialized_index_content.c_str() +
+                                       offset);
+          Reflect(json_reader, *file);
+          if (!json_reader.AtEnd())
+            throw std::invalid_argument("content after the index");
+          break;
+        } catch (std::invalid_argument& e) {
+          LOG_S(INFO) << "'" << path << "': falling back to DOM reader; "
+                      << e.what();
+        }
+      }
+
+      rapidjson::Document reader;
+      reader.Parse(serialized_index_content.c_str() + offset);
       if (reader.HasParseError())
         return nullptr;
 
@@ -387,21 +270,15 @@ std::unique_ptr<IndexFile> Deserialize(
     case SerializeFormat::MessagePack: {
       try {
         int major, minor;
-        if (serialized_index_content.size() < 8)
-          throw std::invalid_argument("Invalid");
-        msgpack::unpacker upk;
-        upk.reserve_buffer(serialized_index_content.size());
-        memcpy(upk.buffer(), serialized_index_content.data(),
-               serialized_index_content.size());
-        upk.buffer_consumed(serialized_index_content.size());
-        file = std::make_unique<IndexFile>(path);
-        file->file_contents = file_content;
-        MessagePackReader reader(&upk);
+        MessagePackReader reader(serialized_index_content.data(),
+                                 serialized_index_content.size());
         Reflect(reader, major);
         Reflect(reader, minor);
         if (major != IndexFile::kMajorVersion ||
             minor != IndexFile::kMinorVersion)
           throw std::invalid_argument("Invalid version");
+        file = std::make_unique<IndexFile>(path);
+        file->file_contents = file_content;
         Reflect(reader, *file);
       } catch (std::invalid_argument& e) {
         LOG_S(INFO) << "Failed to deserialize msgpack '" << path
@@ -435,6 +312,35 @@ void SetTestOutputMode() {
   gTestOutputMode = true;
 }
 
+namespace {
+struct SchemaV1 {
+  int kept = 0;
+  std::string removed;
+  std::vector<Range> ranges;
+};
+MAKE_REFLECT_STRUCT(SchemaV1, kept, removed, ranges);
+
+struct SchemaV2 {
+  std::vector<Range> ranges;
+  int added = 42;
+  int kept = 0;
+};
+MAKE_REFLECT_STRUCT(SchemaV2, ranges, added, kept);
+
+struct OuterV1 {
+  std::vector<SchemaV1> removed;
+  SchemaV1 inner;
+  int last = 0;
+};
+MAKE_REFLECT_STRUCT(OuterV1, removed, inner, last);
+
+struct OuterV2 {
+  int last = 0;
+  SchemaV2 inner;
+};
+MAKE_REFLECT_STRUCT(OuterV2, last, inner);
+}  // namespace
+
 TEST_SUITE("Serializer utils") {
   TEST_CASE("GetBaseName") {
     REQUIRE(GetBaseName("foo.cc") == "foo.cc");
@@ -446,3 +352,244 @@ TEST_SUITE("Serializer utils") {
             "foobar/bar/");  // TODO: Should be bar, but good enough.
   }
 }
+
+TEST_SUITE("Serializer MessagePack") {
+  TEST_CASE("unknown members are skipped and missing members defaulted") {
+    SchemaV1 v1;
+    v1.kept = 3;
+    v1.removed = "removed";
+    v1.ranges.push_back(Range(Position(1, 2), Position(3, 4)));
+    v1.ranges.push_back(Range(Position(5, 6), Position(7, 8)));
+
+    msgpack::sbuffer buf;
+    MessagePackWriter writer(&buf);
+    Reflect(writer, v1);
+    writer.Finish();
+
+    MessagePackReader reader(buf.data(), buf.size());
+    SchemaV2 v2;
+    Reflect(reader, v2);
+
+    REQUIRE(v2.kept == 3);
+    REQUIRE(v2.added == 42);
+    REQUIRE(v2.ranges == v1.ranges);
+  }
+
+  TEST_CASE("unknown nested objects are skipped") {
+    OuterV1 v1;
+    v1.removed.resize(20);
+    v1.removed[0].ranges.push_back(Range(Position(1, 2), Position(3, 4)));
+    v1.inner.kept = 5;
+    v1.last = 6;
+
+    msgpack::sbuffer buf;
+    MessagePackWriter writer(&buf);
+    Reflect(writer, v1);
+    Reflect(writer, v1.last);
+    writer.Finish();
+
+    MessagePackReader reader(buf.data(), buf.size());
+    OuterV2 v2;
+    Reflect(reader, v2);
+    int after = 0;
+    Reflect(reader, after);
+
+    REQUIRE(v2.last == 6);
+    REQUIRE(v2.inner.kept == 5);
+    REQUIRE(v2.inner.added == 42);
+    REQUIRE(after == 6);
+  }
+
+  TEST_CASE("rejects input without a member name table") {
+    msgpack::sbuffer buf;
+    MessagePackWriter writer(&buf);
+    SchemaV1 v1;
+    Reflect(writer, v1);
+    REQUIRE_THROWS_AS(MessagePackReader(buf.data(), buf.size()),
+                      std::invalid_argument);
+  }
+}
+
+TEST_SUITE("Serializer JSON") {
+  TEST_CASE("streaming reader") {
+    std::string json = R"({"ranges": ["2:3-4:5", "6:7-8:9"], "kept": 3})";
+    JsonStreamReader reader(json.c_str());
+    SchemaV2 value;
+    Reflect(reader, value);
+    REQUIRE(reader.AtEnd());
+    REQUIRE(value.ranges.size() == 2);
+    REQUIRE(value.ranges[0] == Range(Position(1, 2), Position(3, 4)));
+    REQUIRE(value.ranges[1] == Range(Position(5, 6), Position(7, 8)));
+    REQUIRE(value.added == 42);
+    REQUIRE(value.kept == 3);
+  }
+
+  TEST_CASE("streaming reader skips unknown members") {
+    std::string json =
+        R"({"removed": {"kept": [1, {}]}, "ranges": [], "other": "",)"
+        R"( "kept": 3, "last": null})";
+    JsonStreamReader reader(json.c_str());
+    SchemaV2 value;
+    Reflect(reader, value);
+    REQUIRE(reader.AtEnd());
+    REQUIRE(value.ranges.empty());
+    REQUIRE(value.added == 42);
+    REQUIRE(value.kept == 3);
+  }
+
+  TEST_CASE("streaming reader reads members which are not known yet") {
+    std::string json = R"({"kept": 3, "ranges": ["2:3-4:5"]})";
+    JsonStreamReader reader(json.c_str());
+    SchemaV2 value;
+    Reflect(reader, value);
+    REQUIRE(reader.AtEnd());
+    REQUIRE(value.ranges.size() == 1);
+    REQUIRE(value.kept == 3);
+  }
+
+  TEST_CASE("streaming reader rejects out of order members") {
+    std::string json =
+        R"([{"ranges": [], "added": 1, "kept": 2}, {"kept": 3, "ranges": []}])";
+    JsonStreamReader reader(json.c_str());
+    std::vector<SchemaV2> values;
+    REQUIRE_THROWS_AS(Reflect(reader, values), std::invalid_argument);
+  }
+
+  TEST_CASE("streaming reader rejects truncated input") {
+    std::string json = R"({"ranges": ["2:3-4:5"], "kept": 3)";
+    JsonStreamReader reader(json.c_str());
+    SchemaV2 value;
+    REQUIRE_THROWS_AS(Reflect(reader, value), std::invalid_argument);
+  }
+}
+
+TEST_SUITE("Serializer benchmark") {
+  // Compares reflecting through Reader& and Writer& with reflecting against the
+  // concrete JSON and MessagePack types. Skipped by default, run with
+  //   --test-unit --test-suite="Serializer benchmark" --no-skip
+  // If CQUERY_BENCHMARK_CACHE_DIR is set, every .mpack cache below it is used;
+  // otherwise a synthetic file is.
+  std::vector<std::unique_ptr<IndexFile>> LoadBenchmarkFiles() {
+    std::vector<std::unique_ptr<IndexFile>> files;
+    if (const char* dir = getenv("CQUERY_BENCHMARK_CACHE_DIR")) {
+      GetFilesAndDirectoriesInFolder(
+          dir, true /*recursive*/, true /*add_folder_to_path*/,
+          [&](const std::string& path) {
+            if (!EndsWith(path, ".mpack"))
+              return;
+            optional<std::string> content = ReadContent(path);
+            std::unique_ptr<IndexFile> file =
+                content ? Deserialize(SerializeFormat::MessagePack, path,
+                                      *content, "", nullopt)
+                        : nullptr;
+            if (file)
+              files.push_back(std::move(file));
+          });
+      return files;
+    }
+
+    auto file =
+        std::make_unique<IndexFile>(AbsolutePath("/benchmark.cc", false));
+    for (int i = 0; i < 2000; i++) {
+      IndexFunc* func = file->Resolve(file->ToFuncId(Usr(i + 1)));
+      func->def.detailed_name = "void f" + std::to_string(i) + "()";
+      for (int j = 0; j < 100; j++)
+        func->uses.push_back(IndexId::LexicalRef(
+            Range(Position(j, 0), Position(j, 5)), AnyId(i), SymbolKind::Func,
+            Role::Reference));
+    }
+    files.push_back(std::move(file));
+    return files;
+  }
+
+  template <typename TVisitor, typename T>
+  IfReader<TVisitor> ReflectBenchmark(TVisitor& visitor,
+                                      T& value,
+                                      bool concrete) {
+    if (concrete)
+      Reflect(visitor, value);
+    else
+      Reflect(static_cast<Reader&>(visitor), value);
+  }
+  template <typename TVisitor, typename T>
+  IfWriter<TVisitor> ReflectBenchmark(TVisitor& visitor,
+                                      T& value,
+                                      bool concrete) {
+    if (concrete)
+      Reflect(visitor, value);
+    else
+      Reflect(static_cast<Writer&>(visitor), value);
+  }
+
+  std::string StoreBenchmarkFile(SerializeFormat format,
+                                 IndexFile& file,
+                                 bool concrete) {
+    switch (format) {
+      case SerializeFormat::Json: {
+        rapidjson::StringBuffer output;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(output);
+        JsonWriter json_writer(&writer);
+        ReflectBenchmark(json_writer, file, concrete);
+        return output.GetString();
+      }
+      case SerializeFormat::MessagePack: {
+        msgpack::sbuffer buf;
+        MessagePackWriter writer(&buf);
+        ReflectBenchmark(writer, file, concrete);
+        writer.Finish();
+        return std::string(buf.data(), buf.size());
+      }
+    }
+    return "";
+  }
+
+  void LoadBenchmarkFile(SerializeFormat format,
+                         const std::string& content,
+                         IndexFile* file,
+                         bool concrete) {
+    switch (format) {
+      case SerializeFormat::Json: {
+        JsonStreamReader reader(content.c_str());
+        ReflectBenchmark(reader, *file, concrete);
+        break;
+      }
+      case SerializeFormat::MessagePack: {
+        MessagePackReader reader(content.data(), content.size());
+        ReflectBenchmark(reader, *file, concrete);
+        break;
+      }
+    }
+  }
+
+  TEST_CASE("static and virtual dispatch" * doctest::skip()) {
+    std::vector<std::unique_ptr<IndexFile>> files = LoadBenchmarkFiles();
+    REQUIRE(!files.empty());
+
+    for (SerializeFormat format :
+         {SerializeFormat::Json, SerializeFormat::MessagePack}) {
+      for (bool concrete : {false, true}) {
+        long long store = 0, load = 0;
+        size_t bytes = 0;
+        for (const std::unique_ptr<IndexFile>& file : files) {
+          Timer timer;
+          std::string content = StoreBenchmarkFile(format, *file, concrete);
+          store += timer.ElapsedMicroseconds();
+          bytes += content.size();
+
+          timer.Reset();
+          IndexFile loaded(file->path);
+          LoadBenchmarkFile(format, content, &loaded, concrete);
+          load += timer.ElapsedMicroseconds();
+
+          REQUIRE(loaded.funcs.size() == file->funcs.size());
+        }
+        const char* name =
+            format == SerializeFormat::Json ? "JSON" : "MessagePack";
+        LOG_S(INFO) << name << ", " << (concrete ? "concrete" : "virtual")
+                    << " dispatch over " << files.size() << " files ("
+                    << bytes / 1024 << "KiB): store took " << store / 1000
+                    << "ms, load took " << load / 1000 << "ms";
+      }
+    }
+  }
+}
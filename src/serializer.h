@@ -9,6 +9,7 @@
 #include <cassert>
 #include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -42,12 +43,24 @@ class Reader {
   virtual uint64_t GetUint64() = 0;
   virtual double GetDouble() = 0;
   virtual std::string GetString() = 0;
+  // Like GetString, but does not copy the string. The view is only valid until
+  // the next call on the reader.
+  virtual std::string_view GetStringView() = 0;
 
   virtual bool HasMember(const char* x) = 0;
   virtual std::unique_ptr<Reader> operator[](const char* x) = 0;
 
   virtual void IterArray(std::function<void(Reader&)> fn) = 0;
   virtual void DoMember(const char* name, std::function<void(Reader&)> fn) = 0;
+
+  // Called before and after the members of an object are read. Only needed by
+  // readers which consume their input sequentially.
+  virtual void StartObject() {}
+  virtual void EndObject() {}
+  // Called before and after reading a fixed number of values which are written
+  // as an array, such as the fields of a Range in binary formats.
+  virtual void StartArray() {}
+  virtual void EndArray() {}
 };
 
 class Writer {
@@ -83,17 +96,30 @@ struct optionals_mandatory_tag {};
   ReflectMember(visitor, #name, value.name, optionals_mandatory_tag{})
 #define REFLECT_MEMBER2(name, value) ReflectMember(visitor, name, value)
 
+// Reflect functions are templates on the visitor type, constrained to readers
+// or writers. Passing a concrete reader or writer (ie, JsonWriter) instead of a
+// Reader& or Writer& lets the compiler call it directly instead of through the
+// vtable.
+template <typename TVisitor, typename T = void>
+using IfReader =
+    typename std::enable_if<std::is_base_of<Reader, TVisitor>::value, T>::type;
+template <typename TVisitor, typename T = void>
+using IfWriter =
+    typename std::enable_if<std::is_base_of<Writer, TVisitor>::value, T>::type;
+
 #define MAKE_REFLECT_TYPE_PROXY(type_name) \
   MAKE_REFLECT_TYPE_PROXY2(type_name, std::underlying_type<type_name>::type)
-#define MAKE_REFLECT_TYPE_PROXY2(type, as_type)       \
-  inline void Reflect(Reader& visitor, type& value) { \
-    as_type value0;                                   \
-    ::Reflect(visitor, value0);                       \
-    value = static_cast<type>(value0);                \
-  }                                                   \
-  inline void Reflect(Writer& visitor, type& value) { \
-    auto value0 = static_cast<as_type>(value);        \
-    ::Reflect(visitor, value0);                       \
+#define MAKE_REFLECT_TYPE_PROXY2(type, as_type)                \
+  template <typename TVisitor>                                 \
+  IfReader<TVisitor> Reflect(TVisitor& visitor, type& value) { \
+    as_type value0;                                            \
+    ::Reflect(visitor, value0);                                \
+    value = static_cast<type>(value0);                         \
+  }                                                            \
+  template <typename TVisitor>                                 \
+  IfWriter<TVisitor> Reflect(TVisitor& visitor, type& value) { \
+    auto value0 = static_cast<as_type>(value);                 \
+    ::Reflect(visitor, value0);                                \
   }
 
 #define _MAPPABLE_REFLECT_MEMBER(name) REFLECT_MEMBER(name);
@@ -132,64 +158,190 @@ struct optionals_mandatory_tag {};
 
 // Reflects the struct so it is serialized as an array instead of an object.
 // This currently only supports writers.
-#define MAKE_REFLECT_STRUCT_WRITER_AS_ARRAY(type, ...) \
-  inline void Reflect(Writer& visitor, type& value) {  \
-    visitor.StartArray(NUM_VA_ARGS(__VA_ARGS__));      \
-    MACRO_MAP(_MAPPABLE_REFLECT_ARRAY, __VA_ARGS__)    \
-    visitor.EndArray();                                \
+#define MAKE_REFLECT_STRUCT_WRITER_AS_ARRAY(type, ...)         \
+  template <typename TVisitor>                                 \
+  IfWriter<TVisitor> Reflect(TVisitor& visitor, type& value) { \
+    visitor.StartArray(NUM_VA_ARGS(__VA_ARGS__));              \
+    MACRO_MAP(_MAPPABLE_REFLECT_ARRAY, __VA_ARGS__)            \
+    visitor.EndArray();                                        \
   }
 
 //// Elementary types
 
-void Reflect(Reader& visitor, uint8_t& value);
-void Reflect(Writer& visitor, uint8_t& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, uint8_t& value) {
+  if (!visitor.IsInt())
+    throw std::invalid_argument("uint8_t");
+  value = (uint8_t)visitor.GetInt();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, uint8_t& value) {
+  visitor.Int(value);
+}
 
-void Reflect(Reader& visitor, short& value);
-void Reflect(Writer& visitor, short& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, short& value) {
+  if (!visitor.IsInt())
+    throw std::invalid_argument("short");
+  value = (short)visitor.GetInt();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, short& value) {
+  visitor.Int(value);
+}
 
-void Reflect(Reader& visitor, unsigned short& value);
-void Reflect(Writer& visitor, unsigned short& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, unsigned short& value) {
+  if (!visitor.IsInt())
+    throw std::invalid_argument("unsigned short");
+  value = (unsigned short)visitor.GetInt();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, unsigned short& value) {
+  visitor.Int(value);
+}
 
-void Reflect(Reader& visitor, int& value);
-void Reflect(Writer& visitor, int& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, int& value) {
+  if (!visitor.IsInt())
+    throw std::invalid_argument("int");
+  value = visitor.GetInt();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, int& value) {
+  visitor.Int(value);
+}
 
-void Reflect(Reader& visitor, unsigned& value);
-void Reflect(Writer& visitor, unsigned& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, unsigned& value) {
+  if (!visitor.IsUint64())
+    throw std::invalid_argument("unsigned");
+  value = visitor.GetUint32();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, unsigned& value) {
+  visitor.Uint32(value);
+}
 
-void Reflect(Reader& visitor, long& value);
-void Reflect(Writer& visitor, long& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, long& value) {
+  if (!visitor.IsInt64())
+    throw std::invalid_argument("long");
+  value = long(visitor.GetInt64());
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, long& value) {
+  visitor.Int64(value);
+}
 
-void Reflect(Reader& visitor, unsigned long& value);
-void Reflect(Writer& visitor, unsigned long& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, unsigned long& value) {
+  if (!visitor.IsUint64())
+    throw std::invalid_argument("unsigned long");
+  value = (unsigned long)visitor.GetUint64();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, unsigned long& value) {
+  visitor.Uint64(value);
+}
 
-void Reflect(Reader& visitor, long long& value);
-void Reflect(Writer& visitor, long long& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, long long& value) {
+  if (!visitor.IsInt64())
+    throw std::invalid_argument("long long");
+  value = visitor.GetInt64();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, long long& value) {
+  visitor.Int64(value);
+}
 
-void Reflect(Reader& visitor, unsigned long long& value);
-void Reflect(Writer& visitor, unsigned long long& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, unsigned long long& value) {
+  if (!visitor.IsUint64())
+    throw std::invalid_argument("unsigned long long");
+  value = visitor.GetUint64();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, unsigned long long& value) {
+  visitor.Uint64(value);
+}
 
-void Reflect(Reader& visitor, double& value);
-void Reflect(Writer& visitor, double& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, double& value) {
+  if (!visitor.IsDouble())
+    throw std::invalid_argument("double");
+  value = visitor.GetDouble();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, double& value) {
+  visitor.Double(value);
+}
 
-void Reflect(Reader& visitor, bool& value);
-void Reflect(Writer& visitor, bool& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, bool& value) {
+  if (!visitor.IsBool())
+    throw std::invalid_argument("bool");
+  value = visitor.GetBool();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, bool& value) {
+  visitor.Bool(value);
+}
 
-void Reflect(Reader& visitor, std::string& value);
-void Reflect(Writer& visitor, std::string& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, std::string& value) {
+  if (!visitor.IsString())
+    throw std::invalid_argument("std::string");
+  value = visitor.GetString();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, std::string& value) {
+  visitor.String(value.c_str(), value.size());
+}
 
-void Reflect(Reader& visitor, std::string_view& view);
-void Reflect(Writer& visitor, std::string_view& view);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor&, std::string_view&) {
+  assert(0);
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, std::string_view& data) {
+  if (data.empty())
+    visitor.String("");
+  else
+    visitor.String(&data[0], data.size());
+}
 
-void Reflect(Reader& visitor, JsonNull& value);
-void Reflect(Writer& visitor, JsonNull& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, JsonNull& value) {
+  visitor.GetNull();
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, JsonNull& value) {
+  visitor.Null();
+}
 
-void Reflect(Reader& visitor, SerializeFormat& value);
-void Reflect(Writer& visitor, SerializeFormat& value);
+template <typename TVisitor>
+IfReader<TVisitor> Reflect(TVisitor& visitor, SerializeFormat& value) {
+  std::string fmt = visitor.GetString();
+  value = fmt[0] == 'm' ? SerializeFormat::MessagePack : SerializeFormat::Json;
+}
+template <typename TVisitor>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, SerializeFormat& value) {
+  switch (value) {
+    case SerializeFormat::Json:
+      visitor.String("json");
+      break;
+    case SerializeFormat::MessagePack:
+      visitor.String("msgpack");
+      break;
+  }
+}
 
 //// Type constructors
 
-template <typename T>
-void Reflect(Reader& visitor, optional<T>& value) {
+template <typename TVisitor, typename T>
+IfReader<TVisitor> Reflect(TVisitor& visitor, optional<T>& value) {
   if (visitor.IsNull()) {
     visitor.GetNull();
     return;
@@ -198,8 +350,8 @@ void Reflect(Reader& visitor, optional<T>& value) {
   Reflect(visitor, real_value);
   value = std::move(real_value);
 }
-template <typename T>
-void Reflect(Writer& visitor, optional<T>& value) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, optional<T>& value) {
   if (value)
     Reflect(visitor, *value);
   else
@@ -207,8 +359,8 @@ void Reflect(Writer& visitor, optional<T>& value) {
 }
 
 // The same as std::optional
-template <typename T>
-void Reflect(Reader& visitor, Maybe<T>& value) {
+template <typename TVisitor, typename T>
+IfReader<TVisitor> Reflect(TVisitor& visitor, Maybe<T>& value) {
   if (visitor.IsNull()) {
     visitor.GetNull();
     return;
@@ -217,54 +369,58 @@ void Reflect(Reader& visitor, Maybe<T>& value) {
   Reflect(visitor, real_value);
   value = std::move(real_value);
 }
-template <typename T>
-void Reflect(Writer& visitor, Maybe<T>& value) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, Maybe<T>& value) {
   if (value)
     Reflect(visitor, *value);
   else
     visitor.Null();
 }
 
-template <typename T>
-void ReflectMember(Writer& visitor, const char* name, optional<T>& value) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> ReflectMember(TVisitor& visitor,
+                                 const char* name,
+                                 optional<T>& value) {
   // For TypeScript optional property key?: value in the spec,
-  // We omit both key and value if value is std::nullopt (null) for JsonWriter
-  // to reduce output. But keep it for other serialization formats.
-  if (value || visitor.Format() != SerializeFormat::Json) {
+  // We omit both key and value if value is std::nullopt (null) to reduce
+  // output. Readers leave missing members defaulted.
+  if (value) {
     visitor.Key(name);
     Reflect(visitor, value);
   }
 }
 
 // The same as std::optional
-template <typename T>
-void ReflectMember(Writer& visitor, const char* name, Maybe<T>& value) {
-  if (value.HasValue() || visitor.Format() != SerializeFormat::Json) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> ReflectMember(TVisitor& visitor,
+                                 const char* name,
+                                 Maybe<T>& value) {
+  if (value.HasValue()) {
     visitor.Key(name);
     Reflect(visitor, value);
   }
 }
 
-template <typename T>
-void ReflectMember(Writer& visitor,
-                   const char* name,
-                   T& value,
-                   optionals_mandatory_tag) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> ReflectMember(TVisitor& visitor,
+                                 const char* name,
+                                 T& value,
+                                 optionals_mandatory_tag) {
   visitor.Key(name);
   Reflect(visitor, value);
 }
 
 // std::vector
-template <typename T>
-void Reflect(Reader& visitor, std::vector<T>& values) {
-  visitor.IterArray([&](Reader& entry) {
+template <typename TVisitor, typename T>
+IfReader<TVisitor> Reflect(TVisitor& visitor, std::vector<T>& values) {
+  visitor.IterArray([&](TVisitor& entry) {
     T entry_value;
     Reflect(entry, entry_value);
     values.push_back(std::move(entry_value));
   });
 }
-template <typename T>
-void Reflect(Writer& visitor, std::vector<T>& values) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> Reflect(TVisitor& visitor, std::vector<T>& values) {
   visitor.StartArray(values.size());
   for (auto& value : values)
     Reflect(visitor, value);
@@ -273,34 +429,37 @@ void Reflect(Writer& visitor, std::vector<T>& values) {
 
 // ReflectMember
 
-inline void DefaultReflectMemberStart(Writer& visitor) {
+template <typename TVisitor>
+void DefaultReflectMemberStart(TVisitor& visitor) {
   visitor.StartObject();
 }
-inline void DefaultReflectMemberStart(Reader& visitor) {}
 
-template <typename T>
-bool ReflectMemberStart(Reader& visitor, T& value) {
+template <typename TVisitor, typename T>
+IfReader<TVisitor, bool> ReflectMemberStart(TVisitor& visitor, T& value) {
+  visitor.StartObject();
   return false;
 }
-template <typename T>
-bool ReflectMemberStart(Writer& visitor, T& value) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor, bool> ReflectMemberStart(TVisitor& visitor, T& value) {
   visitor.StartObject();
   return true;
 }
 
-template <typename T>
-void ReflectMemberEnd(Reader& visitor, T& value) {}
-template <typename T>
-void ReflectMemberEnd(Writer& visitor, T& value) {
+template <typename TVisitor, typename T>
+void ReflectMemberEnd(TVisitor& visitor, T& value) {
   visitor.EndObject();
 }
 
-template <typename T>
-void ReflectMember(Reader& visitor, const char* name, T& value) {
-  visitor.DoMember(name, [&](Reader& child) { Reflect(child, value); });
+template <typename TVisitor, typename T>
+IfReader<TVisitor> ReflectMember(TVisitor& visitor,
+                                 const char* name,
+                                 T& value) {
+  visitor.DoMember(name, [&](TVisitor& child) { Reflect(child, value); });
 }
-template <typename T>
-void ReflectMember(Writer& visitor, const char* name, T& value) {
+template <typename TVisitor, typename T>
+IfWriter<TVisitor> ReflectMember(TVisitor& visitor,
+                                 const char* name,
+                                 T& value) {
   visitor.Key(name);
   Reflect(visitor, value);
 }
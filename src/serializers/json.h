@@ -4,8 +4,14 @@
 
 #include <rapidjson/document.h>
 #include <rapidjson/prettywriter.h>
+#include <rapidjson/reader.h>
 
-class JsonReader : public Reader {
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <unordered_set>
+
+class JsonReader final : public Reader {
   rapidjson::GenericValue<rapidjson::UTF8<>>* m_;
   std::vector<const char*> path_;
 
@@ -30,6 +36,9 @@ class JsonReader : public Reader {
   uint64_t GetUint64() override { return m_->GetUint64(); }
   double GetDouble() override { return m_->GetDouble(); }
   std::string GetString() override { return m_->GetString(); }
+  std::string_view GetStringView() override {
+    return std::string_view(m_->GetString(), m_->GetStringLength());
+  }
 
   bool HasMember(const char* x) override { return m_->HasMember(x); }
   std::unique_ptr<Reader> operator[](const char* x) override {
@@ -37,7 +46,13 @@ class JsonReader : public Reader {
     return std::unique_ptr<JsonReader>(new JsonReader(&sub));
   }
 
+  // IterArray and DoMember have non-virtual overloads so that callers which
+  // know the reader type can avoid the std::function.
   void IterArray(std::function<void(Reader&)> fn) override {
+    IterArray<decltype(fn)&>(fn);
+  }
+  template <typename Fn>
+  void IterArray(Fn&& fn) {
     if (!m_->IsArray())
       throw std::invalid_argument("array");
     // Use "0" to indicate any element for now.
@@ -52,6 +67,10 @@ class JsonReader : public Reader {
   }
 
   void DoMember(const char* name, std::function<void(Reader&)> fn) override {
+    DoMember<decltype(fn)&>(name, fn);
+  }
+  template <typename Fn>
+  void DoMember(const char* name, Fn&& fn) {
     path_.push_back(name);
     auto it = m_->FindMember(name);
     if (it != m_->MemberEnd()) {
@@ -74,7 +93,319 @@ class JsonReader : public Reader {
   }
 };
 
-class JsonWriter : public Writer {
+// Reads JSON token by token with rapidjson's iterative (pull) parser instead
+// of building a DOM. |json| is neither modified nor copied. Strings returned by
+// GetStringView point into the parser's buffer and are only valid until the
+// next call on the reader; the next token is not parsed until then.
+//
+// Members are expected in the order they are reflected in, which is the order
+// they are written in. Missing members keep their default value and unknown
+// members are skipped. Members which are out of order are read from the input
+// again if they are unknown when they are skipped; otherwise
+// std::invalid_argument is thrown and callers should fall back to JsonReader.
+class JsonStreamReader final : public Reader {
+  // The value is parsed without looking for content after it, so that members
+  // can be read from the middle of the input. See AtEnd.
+  static constexpr unsigned kParseFlags =
+      rapidjson::kParseDefaultFlags | rapidjson::kParseStopWhenDoneFlag;
+
+  enum class Token {
+    Null,
+    Bool,
+    Int64,
+    Uint64,
+    Double,
+    String,
+    Key,
+    StartObject,
+    EndObject,
+    StartArray,
+    EndArray,
+    // The end of the input.
+    Done
+  };
+
+  // Records the most recent parse event.
+  struct Handler {
+    Token token;
+    bool b;
+    int64_t i64;
+    uint64_t u64;
+    double d;
+    const char* str;
+    rapidjson::SizeType len;
+
+    bool Null() { return Set(Token::Null); }
+    bool Bool(bool x) {
+      b = x;
+      return Set(Token::Bool);
+    }
+    bool Int(int x) { return Int64(x); }
+    bool Uint(unsigned x) { return Uint64(x); }
+    bool Int64(int64_t x) {
+      if (x >= 0)
+        return Uint64(uint64_t(x));
+      i64 = x;
+      return Set(Token::Int64);
+    }
+    bool Uint64(uint64_t x) {
+      u64 = x;
+      return Set(Token::Uint64);
+    }
+    bool Double(double x) {
+      d = x;
+      return Set(Token::Double);
+    }
+    bool RawNumber(const char*, rapidjson::SizeType, bool) { return false; }
+    bool String(const char* x, rapidjson::SizeType n, bool) {
+      str = x;
+      len = n;
+      return Set(Token::String);
+    }
+    bool Key(const char* x, rapidjson::SizeType n, bool) {
+      str = x;
+      len = n;
+      return Set(Token::Key);
+    }
+    bool StartObject() { return Set(Token::StartObject); }
+    bool EndObject(rapidjson::SizeType) { return Set(Token::EndObject); }
+    bool StartArray() { return Set(Token::StartArray); }
+    bool EndArray(rapidjson::SizeType) { return Set(Token::EndArray); }
+
+    bool Set(Token t) {
+      token = t;
+      return true;
+    }
+  };
+
+  // A member which was skipped while looking for another one.
+  struct Skipped {
+    std::string name;
+    // The start of the value in the input.
+    const char* value;
+  };
+  // An object whose members are being read.
+  struct Object {
+    std::vector<Skipped> skipped;
+    // Members which were looked for and assumed to be missing.
+    std::vector<const char*> missing;
+  };
+
+  const char* json_;
+  rapidjson::StringStream stream_;
+  rapidjson::Reader reader_;
+  Handler handler_;
+  // True if the current token has been consumed. The next one is parsed by
+  // Peek, since parsing it may overwrite the string of the current one.
+  bool consumed_ = true;
+  std::vector<const char*> path_;
+  std::vector<Object> objects_;
+  // Every member name passed to DoMember, by address and by value.
+  std::unordered_set<const char*> known_;
+  std::unordered_set<std::string_view> known_names_;
+
+  const Handler& Peek() {
+    if (consumed_) {
+      consumed_ = false;
+      if (reader_.IterativeParseComplete())
+        handler_.token = Token::Done;
+      else if (!reader_.IterativeParseNext<kParseFlags>(stream_, handler_))
+        throw std::invalid_argument("parse error");
+    }
+    return handler_;
+  }
+  // Consumes the current token, which must be |token|.
+  void Expect(Token token, const char* what) {
+    if (Peek().token != token)
+      throw std::invalid_argument(std::string(what) + " expected at " +
+                                  GetPath());
+    consumed_ = true;
+  }
+  bool IsKey(const char* name) {
+    const Handler& handler = Peek();
+    return handler.token == Token::Key &&
+           strncmp(handler.str, name, handler.len) == 0 &&
+           name[handler.len] == '\0';
+  }
+  // Consumes the current value, including the members or items of objects
+  // and arrays.
+  void SkipValue() {
+    int depth = 0;
+    do {
+      Token token = Peek().token;
+      if (token == Token::Done)
+        throw std::invalid_argument("value expected at " + GetPath());
+      consumed_ = true;
+      if (token == Token::StartObject || token == Token::StartArray)
+        depth++;
+      else if (token == Token::EndObject || token == Token::EndArray)
+        depth--;
+    } while (depth > 0);
+  }
+  // Consumes the current member, remembering where its value starts.
+  void SkipMember() {
+    std::string name(handler_.str, handler_.len);
+    consumed_ = true;
+    // The stream is right after the name; the value follows the separator.
+    const char* value = json_ + stream_.Tell();
+    while (*value && *value != ':')
+      value++;
+    SkipValue();
+    objects_.back().skipped.push_back(Skipped{std::move(name), value + 1});
+  }
+
+ public:
+  JsonStreamReader(const char* json) : json_(json), stream_(json) {
+    reader_.IterativeParseInit();
+  }
+  SerializeFormat Format() const override { return SerializeFormat::Json; }
+
+  // True if the whole input has been read.
+  bool AtEnd() {
+    if (Peek().token != Token::Done)
+      return false;
+    for (const char* p = json_ + stream_.Tell(); *p; p++)
+      if (!isspace(uint8_t(*p)))
+        return false;
+    return true;
+  }
+
+  bool IsBool() override { return Peek().token == Token::Bool; }
+  bool IsNull() override { return Peek().token == Token::Null; }
+  bool IsArray() override { return Peek().token == Token::StartArray; }
+  bool IsInt() override {
+    const Handler& handler = Peek();
+    return (handler.token == Token::Int64 && handler.i64 >= INT_MIN) ||
+           (handler.token == Token::Uint64 && handler.u64 <= INT_MAX);
+  }
+  bool IsInt64() override {
+    const Handler& handler = Peek();
+    return handler.token == Token::Int64 ||
+           (handler.token == Token::Uint64 && handler.u64 <= INT64_MAX);
+  }
+  bool IsUint64() override { return Peek().token == Token::Uint64; }
+  bool IsDouble() override { return Peek().token == Token::Double; }
+  bool IsString() override { return Peek().token == Token::String; }
+
+  void GetNull() override { Expect(Token::Null, "null"); }
+  bool GetBool() override {
+    Expect(Token::Bool, "bool");
+    return handler_.b;
+  }
+  int GetInt() override { return int(GetInt64()); }
+  uint32_t GetUint32() override { return uint32_t(GetUint64()); }
+  int64_t GetInt64() override {
+    if (Peek().token == Token::Int64) {
+      consumed_ = true;
+      return handler_.i64;
+    }
+    Expect(Token::Uint64, "int64");
+    return int64_t(handler_.u64);
+  }
+  uint64_t GetUint64() override {
+    Expect(Token::Uint64, "uint64");
+    return handler_.u64;
+  }
+  double GetDouble() override {
+    Expect(Token::Double, "double");
+    return handler_.d;
+  }
+  std::string GetString() override {
+    return std::string(GetStringView());
+  }
+  std::string_view GetStringView() override {
+    Expect(Token::String, "string");
+    return std::string_view(handler_.str, handler_.len);
+  }
+
+  bool HasMember(const char* x) override { return IsKey(x); }
+  std::unique_ptr<Reader> operator[](const char* x) override {
+    throw std::invalid_argument("random access");
+  }
+
+  void IterArray(std::function<void(Reader&)> fn) override {
+    IterArray<decltype(fn)&>(fn);
+  }
+  template <typename Fn>
+  void IterArray(Fn&& fn) {
+    Expect(Token::StartArray, "array");
+    // Use "0" to indicate any element for now.
+    path_.push_back("0");
+    while (Peek().token != Token::EndArray)
+      fn(*this);
+    path_.pop_back();
+    consumed_ = true;
+  }
+
+  void DoMember(const char* name, std::function<void(Reader&)> fn) override {
+    DoMember<decltype(fn)&>(name, fn);
+  }
+  template <typename Fn>
+  void DoMember(const char* name, Fn&& fn) {
+    if (objects_.empty())
+      throw std::invalid_argument("object expected at " + GetPath());
+    if (known_.insert(name).second)
+      known_names_.insert(name);
+
+    std::vector<Skipped>& skipped = objects_.back().skipped;
+    for (size_t i = 0; i < skipped.size(); i++)
+      if (skipped[i].name == name) {
+        JsonStreamReader member(skipped[i].value);
+        member.path_ = path_;
+        member.path_.push_back(name);
+        skipped.erase(skipped.begin() + i);
+        fn(member);
+        return;
+      }
+
+    // Members before this one are skipped if no DoMember has asked for them,
+    // since they are unknown or come later. A member which has been asked for
+    // means this one is missing.
+    while (Peek().token == Token::Key) {
+      if (IsKey(name)) {
+        path_.push_back(name);
+        consumed_ = true;
+        fn(*this);
+        path_.pop_back();
+        return;
+      }
+      if (known_names_.count(std::string_view(handler_.str, handler_.len)))
+        break;
+      SkipMember();
+    }
+    objects_.back().missing.push_back(name);
+  }
+
+  void StartObject() override {
+    Expect(Token::StartObject, "object");
+    objects_.emplace_back();
+  }
+  void EndObject() override {
+    // Skip unknown members. A member which was assumed to be missing is out
+    // of order and has not been read.
+    while (Peek().token == Token::Key) {
+      for (const char* name : objects_.back().missing)
+        if (IsKey(name))
+          throw std::invalid_argument(std::string("out of order member ") +
+                                      name + " at " + GetPath());
+      consumed_ = true;
+      SkipValue();
+    }
+    Expect(Token::EndObject, "object end");
+    objects_.pop_back();
+  }
+
+  std::string GetPath() const {
+    std::string ret;
+    for (auto& t : path_) {
+      ret += '/';
+      ret += t;
+    }
+    return ret;
+  }
+};
+
+class JsonWriter final : public Writer {
   rapidjson::Writer<rapidjson::StringBuffer>* m_;
 
  public:
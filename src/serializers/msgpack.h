@@ -4,82 +4,543 @@
 
 #include <msgpack.hpp>
 
-class MessagePackReader : public Reader {
-  msgpack::unpacker* pk_;
-  msgpack::object_handle oh_;
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+// Objects are written as msgpack maps from a small integer tag to the member's
+// value. Tags index a table of member names which is written once, after all
+// values, and is followed by the offset of the table as a big-endian uint32:
+//
+//   value* [name*] offset
+//
+// Readers map member names to tags with the table, so unknown members are
+// skipped and missing members keep their default value. Adding, removing or
+// reordering members does not invalidate existing caches.
+//
+// Types which write several scalars (ie, Range) write them as a fixed-size
+// array, so every member is a single msgpack value.
+
+class MessagePackReader final : public Reader {
+  // A map whose members are being read.
+  struct Object {
+    const char* begin;
+    uint32_t size;
+    // Position and index of the member after the last one read. Members are
+    // usually read in the order they were written, so lookups start there.
+    const char* next;
+    uint32_t next_index;
+  };
+
+  const char* p_;
+  const char* end_;
+  std::vector<Object> objects_;
+  // The tag of every member name.
+  std::unordered_map<std::string_view, uint32_t> tags_;
+
+  void Need(size_t n) const {
+    if (size_t(end_ - p_) < n)
+      throw std::invalid_argument("truncated");
+  }
+  uint8_t PeekByte() const {
+    Need(1);
+    return uint8_t(*p_);
+  }
+  // Reads a big-endian unsigned integer of |n| bytes.
+  uint64_t ReadBig(size_t n) {
+    Need(n);
+    uint64_t ret = 0;
+    for (size_t i = 0; i < n; i++)
+      ret = ret << 8 | uint8_t(p_[i]);
+    p_ += n;
+    return ret;
+  }
+
+  // Reads an integer, which is negative if |*negative| is set.
+  uint64_t ReadInteger(bool* negative) {
+    uint8_t c = PeekByte();
+    *negative = false;
+    if (c <= 0x7f) {
+      p_++;
+      return c;
+    }
+    if (c >= 0xe0) {
+      p_++;
+      *negative = true;
+      return uint64_t(int64_t(int8_t(c)));
+    }
+    p_++;
+    switch (c) {
+      case 0xcc:
+        return ReadBig(1);
+      case 0xcd:
+        return ReadBig(2);
+      case 0xce:
+        return ReadBig(4);
+      case 0xcf:
+        return ReadBig(8);
+      case 0xd0:
+        *negative = true;
+        return uint64_t(int64_t(int8_t(ReadBig(1))));
+      case 0xd1:
+        *negative = true;
+        return uint64_t(int64_t(int16_t(ReadBig(2))));
+      case 0xd2:
+        *negative = true;
+        return uint64_t(int64_t(int32_t(ReadBig(4))));
+      case 0xd3: {
+        uint64_t ret = ReadBig(8);
+        *negative = int64_t(ret) < 0;
+        return ret;
+      }
+    }
+    p_--;
+    throw std::invalid_argument("integer");
+  }
   template <typename T>
-  T Get() {
-    T ret = oh_.get().as<T>();
-    pk_->next(oh_);
+  T GetInteger() {
+    bool negative;
+    uint64_t x = ReadInteger(&negative);
+    if (negative ? int64_t(x) < int64_t(std::numeric_limits<T>::min())
+                 : x > uint64_t(std::numeric_limits<T>::max()))
+      throw std::invalid_argument("integer range");
+    return T(x);
+  }
+
+  // Reads the header of an array or map and returns its size.
+  uint32_t ReadArrayHeader() {
+    uint8_t c = PeekByte();
+    p_++;
+    if ((c & 0xf0) == 0x90)
+      return c & 0x0f;
+    if (c == 0xdc)
+      return uint32_t(ReadBig(2));
+    if (c == 0xdd)
+      return uint32_t(ReadBig(4));
+    p_--;
+    throw std::invalid_argument("array");
+  }
+  uint32_t ReadMapHeader() {
+    uint8_t c = PeekByte();
+    p_++;
+    if ((c & 0xf0) == 0x80)
+      return c & 0x0f;
+    if (c == 0xde)
+      return uint32_t(ReadBig(2));
+    if (c == 0xdf)
+      return uint32_t(ReadBig(4));
+    p_--;
+    throw std::invalid_argument("object");
+  }
+  std::string_view ReadString() {
+    uint8_t c = PeekByte();
+    p_++;
+    size_t len;
+    if ((c & 0xe0) == 0xa0)
+      len = c & 0x1f;
+    else if (c == 0xd9)
+      len = ReadBig(1);
+    else if (c == 0xda)
+      len = ReadBig(2);
+    else if (c == 0xdb)
+      len = ReadBig(4);
+    else {
+      p_--;
+      throw std::invalid_argument("string");
+    }
+    Need(len);
+    std::string_view ret(p_, len);
+    p_ += len;
     return ret;
   }
 
+  // Skips a value, including the contents of arrays and maps.
+  void Skip() {
+    for (uint64_t pending = 1; pending > 0; pending--) {
+      uint8_t c = PeekByte();
+      if (c <= 0x7f || c >= 0xe0 || (c >= 0xc0 && c <= 0xc3)) {
+        p_++;
+      } else if ((c & 0xf0) == 0x80 || c == 0xde || c == 0xdf) {
+        pending += 2 * uint64_t(ReadMapHeader());
+      } else if ((c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd) {
+        pending += ReadArrayHeader();
+      } else if ((c & 0xe0) == 0xa0 || (c >= 0xd9 && c <= 0xdb)) {
+        ReadString();
+      } else {
+        p_++;
+        size_t len;
+        switch (c) {
+          // bin
+          case 0xc4:
+            len = ReadBig(1);
+            break;
+          case 0xc5:
+            len = ReadBig(2);
+            break;
+          case 0xc6:
+            len = ReadBig(4);
+            break;
+          // ext
+          case 0xc7:
+            len = ReadBig(1) + 1;
+            break;
+          case 0xc8:
+            len = ReadBig(2) + 1;
+            break;
+          case 0xc9:
+            len = ReadBig(4) + 1;
+            break;
+          // float, int and fixext
+          case 0xca:
+            len = 4;
+            break;
+          case 0xcb:
+            len = 8;
+            break;
+          case 0xcc:
+          case 0xd0:
+            len = 1;
+            break;
+          case 0xcd:
+          case 0xd1:
+            len = 2;
+            break;
+          case 0xce:
+          case 0xd2:
+            len = 4;
+            break;
+          case 0xcf:
+          case 0xd3:
+            len = 8;
+            break;
+          case 0xd4:
+          case 0xd5:
+          case 0xd6:
+          case 0xd7:
+          case 0xd8:
+            len = 1 + (size_t(1) << (c - 0xd4));
+            break;
+          default:
+            throw std::invalid_argument("value");
+        }
+        Need(len);
+        p_ += len;
+      }
+    }
+  }
+
+  // Returns the tag of member |name|, or -1 if no written object has it.
+  int64_t TagOf(const char* name) {
+    auto it = tags_.find(name);
+    return it == tags_.end() ? -1 : it->second;
+  }
+
+  // Positions |p_| at the value of member |name| of the current object and
+  // returns true, or returns false if there is no such member.
+  bool FindMember(const char* name) {
+    if (objects_.empty())
+      throw std::invalid_argument("object");
+    int64_t tag = TagOf(name);
+    Object& object = objects_.back();
+    if (tag < 0 || object.size == 0)
+      return false;
+    // Look from the member after the previous one to the end of the object,
+    // then from its start. Only a member which is missing or out of order
+    // causes a scan.
+    p_ = object.next;
+    uint32_t index = object.next_index;
+    for (uint32_t n = 0; n < object.size; n++, index++) {
+      if (index == object.size) {
+        p_ = object.begin;
+        index = 0;
+      }
+      bool negative;
+      uint64_t key = ReadInteger(&negative);
+      if (!negative && key == uint64_t(tag)) {
+        object.next_index = index + 1;
+        return true;
+      }
+      Skip();
+    }
+    p_ = object.next;
+    return false;
+  }
+
  public:
-  MessagePackReader(msgpack::unpacker* pk) : pk_(pk) { pk->next(oh_); }
+  // Reads the values in [data, data + size), which must outlive the reader.
+  // Throws std::invalid_argument if there is no name table.
+  MessagePackReader(const char* data, size_t size) {
+    if (size < 4)
+      throw std::invalid_argument("name table");
+    p_ = data + size - 4;
+    end_ = data + size;
+    uint64_t offset = ReadBig(4);
+    if (offset > size - 4)
+      throw std::invalid_argument("name table");
+    p_ = data + offset;
+    end_ = data + size - 4;
+    uint32_t num_names = ReadArrayHeader();
+    for (uint32_t i = 0; i < num_names; i++)
+      tags_.emplace(ReadString(), i);
+    p_ = data;
+    end_ = data + offset;
+  }
   SerializeFormat Format() const override {
     return SerializeFormat::MessagePack;
   }
 
-  bool IsBool() override { return oh_.get().type == msgpack::type::BOOLEAN; }
-  bool IsNull() override { return oh_.get().is_nil(); }
-  bool IsArray() override { return oh_.get().type == msgpack::type::ARRAY; }
+  bool IsBool() override {
+    uint8_t c = PeekByte();
+    return c == 0xc2 || c == 0xc3;
+  }
+  bool IsNull() override { return PeekByte() == 0xc0; }
+  bool IsArray() override {
+    uint8_t c = PeekByte();
+    return (c & 0xf0) == 0x90 || c == 0xdc || c == 0xdd;
+  }
   bool IsInt() override {
-    return oh_.get().type == msgpack::type::POSITIVE_INTEGER ||
-           oh_.get().type == msgpack::type::NEGATIVE_INTEGER;
+    uint8_t c = PeekByte();
+    return c <= 0x7f || c >= 0xe0 || (c >= 0xcc && c <= 0xd3);
   }
   bool IsInt64() override { return IsInt(); }
   bool IsUint64() override { return IsInt(); }
-  bool IsDouble() override { return oh_.get().type == msgpack::type::FLOAT64; };
-  bool IsString() override { return oh_.get().type == msgpack::type::STR; }
+  bool IsDouble() override {
+    uint8_t c = PeekByte();
+    return c == 0xca || c == 0xcb;
+  }
+  bool IsString() override {
+    uint8_t c = PeekByte();
+    return (c & 0xe0) == 0xa0 || (c >= 0xd9 && c <= 0xdb);
+  }
 
-  void GetNull() override { pk_->next(oh_); }
-  bool GetBool() override { return Get<bool>(); }
-  int GetInt() override { return Get<int>(); }
-  uint32_t GetUint32() override { return Get<uint32_t>(); }
-  int64_t GetInt64() override { return Get<int64_t>(); }
-  uint64_t GetUint64() override { return Get<uint64_t>(); }
-  double GetDouble() override { return Get<double>(); }
-  std::string GetString() override { return Get<std::string>(); }
+  void GetNull() override {
+    if (!IsNull())
+      throw std::invalid_argument("null");
+    p_++;
+  }
+  bool GetBool() override {
+    if (!IsBool())
+      throw std::invalid_argument("bool");
+    return *p_++ == char(0xc3);
+  }
+  int GetInt() override { return GetInteger<int>(); }
+  uint32_t GetUint32() override { return GetInteger<uint32_t>(); }
+  int64_t GetInt64() override { return GetInteger<int64_t>(); }
+  uint64_t GetUint64() override { return GetInteger<uint64_t>(); }
+  double GetDouble() override {
+    uint8_t c = PeekByte();
+    if (c == 0xca || c == 0xcb) {
+      p_++;
+      uint64_t bits = ReadBig(c == 0xca ? 4 : 8);
+      if (c == 0xca) {
+        float ret;
+        uint32_t bits32 = uint32_t(bits);
+        memcpy(&ret, &bits32, sizeof(ret));
+        return ret;
+      }
+      double ret;
+      memcpy(&ret, &bits, sizeof(ret));
+      return ret;
+    }
+    bool negative;
+    uint64_t x = ReadInteger(&negative);
+    return negative ? double(int64_t(x)) : double(x);
+  }
+  std::string GetString() override { return std::string(ReadString()); }
+  // The view points into the input, so it stays valid.
+  std::string_view GetStringView() override { return ReadString(); }
 
-  bool HasMember(const char* x) override { return true; }
-  std::unique_ptr<Reader> operator[](const char* x) override { return {}; }
+  bool HasMember(const char* x) override {
+    const char* saved = p_;
+    uint32_t saved_index = objects_.empty() ? 0 : objects_.back().next_index;
+    bool found = FindMember(x);
+    p_ = saved;
+    if (!objects_.empty())
+      objects_.back().next_index = saved_index;
+    return found;
+  }
+  std::unique_ptr<Reader> operator[](const char* x) override {
+    throw std::invalid_argument("random access");
+  }
 
+  // IterArray and DoMember have non-virtual overloads so that callers which
+  // know the reader type can avoid the std::function.
   void IterArray(std::function<void(Reader&)> fn) override {
-    size_t n = Get<size_t>();
-    for (size_t i = 0; i < n; i++)
+    IterArray<decltype(fn)&>(fn);
+  }
+  template <typename Fn>
+  void IterArray(Fn&& fn) {
+    for (uint32_t n = ReadArrayHeader(); n > 0; n--)
       fn(*this);
   }
 
-  void DoMember(const char*, std::function<void(Reader&)> fn) override {
+  void DoMember(const char* name, std::function<void(Reader&)> fn) override {
+    DoMember<decltype(fn)&>(name, fn);
+  }
+  template <typename Fn>
+  void DoMember(const char* name, Fn&& fn) {
+    if (!FindMember(name))
+      return;
+    // |objects_| may be reallocated by |fn|.
+    size_t index = objects_.size() - 1;
     fn(*this);
+    objects_[index].next = p_;
+  }
+
+  void StartObject() override {
+    uint32_t size = ReadMapHeader();
+    objects_.push_back(Object{p_, size, p_, 0});
+  }
+  void EndObject() override {
+    // Skip the members after the last one read.
+    const Object& object = objects_.back();
+    p_ = object.next;
+    for (uint32_t i = object.next_index; i < object.size; i++) {
+      Skip();
+      Skip();
+    }
+    objects_.pop_back();
   }
+  void StartArray() override { ReadArrayHeader(); }
 };
 
-class MessagePackWriter : public Writer {
-  msgpack::packer<msgpack::sbuffer>* m_;
+class MessagePackWriter final : public Writer {
+  using Packer = msgpack::packer<msgpack::sbuffer>;
+
+  struct Frame {
+    bool object;
+    // For objects, the offset of the header in |out_|. For arrays, the size
+    // passed to StartArray.
+    size_t header;
+    // Number of items, or number of members for objects.
+    uint32_t count;
+  };
+
+  msgpack::sbuffer* out_;
+  std::vector<Frame> frames_;
+  // Member names by tag. A deque, since |tags_| refers to the strings.
+  std::deque<std::string> names_;
+  std::unordered_map<std::string_view, uint32_t> tags_;
+
+  Frame* Top() { return frames_.empty() ? nullptr : &frames_.back(); }
+
+  void Pop() {
+    frames_.pop_back();
+    // Object members are counted when their key is written.
+    if (Top() && !Top()->object)
+      Top()->count++;
+  }
+
+  template <typename Fn>
+  void Write(Fn fn) {
+    Packer pk(out_);
+    fn(pk);
+    if (Top() && !Top()->object)
+      Top()->count++;
+  }
+
+  uint32_t TagOf(const char* name) {
+    auto it = tags_.find(name);
+    if (it == tags_.end()) {
+      names_.emplace_back(name);
+      it = tags_.emplace(names_.back(), uint32_t(names_.size() - 1)).first;
+    }
+    return it->second;
+  }
 
  public:
-  MessagePackWriter(msgpack::packer<msgpack::sbuffer>* m) : m_(m) {}
+  MessagePackWriter(msgpack::sbuffer* out) : out_(out) {}
   SerializeFormat Format() const override {
     return SerializeFormat::MessagePack;
   }
 
-  void Null() override { m_->pack_nil(); }
-  void Bool(bool x) override { m_->pack(x); }
-  void Int(int x) override { m_->pack(x); }
-  void Uint32(uint32_t x) override { m_->pack(x); }
-  void Int64(int64_t x) override { m_->pack(x); }
-  void Uint64(uint64_t x) override { m_->pack(x); }
-  void Double(double x) override { m_->pack(x); }
-  void String(const char* x) override { m_->pack(x); }
-  // TODO Remove std::string
+  // Writes the member name table. Must be called once, after every value has
+  // been written.
+  void Finish() {
+    assert(frames_.empty());
+    size_t offset = out_->size();
+    Packer pk(out_);
+    pk.pack_array(uint32_t(names_.size()));
+    for (const std::string& name : names_) {
+      pk.pack_str(uint32_t(name.size()));
+      pk.pack_str_body(name.data(), uint32_t(name.size()));
+    }
+    char trailer[4];
+    for (int i = 0; i < 4; i++)
+      trailer[i] = char(uint32_t(offset) >> (24 - 8 * i));
+    out_->write(trailer, sizeof(trailer));
+  }
+
+  void Null() override {
+    Write([](Packer& pk) { pk.pack_nil(); });
+  }
+  void Bool(bool x) override {
+    Write([&](Packer& pk) { pk.pack(x); });
+  }
+  void Int(int x) override {
+    Write([&](Packer& pk) { pk.pack(x); });
+  }
+  void Uint32(uint32_t x) override {
+    Write([&](Packer& pk) { pk.pack(x); });
+  }
+  void Int64(int64_t x) override {
+    Write([&](Packer& pk) { pk.pack(x); });
+  }
+  void Uint64(uint64_t x) override {
+    Write([&](Packer& pk) { pk.pack(x); });
+  }
+  void Double(double x) override {
+    Write([&](Packer& pk) { pk.pack(x); });
+  }
+  void String(const char* x) override { String(x, strlen(x)); }
   void String(const char* x, size_t len) override {
-    m_->pack(std::string(x, len));
+    Write([&](Packer& pk) {
+      pk.pack_str(uint32_t(len));
+      pk.pack_str_body(x, uint32_t(len));
+    });
+  }
+  // |size| must be the number of items which are written.
+  void StartArray(size_t size) override {
+    Packer(out_).pack_array(uint32_t(size));
+    frames_.push_back(Frame{false, size, 0});
+  }
+  void EndArray() override {
+    assert(Top()->count == Top()->header && "StartArray size mismatch");
+    Pop();
+  }
+  // The number of members is not known until the object is closed, so a
+  // fixmap header is written and widened if there are more than 15 members.
+  void StartObject() override {
+    frames_.push_back(Frame{true, out_->size(), 0});
+    char header = char(0x80);
+    out_->write(&header, 1);
+  }
+  void EndObject() override {
+    const Frame& frame = frames_.back();
+    char* data = out_->data();
+    if (frame.count <= 15) {
+      data[frame.header] = char(0x80 | frame.count);
+    } else {
+      size_t width = frame.count <= 0xffff ? 2 : 4;
+      size_t body = frame.header + 1;
+      size_t body_size = out_->size() - body;
+      out_->write("\0\0\0\0", width);
+      data = out_->data();
+      memmove(data + body + width, data + body, body_size);
+      data[frame.header] = char(width == 2 ? 0xde : 0xdf);
+      for (size_t i = 0; i < width; i++)
+        data[body + i] = char(frame.count >> (8 * (width - 1 - i)));
+    }
+    Pop();
+  }
+  void Key(const char* name) override {
+    assert(Top() && Top()->object);
+    Top()->count++;
+    Packer(out_).pack(TagOf(name));
   }
-  void StartArray(size_t n) override { m_->pack(n); }
-  void EndArray() override {}
-  void StartObject() override {}
-  void EndObject() override {}
-  void Key(const char* name) override {}
 };
@@ -0,0 +1,146 @@
+#include "trigram_index.h"
+
+#include <doctest/doctest.h>
+
+#include <ctype.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+
+namespace {
+// The index is rebuilt once there are at least this many stale symbols and
+// they are more than a quarter of the indexed symbols.
+constexpr size_t kMinStaleForRebuild = 1024;
+
+// Returns the distinct case-folded trigrams of |s|.
+std::vector<uint32_t> GetTrigrams(std::string_view s) {
+  std::vector<uint32_t> ret;
+  if (s.size() < 3)
+    return ret;
+  ret.reserve(s.size() - 2);
+  uint32_t t = uint32_t(uint8_t(tolower(s[0]))) << 8 | uint8_t(tolower(s[1]));
+  for (size_t i = 2; i < s.size(); i++) {
+    t = (t << 8 | uint8_t(tolower(s[i]))) & 0xffffff;
+    ret.push_back(t);
+  }
+  std::sort(ret.begin(), ret.end());
+  ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+  return ret;
+}
+}  // namespace
+
+void TrigramIndex::Update(size_t symbol_idx, std::string_view name) {
+  if (name.empty()) {
+    Remove(symbol_idx);
+    return;
+  }
+  size_t hash = std::hash<std::string_view>()(name);
+  if (!hash)
+    hash = 1;
+  if (symbol_idx >= name_hashes_.size())
+    name_hashes_.resize(symbol_idx + 1);
+  if (name_hashes_[symbol_idx] == hash)
+    return;
+  if (name_hashes_[symbol_idx])
+    num_stale_++;
+  else
+    num_indexed_++;
+  name_hashes_[symbol_idx] = hash;
+
+  uint32_t idx = uint32_t(symbol_idx);
+  for (uint32_t t : GetTrigrams(name)) {
+    std::vector<uint32_t>& posting = postings_[t];
+    // Symbols are usually indexed in increasing order.
+    if (posting.empty() || posting.back() < idx) {
+      posting.push_back(idx);
+    } else {
+      auto it = std::lower_bound(posting.begin(), posting.end(), idx);
+      if (*it != idx)
+        posting.insert(it, idx);
+    }
+  }
+}
+
+void TrigramIndex::Remove(size_t symbol_idx) {
+  if (symbol_idx >= name_hashes_.size() || !name_hashes_[symbol_idx])
+    return;
+  name_hashes_[symbol_idx] = 0;
+  num_indexed_--;
+  num_stale_++;
+}
+
+bool TrigramIndex::Candidates(std::string_view query,
+                              std::vector<uint32_t>* candidates) const {
+  std::vector<uint32_t> trigrams = GetTrigrams(query);
+  if (trigrams.empty())
+    return false;
+
+  candidates->clear();
+  std::vector<const std::vector<uint32_t>*> postings;
+  for (uint32_t t : trigrams) {
+    auto it = postings_.find(t);
+    if (it == postings_.end())
+      return true;
+    postings.push_back(&it->second);
+  }
+  // Intersect the shortest postings first to keep intermediate results small.
+  std::sort(postings.begin(), postings.end(),
+            [](const std::vector<uint32_t>* a, const std::vector<uint32_t>* b) {
+              return a->size() < b->size();
+            });
+  *candidates = *postings[0];
+  std::vector<uint32_t> intersection;
+  for (size_t i = 1; i < postings.size() && candidates->size(); i++) {
+    intersection.clear();
+    std::set_intersection(candidates->begin(), candidates->end(),
+                          postings[i]->begin(), postings[i]->end(),
+                          std::back_inserter(intersection));
+    candidates->swap(intersection);
+  }
+  // Drop symbols which have been removed since they were indexed.
+  candidates->erase(
+      std::remove_if(candidates->begin(), candidates->end(),
+                     [&](uint32_t idx) { return !name_hashes_[idx]; }),
+      candidates->end());
+  return true;
+}
+
+bool TrigramIndex::NeedsRebuild() const {
+  return num_stale_ >= kMinStaleForRebuild && num_stale_ * 4 > num_indexed_;
+}
+
+void TrigramIndex::Clear() {
+  name_hashes_.clear();
+  postings_.clear();
+  num_indexed_ = 0;
+  num_stale_ = 0;
+}
+
+TEST_SUITE("TrigramIndex") {
+  TEST_CASE("candidates") {
+    TrigramIndex index;
+    index.Update(0, "ns::Foobar");
+    index.Update(1, "ns::foo");
+    index.Update(2, "Bar");
+
+    std::vector<uint32_t> candidates;
+    REQUIRE(!index.Candidates("fo", &candidates));
+    REQUIRE(index.Candidates("FOO", &candidates));
+    REQUIRE(candidates == std::vector<uint32_t>({0, 1}));
+    REQUIRE(index.Candidates("bar", &candidates));
+    REQUIRE(candidates == std::vector<uint32_t>({0, 2}));
+    REQUIRE(index.Candidates("obar", &candidates));
+    REQUIRE(candidates == std::vector<uint32_t>({0}));
+    REQUIRE(index.Candidates("baz", &candidates));
+    REQUIRE(candidates.empty());
+
+    // Renamed symbols are found by their new name, and remain candidates for
+    // their old name until the index is rebuilt. Removed symbols are dropped.
+    index.Update(0, "Baz");
+    index.Remove(1);
+    REQUIRE(index.Candidates("baz", &candidates));
+    REQUIRE(candidates == std::vector<uint32_t>({0}));
+    REQUIRE(index.Candidates("foo", &candidates));
+    REQUIRE(candidates == std::vector<uint32_t>({0}));
+  }
+}
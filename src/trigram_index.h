@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string_view.h>
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+// Maps case-folded trigrams to the symbols whose names contain them, so that
+// substring queries only need to look at a small set of candidates instead of
+// every symbol.
+//
+// The index is maintained incrementally. When a symbol is renamed or removed
+// its old postings are left in place and only filtered out by callers, which
+// must verify every candidate against the current name. Once enough postings
+// are stale NeedsRebuild() returns true and the owner should Clear() and
+// re-add every symbol.
+class TrigramIndex {
+ public:
+  // Indexes |name| as the name of |symbol_idx|. Does nothing if |symbol_idx|
+  // is already indexed with the same name.
+  void Update(size_t symbol_idx, std::string_view name);
+  // Forgets the name of |symbol_idx|.
+  void Remove(size_t symbol_idx);
+
+  // Returns false if |query| is too short to be looked up, in which case every
+  // symbol is a candidate. Otherwise, sets |candidates| to the sorted symbol
+  // indices whose names may contain |query|, ignoring case.
+  bool Candidates(std::string_view query,
+                  std::vector<uint32_t>* candidates) const;
+
+  bool NeedsRebuild() const;
+  void Clear();
+
+ private:
+  // Hash of the name each symbol is indexed with, or 0 if it is not indexed.
+  std::vector<size_t> name_hashes_;
+  // Sorted symbol indices for every trigram.
+  std::unordered_map<uint32_t, std::vector<uint32_t>> postings_;
+  size_t num_indexed_ = 0;
+  // Number of renamed or removed symbols whose old postings are still present.
+  size_t num_stale_ = 0;
+};
@@ -94,6 +94,13 @@ bool StartsWithAny(const std::string& value,
                      });
 }
 
+bool StartsWithDirectory(std::string_view path, std::string_view directory) {
+  if (!StartsWith(path, directory))
+    return false;
+  return directory.empty() || directory.back() == '/' ||
+         path.size() == directory.size() || path[directory.size()] == '/';
+}
+
 bool EndsWithAny(const std::string& value,
                  const std::vector<std::string>& endings) {
   return std::any_of(
@@ -476,14 +483,38 @@ bool IsDirectory(const std::string& path) {
   return path_stat.st_mode & S_IFDIR;
 }
 
-size_t HashArguments(const std::vector<std::string>& args) {
+size_t HashArguments(const std::vector<std::string>& args,
+                     const std::string& project_root) {
   auto is_file = [](const std::string& arg) {
     return EndsWithAny(arg, {".h", ".c", ".cc", ".cpp", ".hpp", ".m", ".mm"});
   };
+  std::string root = project_root;
+  if (root.size() && root.back() == '/')
+    root.pop_back();
+  // Removes |root| wherever it names the directory itself, and not a sibling
+  // such as "/a/wt10" for "/a/wt1".
+  auto remove_root = [&root](const std::string& arg) {
+    std::string result;
+    size_t pos = 0;
+    for (size_t found; (found = arg.find(root, pos)) != std::string::npos;) {
+      if (StartsWithDirectory(std::string_view(arg).substr(found), root)) {
+        result.append(arg, pos, found - pos);
+        pos = found + root.size();
+      } else {
+        result.append(arg, pos, found + 1 - pos);
+        pos = found + 1;
+      }
+    }
+    result.append(arg, pos, std::string::npos);
+    return result;
+  };
   size_t hash = 0;
   for (auto it = args.begin(); it != args.end(); it++) {
     if (!is_file(*it)) {
-      hash_combine(hash, *it);
+      if (root.empty())
+        hash_combine(hash, *it);
+      else
+        hash_combine(hash, remove_root(*it));
     }
   }
   return hash;
@@ -508,6 +539,34 @@ TEST_SUITE("AbsolutePath") {
   }
 }
 
+TEST_SUITE("HashArguments") {
+  TEST_CASE("project root is ignored") {
+    REQUIRE(HashArguments({"-I/a/wt1/include", "/a/wt1/foo.cc"}, "/a/wt1/") ==
+            HashArguments({"-I/a/wt2/include", "/a/wt2/foo.cc"}, "/a/wt2/"));
+    REQUIRE(HashArguments({"-I/a/wt1/include"}) !=
+            HashArguments({"-I/a/wt2/include"}));
+  }
+
+  TEST_CASE("sibling of the project root is kept") {
+    REQUIRE(HashArguments({"-I/a/wt1"}, "/a/wt1") ==
+            HashArguments({"-I/a/wt2"}, "/a/wt2"));
+    REQUIRE(HashArguments({"-I/a/wt10/include"}, "/a/wt1/") !=
+            HashArguments({"-I/a/wt20/include"}, "/a/wt2/"));
+    REQUIRE(HashArguments({"-I/a/wt10/include"}, "/a/wt1/") !=
+            HashArguments({"-I0/include"}, "/a/wt1/"));
+  }
+}
+
+TEST_SUITE("StartsWithDirectory") {
+  TEST_CASE("all") {
+    REQUIRE(StartsWithDirectory("/a/b", "/a/b"));
+    REQUIRE(StartsWithDirectory("/a/b/c", "/a/b"));
+    REQUIRE(StartsWithDirectory("/a/b/c", "/a/b/"));
+    REQUIRE(!StartsWithDirectory("/a/bc", "/a/b"));
+    REQUIRE(!StartsWithDirectory("/a/b", "/a/b/"));
+  }
+}
+
 TEST_SUITE("GetDirName") {
   TEST_CASE("all") {
     REQUIRE(GetDirName("") == "./");
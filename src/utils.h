@@ -31,6 +31,9 @@ bool StartsWithAny(const std::string& value,
                    const std::vector<std::string>& startings);
 bool EndsWithAny(const std::string& value,
                  const std::vector<std::string>& endings);
+// Returns true if |path| is |directory| or is inside of it, so "/a/b" is not
+// inside "/a/bc". |directory| may end in '/'.
+bool StartsWithDirectory(std::string_view path, std::string_view directory);
 bool FindAnyPartial(const std::string& value,
                     const std::vector<std::string>& values);
 // Returns the dirname of |path|, i.e. "foo/bar.cc" => "foo/", "foo" => "./",
@@ -146,4 +149,8 @@ bool IsWindowsAbsolutePath(const std::string& path);
 
 bool IsDirectory(const std::string& path);
 
-size_t HashArguments(const std::vector<std::string>& args);
\ No newline at end of file
+// Hashes the arguments which affect how a file is indexed. If |project_root|
+// is not empty it is removed from the arguments first, so checkouts of the
+// same project in different directories hash equally.
+size_t HashArguments(const std::vector<std::string>& args,
+                     const std::string& project_root = "");
\ No newline at end of file
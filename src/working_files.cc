@@ -7,6 +7,7 @@
 #include <loguru.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <climits>
 #include <numeric>
 
@@ -19,23 +20,23 @@ constexpr int kMaxDiff = 20;
 // |kMaxColumnAlignSize|.
 constexpr int kMaxColumnAlignSize = 200;
 
-lsPosition GetPositionForOffset(const std::string& content, int offset) {
-  if (offset >= content.size())
-    offset = (int)content.size() - 1;
+// Returns the text of the line from |start| to the next newline or the end of
+// |content|, without the newline and a trailing '\r', like ToLines.
+std::string GetLineAt(const std::string& content, int start, int end) {
+  if (end > start && content[end - 1] == '\n')
+    end--;
+  if (end > start && content[end - 1] == '\r')
+    end--;
+  return content.substr(start, end - start);
+}
 
-  lsPosition result;
-  int i = 0;
-  while (i < offset) {
-    if (content[i] == '\n') {
-      result.line += 1;
-      result.character = 0;
-    } else {
-      result.character += 1;
-    }
-    ++i;
-  }
+bool IsIdentifierChar(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
 
-  return result;
+int64_t NextEditGeneration() {
+  static std::atomic<int64_t> generation{0};
+  return ++generation;
 }
 
 // Computes the edit distance of strings [a,a+la) and [b,b+lb) with Eugene W.
@@ -222,12 +223,122 @@ void WorkingFile::SetIndexContent(const std::string& index_content) {
 }
 
 void WorkingFile::OnBufferContentUpdated() {
+  edit_generation = NextEditGeneration();
+  typed_identifier_start = -1;
   buffer_lines = ToLines(buffer_content, false /*trim_whitespace*/);
+  buffer_line_starts = {0};
+  for (int i = 0; i < int(buffer_content.size()); i++)
+    if (buffer_content[i] == '\n')
+      buffer_line_starts.push_back(i + 1);
+
+  index_to_buffer.clear();
+  buffer_to_index.clear();
+}
+
+void WorkingFile::ApplyBufferEdit(int start_offset,
+                                  int end_offset,
+                                  const std::string& text) {
+  auto line_of = [&](int offset) {
+    return int(std::upper_bound(buffer_line_starts.begin(),
+                                buffer_line_starts.end(), offset) -
+               buffer_line_starts.begin()) -
+           1;
+  };
+  // Typing or erasing characters of an identifier only keeps the generation
+  // if the identifier starts where the previous edit left off, so that the
+  // first character typed after "foo." or "::" keeps it too.
+  bool is_identifier_edit =
+      std::all_of(text.begin(), text.end(), IsIdentifierChar) &&
+      std::all_of(buffer_content.begin() + start_offset,
+                  buffer_content.begin() + end_offset, IsIdentifierChar);
+  int identifier_start = start_offset;
+  while (identifier_start > 0 &&
+         IsIdentifierChar(buffer_content[identifier_start - 1]))
+    identifier_start--;
+  if (!is_identifier_edit || identifier_start != typed_identifier_start)
+    edit_generation = NextEditGeneration();
+  typed_identifier_start = is_identifier_edit
+                               ? identifier_start
+                               : start_offset + int(text.size());
+
+  // Lines [first_line, last_line] are replaced.
+  int first_line = line_of(start_offset);
+  int last_line = line_of(end_offset);
+  size_t old_num_lines = buffer_lines.size();
+
+  buffer_content.replace(start_offset, end_offset - start_offset, text);
+
+  // Starts after the edit move by the change in size, and the newlines in
+  // |text| start new lines.
+  int delta = int(text.size()) - (end_offset - start_offset);
+  for (size_t i = last_line + 1; i < buffer_line_starts.size(); i++)
+    buffer_line_starts[i] += delta;
+  std::vector<int> new_starts;
+  for (int i = 0; i < int(text.size()); i++)
+    if (text[i] == '\n')
+      new_starts.push_back(start_offset + i + 1);
+  buffer_line_starts.erase(buffer_line_starts.begin() + first_line + 1,
+                           buffer_line_starts.begin() + last_line + 1);
+  buffer_line_starts.insert(buffer_line_starts.begin() + first_line + 1,
+                            new_starts.begin(), new_starts.end());
+
+  // Split lines [first_line, new_last_line] again. The last line is missing
+  // from |buffer_lines| if it is empty, which only changes if it is one of
+  // the edited lines.
+  int new_last_line = first_line + int(new_starts.size());
+  size_t num_lines = buffer_line_starts.size();
+  if (buffer_line_starts.back() == int(buffer_content.size()))
+    num_lines--;
+  std::vector<std::string> lines;
+  for (int i = first_line; i <= new_last_line && i < int(num_lines); i++) {
+    int end = i + 1 < int(buffer_line_starts.size())
+                  ? buffer_line_starts[i + 1]
+                  : int(buffer_content.size());
+    lines.push_back(GetLineAt(buffer_content, buffer_line_starts[i], end));
+  }
+  auto first =
+      buffer_lines.begin() + std::min(size_t(first_line), old_num_lines);
+  auto last =
+      buffer_lines.begin() + std::min(size_t(last_line) + 1, old_num_lines);
+  // Assign to the existing strings where possible, so that the following
+  // lines only move if the number of lines changes.
+  size_t num_assigned = std::min(size_t(last - first), lines.size());
+  for (size_t i = 0; i < num_assigned; i++)
+    first[i] = std::move(lines[i]);
+  first += num_assigned;
+  if (first != last) {
+    buffer_lines.erase(first, last);
+  } else {
+    buffer_lines.insert(first,
+                        std::make_move_iterator(lines.begin() + num_assigned),
+                        std::make_move_iterator(lines.end()));
+  }
 
   index_to_buffer.clear();
   buffer_to_index.clear();
 }
 
+int WorkingFile::GetBufferOffset(lsPosition position) const {
+  if (position.line >= int(buffer_line_starts.size()))
+    return int(buffer_content.size());
+  int start = buffer_line_starts[std::max(0, position.line)];
+  return start + GetOffsetForPosition(
+                     lsPosition(0, position.character),
+                     std::string_view(buffer_content).substr(start));
+}
+
+lsPosition WorkingFile::GetBufferPosition(int offset) const {
+  if (offset >= int(buffer_content.size()))
+    offset = int(buffer_content.size()) - 1;
+  if (offset <= 0)
+    return lsPosition();
+  int line = int(std::upper_bound(buffer_line_starts.begin(),
+                                  buffer_line_starts.end(), offset) -
+                 buffer_line_starts.begin()) -
+             1;
+  return lsPosition(line, offset - buffer_line_starts[line]);
+}
+
 // Variant of Paul Heckel's diff algorithm to compute |index_to_buffer| and
 // |buffer_to_index|.
 // The core idea is that if a line is unique in both index and buffer,
@@ -361,7 +472,7 @@ std::string WorkingFile::FindClosestCallNameInBuffer(
     lsPosition* completion_position) const {
   *active_parameter = 0;
 
-  int offset = GetOffsetForPosition(position, buffer_content);
+  int offset = GetBufferOffset(position);
 
   // If vscode auto-inserts closing ')' we will begin on ')' token in foo()
   // which will make the below algorithm think it's a nested call.
@@ -399,7 +510,7 @@ std::string WorkingFile::FindClosestCallNameInBuffer(
   }
 
   if (completion_position)
-    *completion_position = GetPositionForOffset(buffer_content, offset);
+    *completion_position = GetBufferPosition(offset);
 
   return buffer_content.substr(offset, start_offset - offset + 1);
 }
@@ -411,7 +522,7 @@ lsPosition WorkingFile::FindStableCompletionSource(
     lsPosition* replace_end_position) const {
   *is_global_completion = true;
 
-  int start_offset = GetOffsetForPosition(position, buffer_content);
+  int start_offset = GetBufferOffset(position);
   int offset = start_offset;
 
   while (offset > 0) {
@@ -446,7 +557,7 @@ lsPosition WorkingFile::FindStableCompletionSource(
   }
 
   *existing_completion = buffer_content.substr(offset, start_offset - offset);
-  return GetPositionForOffset(buffer_content, offset);
+  return GetBufferPosition(offset);
 }
 
 WorkingFile* WorkingFiles::GetFileByFilename(const AbsolutePath& filename) {
@@ -515,16 +626,12 @@ void WorkingFiles::OnChange(const lsTextDocumentDidChangeParams& change) {
       file->buffer_content = diff.text;
       file->OnBufferContentUpdated();
     } else {
-      int start_offset =
-          GetOffsetForPosition(diff.range->start, file->buffer_content);
+      int start_offset = file->GetBufferOffset(diff.range->start);
       // Ignore TextDocumentContentChangeEvent.rangeLength which causes trouble
       // when UTF-16 surrogate pairs are used.
       int end_offset =
-          GetOffsetForPosition(diff.range->end, file->buffer_content);
-      file->buffer_content.replace(file->buffer_content.begin() + start_offset,
-                                   file->buffer_content.begin() + end_offset,
-                                   diff.text);
-      file->OnBufferContentUpdated();
+          std::max(start_offset, file->GetBufferOffset(diff.range->end));
+      file->ApplyBufferEdit(start_offset, end_offset, diff.text);
     }
   }
 }
@@ -678,4 +785,59 @@ TEST_SUITE("WorkingFile") {
     REQUIRE(end_pos.line == CharPos(f, ' ').line);
     REQUIRE(end_pos.character == CharPos(f, ' ').character);
   }
+
+  TEST_CASE("incremental edits") {
+    WorkingFile f(AbsolutePath::BuildDoNotUse("foo.cc"), "ab\r\ncd\nef\n");
+    auto check = [&]() {
+      REQUIRE(f.buffer_lines ==
+              ToLines(f.buffer_content, false /*trim_whitespace*/));
+      for (int line = 0; line < 6; line++)
+        for (int character = 0; character < 4; character++) {
+          lsPosition position(line, character);
+          REQUIRE(f.GetBufferOffset(position) ==
+                  GetOffsetForPosition(position, f.buffer_content));
+        }
+    };
+    f.ApplyBufferEdit(1, 1, "x\ny");
+    REQUIRE(f.buffer_content == "ax\nyb\r\ncd\nef\n");
+    check();
+    // Joins lines.
+    f.ApplyBufferEdit(3, 8, "");
+    REQUIRE(f.buffer_content == "ax\nd\nef\n");
+    check();
+    // Removes the trailing newline, then appends at the end.
+    f.ApplyBufferEdit(7, 8, "");
+    check();
+    f.ApplyBufferEdit(7, 7, "\r\n\ng");
+    REQUIRE(f.buffer_content == "ax\nd\nef\r\n\ng");
+    check();
+    REQUIRE(f.GetBufferPosition(8).line == 2);
+    REQUIRE(f.GetBufferPosition(8).character == 3);
+    REQUIRE(f.GetBufferPosition(11).line == 4);
+    REQUIRE(f.GetBufferPosition(11).character == 0);
+  }
+
+  TEST_CASE("edit generation") {
+    WorkingFile f(AbsolutePath::BuildDoNotUse("foo.cc"), "a;\nb;\n");
+    int64_t generation = f.edit_generation;
+    // Typing "." starts a new identifier after it.
+    f.ApplyBufferEdit(4, 4, ".");
+    REQUIRE(f.edit_generation != generation);
+    generation = f.edit_generation;
+    // Typing and erasing characters of that identifier keeps the generation.
+    f.ApplyBufferEdit(5, 5, "f");
+    f.ApplyBufferEdit(6, 6, "oo");
+    f.ApplyBufferEdit(7, 8, "");
+    REQUIRE(f.buffer_content == "a;\nb.fo;\n");
+    REQUIRE(f.edit_generation == generation);
+    // Other edits change it, even identifier edits elsewhere.
+    f.ApplyBufferEdit(1, 1, "x");
+    REQUIRE(f.edit_generation != generation);
+    generation = f.edit_generation;
+    f.ApplyBufferEdit(8, 8, ",");
+    REQUIRE(f.edit_generation != generation);
+    generation = f.edit_generation;
+    f.OnBufferContentUpdated();
+    REQUIRE(f.edit_generation != generation);
+  }
 }
@@ -18,6 +18,17 @@ struct WorkingFile {
   std::vector<std::string> index_lines;
   // Note: This assumes 0-based lines (1-based lines are normally assumed).
   std::vector<std::string> buffer_lines;
+  // Offsets in |buffer_content| at which each line starts, ie, 0 and one past
+  // every '\n'. If |buffer_content| ends with a newline, the last entry is
+  // the empty line after it, which |buffer_lines| does not contain.
+  std::vector<int> buffer_line_starts;
+  // Changes on every edit of |buffer_content| except those which only type or
+  // erase characters of the identifier being typed. Values are unique across
+  // files, so results computed for a buffer can be keyed by it.
+  int64_t edit_generation = 0;
+  // Offset at which an identifier edit has to start its identifier to keep
+  // |edit_generation|, ie, the start of the identifier being typed.
+  int typed_identifier_start = -1;
   // Mappings between index line number and buffer line number.
   // Empty indicates either buffer or index has been changed and re-computation
   // is required.
@@ -37,6 +48,19 @@ struct WorkingFile {
   void SetIndexContent(const std::string& index_content);
   // This should be called whenever |buffer_content| has changed.
   void OnBufferContentUpdated();
+  // Replaces [start_offset, end_offset) of |buffer_content| with |text|. Only
+  // the lines touched by the edit are split again, so this is much cheaper
+  // than changing |buffer_content| and calling OnBufferContentUpdated.
+  void ApplyBufferEdit(int start_offset,
+                       int end_offset,
+                       const std::string& text);
+
+  // Same as GetOffsetForPosition on |buffer_content|, but only scans the line
+  // of |position|.
+  int GetBufferOffset(lsPosition position) const;
+  // Returns the position of |offset| in |buffer_content|, counting bytes as
+  // characters.
+  lsPosition GetBufferPosition(int offset) const;
 
   // Finds the buffer line number which maps to index line number |line|.
   // Also resolves |column| if not NULL.